@@ -0,0 +1,77 @@
+#!/bin/bash
+# origin/sld/*.sld をそれぞれ数回描画し、シーンと解像度ごとに
+# 時間の中央値、光線数/秒、最大常駐メモリ、出力のチェックサムを CSV に書く
+#
+# usage: bench.sh [-b binary] [-n runs] [-s WxH,WxH...] [-o out.csv] [-g golden_dir] [-u] [-- min-rt options]
+#   -b  計測する min-rt (既定 ./min-rt-bench)
+#   -n  1つのシーンを描画する回数 (既定 5)
+#   -s  解像度のリスト (既定 128x128)
+#   -o  結果の CSV (既定 bench.csv)
+#   -g  正解画像の置き場 (既定 test/golden)
+#   -u  出力を正解画像として保存する (比較はしない)
+#   --  以降は min-rt にそのまま渡す
+# 正解画像と異なる出力があれば終了コード 1 を返す
+bin=./min-rt-bench
+runs=5
+sizes=128x128
+csv=bench.csv
+golden=test/golden
+update=0
+while [ $# -gt 0 ]; do
+    case "$1" in
+        -b) bin="$2"; shift 2 ;;
+        -n) runs="$2"; shift 2 ;;
+        -s) sizes="$2"; shift 2 ;;
+        -o) csv="$2"; shift 2 ;;
+        -g) golden="$2"; shift 2 ;;
+        -u) update=1; shift ;;
+        --) shift; break ;;
+        *) sed -n '5,13s/^# \{0,1\}//p' "$0" >&2; exit 2 ;;
+    esac
+done
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+mkdir -p "$golden"
+bad=0
+
+echo "scene,width,height,runs,median_wall_s,rays,rays_per_s,peak_rss_kb,cksum,golden" > "$csv"
+for size in ${sizes//,/ }; do
+    w=${size%x*}
+    h=${size#*x}
+    for i in ./origin/sld/*.sld; do
+        g=$(basename "$i" .sld)
+        : > "$tmp/walls"
+        rss=0
+        for k in $(seq "$runs"); do
+            if ! "$bin" -bench -p6 -w "$w" -h "$h" -i "$i" -o "$tmp/out.ppm" "$@" 2> "$tmp/err"; then
+                echo "$g ${w}x${h}: min-rt failed" >&2
+                cat "$tmp/err" >&2
+                exit 1
+            fi
+            # wall 0.051 s, 341538 rays, 6662522 rays/s
+            awk '/^wall / { print $2 }' "$tmp/err" >> "$tmp/walls"
+            rays=$(awk '/^wall / { print $4 }' "$tmp/err")
+            r=$(awk '/^peak rss / { print $3 }' "$tmp/err")
+            [ "$r" -gt "$rss" ] && rss=$r
+        done
+        wall=$(sort -g "$tmp/walls" | awk '{ v[NR] = $1 } END { print (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }')
+        rps=$(awk -v n="$rays" -v t="$wall" 'BEGIN { printf "%.0f", (t > 0) ? n / t : 0 }')
+        sum=$(cksum < "$tmp/out.ppm" | awk '{ print $1 }')
+        ref="$golden/$g-${w}x${h}.ppm"
+        if [ $update = 1 ]; then
+            cp "$tmp/out.ppm" "$ref"
+            status=saved
+        elif [ ! -f "$ref" ]; then
+            status=missing
+        elif cmp -s "$tmp/out.ppm" "$ref"; then
+            status=ok
+        else
+            status=DIFF
+            bad=1
+        fi
+        echo "$g,$w,$h,$runs,$wall,$rays,$rps,$rss,$sum,$status" >> "$csv"
+        printf "%-12s %5dx%-5d %8.3f s %11s rays/s %7s KB  %s\n" "$g" "$w" "$h" "$wall" "$rps" "$rss" "$status"
+    done
+done
+exit $bad
@@ -11,12 +11,22 @@
 /*                                                              */
 /****************************************************************/
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "sld.h"
 
 typedef struct {
   double x, y, z;
@@ -33,24 +43,32 @@ typedef struct {
   bool   invert;
   double  surfparams[2];
   vec_t  color, rot123;
-  vec4_t ctbl;
 } obj_t;
 
+/* ピクセル列の反射ごとの情報。各配列は [反射回数][ピクセル番号] の順に並び、
+   同じ反射回数の値が n 個連続する。反射回数は 0 から depth-1 まで */
 typedef struct {
-  vec_t   rgb;
+  int     n;
+  int     depth;
   vec_t  *isect_ps;
   int    *sids;
   int    *cdif;
   vec_t  *engy;
   vec_t  *r20p;
-  int     gid;
   vec_t  *nvectors;
+} pixel_block_t;
+
+typedef struct {
+  vec_t   rgb;
+  int     gid;
+  int     x;    /* blk の中での番号 */
+  pixel_block_t *blk;
 } pixel_t;
 
 
 typedef struct {
   vec_t   vec;
-  double *cnst[120]; /* cnstの各要素は定数の配列(長さ4~6でオブジェクトの形による) */
+  double *cnst; /* 定数テーブル置き場の中の、この方向ベクトル用の領域 */
 } dvec_t;
 
 typedef struct {
@@ -59,94 +77,333 @@ typedef struct {
   double br;
 } refl_t;
 
+/* OR 行列に現れる AND グループ1つ分の包含箱 */
+typedef struct {
+  int    row;        /* OR 行列の行番号 */
+  int   *and_group;
+  vec_t  lo, hi;     /* 無限に広がる軸は ±HUGE_VAL */
+} bvh_item_t;
+
+typedef struct {
+  vec_t  lo, hi;
+  int    child;      /* 内部節点なら左の子 (右の子は child + 1)、葉なら index の添字 */
+  int    n;          /* 葉なら 1、内部節点なら 0 */
+} bvh_node_t;
+
+typedef struct {
+  /* items は OR 行列を先頭から辿った順に並べる */
+  int          n_items;
+  bvh_item_t  *items;
+  int          n_nodes;
+  bvh_node_t  *nodes;       /* 葉は要素を1つだけ持つ */
+  /* 葉から items への添字 */
+  int         *index;
+  /* どこかの軸に無限に広がる要素は木に入れず、個別に判定する */
+  int          n_unbounded;
+  int         *unbounded;
+} bvh_t;
+
+/* BVH の探索で見つかった候補 */
+typedef struct {
+  int    id;         /* items の添字 */
+  double tnear;      /* 光線が包含箱に入る t */
+} bvh_hit_t;
+
+/* 影の格子のセル1つ分の、影になり始める深さ (速い版だけで使う) */
+typedef struct {
+  double depth;      /* セルの中心を通る直線上で影になり始める深さ */
+  double du, dv;     /* depth の u, v 方向の傾き */
+  int    kind;       /* LIGHT_CELL_* */
+} light_cell_t;
+
+/* 放射照度キャッシュの記録1つ分 */
+typedef struct {
+  vec_t  pos, nvector;
+  vec_t  irr;        /* 300本の方向ベクトルで求めた間接受光 (diffuse_ray) */
+  double radius;     /* 間接光の光線が当たった物体までの距離の調和平均 */
+} irr_record_t;
+
+/* 放射照度キャッシュのハッシュ表の登録1つ分 */
+typedef struct {
+  int key[3];        /* セルの座標 */
+  int record;        /* records の添字 */
+  int next;          /* 同じハッシュ値の次の登録 (-1 なら終わり) */
+} irr_entry_t;
 
-/**************** グローバル変数の宣言 ****************/
+/* 放射照度キャッシュ (create_irr_cache で作る)。記録は、それを使える範囲と
+   重なる格子のセルすべてに登録しておき、点の属するセルの登録だけを調べる */
+typedef struct {
+  double  error;     /* 許容誤差 a。記録 i を点 p, 法線 n に使えるのは
+                        |p - p_i| / R_i + sqrt(1 - n・n_i) < a のとき */
+  double  cell;      /* セルの幅 (= a * IRR_MAX_RADIUS) */
+  int     n_records, cap_records;
+  irr_record_t *records;
+  int    *buckets;   /* ハッシュ値ごとの最初の登録 (-1 なら無し) */
+  int     n_entries, cap_entries;
+  irr_entry_t *entries;
+  unsigned scene;    /* 記録を求めたシーンの scene_hash (ファイルに書く) */
+  bool    moved;     /* 真なら物体を動かした後の記録で、ファイルには書かない */
+  /* 探すときは読み込みロック、加えるときは書き込みロックを取る。
+     探すのは加えるよりずっと多いので、スレッド同士はほとんど待たない */
+  pthread_rwlock_t lock;
+} irr_cache_t;
+
+/* 光源から見た影の格子 (build_light_map で作る)。光の方向に垂直な平面を
+   格子に分け、セルごとに、光の方向に見てそのセルと重なる AND グループを
+   OR 行列での順に並べておく */
+typedef struct {
+  vec_t   u, v;          /* 光の方向に垂直な単位ベクトル */
+  vec_t   w;             /* light / |light|^2。点 p の深さは p・w で、影の光線の t と同じ尺度 */
+  double  u0, v0;        /* 格子の隅 */
+  double  cell;          /* セルの幅 */
+  int     nu, nv;
+  bvh_item_t *items;     /* 交点を持ちうる AND グループ (OR 行列の順) */
+  double *wmin;          /* items の包含箱の最も浅い深さ */
+  /* セル c の要素は cell_items[cell_start[c]] 〜 cell_items[cell_start[c + 1] - 1] */
+  int    *cell_start;
+  int    *cell_items;
+  /* どの点でも調べる要素 (有界でないものと、多くのセルに重なるもの) */
+  int     n_wide;
+  int    *wide;
+  /* 速い版 : 真なら cells で答えを決め、決まらない点だけ厳密に調べる */
+  bool    fast;
+  double  w_lo, w_hi;    /* cells の深さを求めた範囲 */
+  double  band;          /* 影になり始める深さからこれより近い点は厳密に調べる */
+  light_cell_t *cells;
+} light_map_t;
+
+/* 形の分類 (直方体, 平面, 2次曲面) の数 */
+#define N_SHAPE_CLASS 3
+
+
+/**************** シーンデータ ****************/
+
+/* 読み込んだシーンと、そこから作った前処理済みデータを保持する。
+   レンダリング中は読み出し専用なので、複数のスレッドから共有できる */
+typedef struct {
+  /* オブジェクトの個数 */
+  int n_objects;
 
-/* オブジェクトの個数 */
-int n_objects = 0;
+  /* オブジェクトのデータを入れるベクトル */
+  obj_t *objects;
 
-/* オブジェクトのデータを入れるベクトル（最大60個）*/
-obj_t objects[60];
+  /* 回転を施す前の各オブジェクトの abc (-frames で物体を回し直すときに使う) */
+  vec_t *base_abc;
 
-/* Screen の中心座標 */
-vec_t screen;
+  /* Screen の中心座標 */
+  vec_t screen;
 
-/* 視点の座標 */
-vec_t viewpoint;
+  /* 視点の座標 */
+  vec_t viewpoint;
 
-/* 光源方向ベクトル (単位ベクトル) */
-vec_t light;
+  /* 光源方向ベクトル (単位ベクトル) */
+  vec_t light;
 
-/* 鏡面ハイライト強度 (標準=255) */
-double beam = 255.0;
+  /* 鏡面ハイライト強度 (標準=255) */
+  double beam;
 
-/* AND ネットワークを保持 */
-int *and_net[50];
+  /* AND ネットワークを保持 */
+  int **and_net;
+  int n_and_net;
 
-/* OR ネットワークを保持 */
-int **or_net;
+  /* OR ネットワークを保持 */
+  int **or_net;
 
-/* 以下、交差判定ルーチンの返り値格納用 */
-/* solver の交点 の t の値 */
-double solver_dist = 0.0;
+  /* AND, OR ネットワークの全要素 (各行はここを指す) */
+  int *net_words;
 
-/* 交点の直方体表面での方向 */
-int intsec_rectside = 0;
+  /* 画像サイズ */
+  int image_size[2];
 
-/* 発見した交点の最小の t */
-double tmin = 1000000000.0;
+  /* 画像の中心 = 画像サイズの半分 */
+  int image_center[2];
 
-/* 交点の座標 */
-vec_t intersection_point;
+  /* 3次元上のピクセル間隔 */
+  double scan_pitch;
 
-/* 衝突したオブジェクト番号 */
-int intersected_object_id = 0;
+  /* 画面上のx,y,z軸の3次元空間上の方向 */
+  vec_t screenx_dir;
+  vec_t screeny_dir;
+  vec_t screenz_dir;
 
-/* 法線ベクトル */
-vec_t nvector;
+  /* 間接光サンプリングに使う方向ベクトル */
+  dvec_t *dirvecs[5];
 
-/* 交点の色 */
-vec_t texture_color;
+  /* 光源光の前処理済み方向ベクトル */
+  dvec_t light_dirvec;
 
-/* 計算中の間接受光強度を保持 */
-vec_t diffuse_ray;
-/* スクリーン上の点の明るさ */
-vec_t rgb;
+  /* 方向ベクトルごとの solver 用定数テーブルの置き場。
+     方向ベクトル1本あたり dconst_len 個の定数を連続して置き、
+     オブジェクト i の定数 (長さ4~6で形による) はその dconst_ofs[i] 番目から */
+  double *dconst_arena;
+  int     dconst_len;
+  int    *dconst_ofs;
+  /* 確保した方向ベクトルの数と、割り当て済の数 */
+  int     dconst_cap;
+  int     n_dconsts;
 
-/* 画像サイズ */
-int image_size[2];
+  /* 鏡平面の反射情報 */
+  refl_t *reflections;
 
-/* 画像の中心 = 画像サイズの半分 */
-int image_center[2];
+  /* reflectionsの有効な要素数 */
+  int n_reflections;
+  int cap_reflections;
 
-/* 3次元上のピクセル間隔 */
-double scan_pitch;
+  /* AND グループの包含箱の BVH (build_bvh で作る。NULL なら OR 行列を順に辿る) */
+  bvh_t *bvh;
 
-/* judge_intersectionに与える光線始点 */
-vec_t startp;
+  /* 光源から見た影の格子 (build_light_map で作る。NULL なら使わない) */
+  light_map_t *light_map;
 
-/* judge_intersection_fastに与える光線始点 */
-vec_t startp_fast;
+  /* 放射照度キャッシュ (NULL なら使わない)。シーンが変わらない限り、
+     視点を変えて描き直すときにも使い回せる */
+  irr_cache_t *irr_cache;
 
-/* 画面上のx,y,z軸の3次元空間上の方向 */
-vec_t screenx_dir;
-vec_t screeny_dir;
-vec_t screenz_dir;
+  /* 視点からの光線の最大追跡回数 (鏡面反射の回数 + 1, 標準 5) と、
+     鏡面反射を辿り続ける重みの下限 (標準 0.1) */
+  int max_depth;
+  double energy_cutoff;
 
-/* 直接光追跡で使う光方向ベクトル */
-vec_t ptrace_dirvec;
+  /* 0 でなければ、隣と違う面に当たったか直接光の色が aa_threshold を超えて
+     違うピクセルを aa x aa 個の光線で追跡し直す (-aa) */
+  int aa;
+  double aa_threshold;
 
-/* 間接光サンプリングに使う方向ベクトル */
-dvec_t *dirvecs[5];
 
-/* 光源光の前処理済み方向ベクトル */
-dvec_t light_dirvec;
+} scene_t;
 
-/* 鏡平面の反射情報 */
-refl_t reflections[180];
+/**************** 追跡中の状態 ****************/
 
-/* reflectionsの有効な要素数 */
-int n_reflections;
+/* RT_STATS を定義してビルドしたときだけ数える詳しい計測値
+   (make stats で min-rt-stats を作る)。描画後に JSON で標準エラーに出す */
+#ifdef RT_STATS
+typedef struct {
+  /* 形の分類 (直方体, 平面, 2次曲面) ごとの、solver を実際に
+     計算した回数 */
+  unsigned long solver[N_SHAPE_CLASS];
+  /* 交点の無い要素が反転していないため AND グループの残りを調べなかった回数 */
+  unsigned long and_early_exits;
+  /* 上下左右4点の結果を足して済ませた点、残り240本を追跡した点の数と、
+     4点を使えず do_without_neighbors に切り替えたピクセルの数 */
+  unsigned long five_point;
+  unsigned long one_point;
+  unsigned long neighbor_fallbacks;
+  /* 画像の端で初めから4点を使わなかったピクセルの数 */
+  unsigned long edge_pixels;
+  /* 直接光追跡, 間接光20%の追跡, ピクセル値の計算にかかった時間 (秒) */
+  double t_direct;
+  double t_pretrace_diffuse;
+  double t_scan;
+} rt_stats_t;
+#endif
+
+/* 光線の本数などの計測値 (スレッドごとに数え、最後に合計する) */
+typedef struct {
+  unsigned long n_rays;       /* 交差判定した光線の本数 (影の判定を含む) */
+  unsigned long n_shadow;     /* 影の判定の回数 */
+  unsigned long n_shadowed;   /* そのうち影に入っていた回数 */
+  unsigned long n_cache_hits; /* そのうち直前に影を落とした AND グループで決まった回数 */
+  unsigned long n_map_hits;   /* そのうち速い版の影の格子だけで決まった回数 */
+  unsigned long n_irr_lookups; /* 間接受光を放射照度キャッシュから探した回数 */
+  unsigned long n_irr_hits;    /* そのうち記録の補間で済んだ回数 */
+  unsigned long n_aa_pixels;   /* -aa で追跡し直したピクセルの数 */
+  unsigned long n_aa_diffuse;  /* そのうち間接受光を新たに求めた衝突点の数 */
+#ifdef RT_STATS
+  rt_stats_t stats;
+#endif
+} ray_count_t;
+
+/* 交差判定やシェーディングの途中結果を保持する。
+   スレッドごとに1つ用意すれば、同じシーンを並行して追跡できる */
+typedef struct {
+  /* 追跡対象のシーン */
+  scene_t *sc;
+
+  /* 以下、交差判定ルーチンの返り値格納用 */
+  /* solver の交点 の t の値 */
+  double solver_dist;
+
+  /* 交点の直方体表面での方向 */
+  int intsec_rectside;
+
+  /* 発見した交点の最小の t */
+  double tmin;
+
+  /* 交点の座標 */
+  vec_t intersection_point;
+
+  /* 衝突したオブジェクト番号 */
+  int intersected_object_id;
+
+  /* 法線ベクトル */
+  vec_t nvector;
+
+  /* 交点の色 */
+  vec_t texture_color;
+
+  /* 計算中の間接受光強度を保持 */
+  vec_t diffuse_ray;
+
+  /* スクリーン上の点の明るさ */
+  vec_t rgb;
+
+  /* judge_intersectionに与える光線始点 */
+  vec_t startp;
+
+  /* judge_intersection_fastに与える光線始点 */
+  vec_t startp_fast;
+
+  /* 直接光追跡で使う光方向ベクトル */
+  vec_t ptrace_dirvec;
+
+  /* 光線の発射点をあらかじめ計算した場合の定数テーブル (オブジェクトごと) */
+  vec4_t *ctbl;
+
+
+  /* BVH の探索に使う作業領域 */
+  bvh_hit_t *bvh_hits;
+  int       *bvh_stack;
+
+  /* 直前に影を落とした AND グループと、それが属する OR 行列の行
+     (shadow_group が NULL なら無し) */
+  int  shadow_row;
+  int *shadow_group;
+
+  /* 真なら間接光の光線が当たった物体までの距離の逆数を irr_inv_dist に足す
+     (放射照度キャッシュの記録の半径を求めるため) */
+  bool   irr_measure;
+  double irr_inv_dist;
+
+  /* -aa のときだけ使う作業領域。追加の光線の追跡結果を入れる1ピクセル分の
+     配列と、反射回数ごとの間接受光 (aa_irr) と、1つのピクセル内で
+     求めた間接受光を衝突面 (反射回数 * 面の数 + 面番号) ごとに覚えたもの */
+  pixel_t *aa_pixel;
+  vec_t   *aa_irr;
+  int     *aa_keys;
+  vec_t   *aa_vals;
+  int      n_aa_vals;
+
+  /* 光線の本数などの計測値 */
+  ray_count_t count;
+#ifdef RT_STATS
+  /* STAT_BEGIN で記録した時刻 */
+  double stat_t0;
+#endif
+} render_ctx_t;
+
+/* RT_STATS の計測値を数える。定義しなければ何もしない */
+#ifdef RT_STATS
+#define STAT_ADD(ctx, f, n) ((ctx)->count.stats.f += (n))
+#define STAT_BEGIN(ctx)     ((ctx)->stat_t0 = get_time())
+#define STAT_END(ctx, f)    ((ctx)->count.stats.f += get_time() - (ctx)->stat_t0)
+#else
+#define STAT_ADD(ctx, f, n) ((void)0)
+#define STAT_BEGIN(ctx)     ((void)0)
+#define STAT_END(ctx, f)    ((void)0)
+#endif
+#define STAT_INC(ctx, f) STAT_ADD(ctx, f, 1)
+/* solver に渡す形 (o_form) から形の分類への変換 */
+#define stat_shape(s) ((s) == 1 ? 0 : (s) == 2 ? 1 : 2)
 
 /******************************************************************************
    Runtime
@@ -162,18 +419,32 @@ int n_reflections;
 #define int_of_double(f) ((int)(f))
 #define float_of_int(i) ((double)(i))
 
-int read_int() {
-  unsigned n = 0;
-  n += getchar();
-  n += getchar() << 8;
-  n += getchar() << 16;
-  n += getchar() << 24;
-  return n;
+/* シーンデータのワード列 (conv の出力) をメモリ上で先頭から読む。
+   conv はホストのバイト順か、その逆順 (conv_to_big_endian) で書くので両方に対応する */
+typedef struct {
+  const unsigned char *p, *end;
+  bool big_endian;
+} word_reader_t;
+
+/* 残りのワード数 */
+#define words_left(in) (((in)->end - (in)->p) / 4)
+
+/* 範囲の確認はしないので、check_scene_words で検証したワード列だけを読む */
+int read_int(word_reader_t *in) {
+  const unsigned char *p = in->p;
+  unsigned n;
+  if (in->big_endian) {
+    n = (unsigned) p[0] << 24 | (unsigned) p[1] << 16 | (unsigned) p[2] << 8 | p[3];
+  } else {
+    n = (unsigned) p[3] << 24 | (unsigned) p[2] << 16 | (unsigned) p[1] << 8 | p[0];
+  }
+  in->p += 4;
+  return (int) n;
 }
 
-double read_float() {
-  union {unsigned i; float f;} u;
-  u.i = read_int();
+double read_float(word_reader_t *in) {
+  union {int i; float f;} u;
+  u.i = read_int(in);
   return u.f;
 }
 
@@ -185,6 +456,22 @@ void print_int(int i) {
   printf("%d", i);
 }
 
+/* このプロセスの最大常駐メモリ (KB, Linux の ru_maxrss の単位) */
+long peak_rss_kb(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0) {
+    return -1;
+  }
+  return ru.ru_maxrss;
+}
+
+/* 経過時間の計測用 (秒) */
+double get_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1.0e-9;
+}
+
 
 /******************************************************************************
    ユーティリティー
@@ -204,6 +491,24 @@ double sgn (double x) {
 /* 条件付き符号反転 */
 #define fneg_cond(cond, x) ((cond) ? (x) : fneg(x))
 
+/* 要素の大きさが size の配列 p を、n 番目の要素が入るよう必要なら伸ばす。
+   容量 *cap は倍々に増やす */
+void *grow_array(void *p, int *cap, int n, size_t size) {
+  if (n >= *cap) {
+    int new_cap = *cap > 0 ? *cap : 16;
+    while (n >= new_cap) {
+      new_cap *= 2;
+    }
+    p = realloc(p, new_cap * size);
+    if (p == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+    *cap = new_cap;
+  }
+  return p;
+}
+
 
 /******************************************************************************
    ベクトル操作のためのプリミティブ
@@ -349,6 +654,7 @@ void vecunit_sgn (vec_t *v, int inv) {
 #define o_param_r3(m) ((m)->rot123.z)
 
 /* 光線の発射点をあらかじめ計算した場合の定数テーブル */
+/* 始点は追跡ごとに変わるので、オブジェクトではなく render_ctx_t 側に持つ */
 /*
   0 -- 2 番目の要素: 物体の固有座標系に平行移動した光線始点
   3番目の要素:
@@ -356,7 +662,7 @@ void vecunit_sgn (vec_t *v, int inv) {
   平面→ abcベクトルとの内積
   二次曲面、円錐→二次方程式の定数項
 */
-#define o_param_ctbl(m) (&(m)->ctbl)
+#define o_param_ctbl(ctx, index) (&(ctx)->ctbl[index])
 
 /******************************************************************************
    Pixelデータのメンバアクセス関数群
@@ -365,21 +671,31 @@ void vecunit_sgn (vec_t *v, int inv) {
 /* 直接光追跡で得られたピクセルのRGB値 */
 #define p_rgb(p) (&(p)->rgb)
 
-/* 飛ばした光が物体と衝突した点の配列 */
-#define p_intersection_points(p) ((p)->isect_ps)
+/* ピクセル p が持つ反射回数の数 */
+#define p_depth(p) ((p)->blk->depth)
+
+/* 反射回数 i の情報の配列 a の中での、ピクセル p の要素 */
+#define p_elem(p, a, i) ((p)->blk->a[(i) * (p)->blk->n + (p)->x])
 
-/* 飛ばした光が衝突した物体面番号の配列 */
+/* ピクセル p を含む列の反射回数 i の物体面番号の行。p から k 個先の
+   ピクセルの値は [k] で読める */
+#define p_surface_id_row(p, i) (&p_elem(p, sids, i))
+
+/* 飛ばした光が i 回目に物体と衝突した点 */
+#define p_intersection_point(p, i) p_elem(p, isect_ps, i)
+
+/* 飛ばした光が i 回目に衝突した物体面番号 */
 /* 物体面番号は オブジェクト番号 * 4 + (solverの返り値) */
-#define p_surface_ids(p) ((p)->sids)
+#define p_surface_id(p, i) p_elem(p, sids, i)
 
 /* 間接受光を計算するか否かのフラグ */
-#define p_calc_diffuse(p) ((p)->cdif)
+#define p_calc_diffuse(p, i) p_elem(p, cdif, i)
 
 /* 衝突点の間接受光エネルギーがピクセル輝度に与える寄与の大きさ */
-#define p_energy(p) ((p)->engy)
+#define p_energy(p, i) p_elem(p, engy, i)
 
 /* 衝突点の間接受光エネルギーを光線本数を1/5に間引きして計算した値 */
-#define p_received_ray_20percent(p) ((p)->r20p)
+#define p_received_ray_20percent(p, i) p_elem(p, r20p, i)
 
 /* このピクセルのグループ ID */
 /*
@@ -397,7 +713,7 @@ void vecunit_sgn (vec_t *v, int inv) {
 #define p_set_group_id(p, id) ((p)->gid = (id))
 
 /* 各衝突点における法線ベクトル */
-#define p_nvectors(p) ((p)->nvectors)
+#define p_nvector(p, i) p_elem(p, nvectors, i)
 
 /******************************************************************************
    前処理済み方向ベクトルのメンバアクセス関数
@@ -406,8 +722,8 @@ void vecunit_sgn (vec_t *v, int inv) {
 /* ベクトル */
 #define d_vec(d) (&(d)->vec)
 
-/* 各オブジェクトに対して作った solver 高速化用定数テーブル */
-#define d_const(d) ((d)->cnst)
+/* オブジェクト index に対して作った solver 高速化用定数テーブル */
+#define d_const(sc, d, index) ((d)->cnst + (sc)->dconst_ofs[index])
 
 /******************************************************************************
    平面鏡面体の反射情報
@@ -433,47 +749,60 @@ double rad (double x) {
 
 /**** 環境データの読み込み ****/
 
-void read_screen_settings (void) {
+/* スクリーンの中心 (sx, sy, sz) と2つの回転角 (度) からカメラを設定する。
+   カメラに依存するのはここで決める値だけなので、-views では読み込んだ
+   シーンと前処理済みのデータはそのままで、これだけを設定し直す */
+void setup_screen(scene_t *sc, double sx, double sy, double sz, double deg1, double deg2) {
   double v1, cos_v1, sin_v1;
   double v2, cos_v2, sin_v2;
-  screen.x = read_float();
-  screen.y = read_float();
-  screen.z = read_float();
+  sc->screen.x = sx;
+  sc->screen.y = sy;
+  sc->screen.z = sz;
 
-  v1 = rad(read_float());
-  v2 = rad(read_float());
+  v1 = rad(deg1);
+  v2 = rad(deg2);
   cos_v1 = cos(v1);
   sin_v1 = sin(v1);
   cos_v2 = cos(v2);
   sin_v2 = sin(v2);
 
-  screenz_dir.x = cos_v1 * sin_v2 * 200.0;
-  screenz_dir.y = sin_v1 * (-200.0);
-  screenz_dir.z = cos_v1 * cos_v2 * 200.0;
-  screenx_dir.x = cos_v2;
-  screenx_dir.y = 0.0;
-  screenx_dir.z = - sin_v2;
-  screeny_dir.x = - sin_v1 * sin_v2;
-  screeny_dir.y = - cos_v1;
-  screeny_dir.z = - sin_v1 * cos_v2;
-  viewpoint.x = screen.x - screenz_dir.x;
-  viewpoint.y = screen.y - screenz_dir.y;
-  viewpoint.z = screen.z - screenz_dir.z;
+  sc->screenz_dir.x = cos_v1 * sin_v2 * 200.0;
+  sc->screenz_dir.y = sin_v1 * (-200.0);
+  sc->screenz_dir.z = cos_v1 * cos_v2 * 200.0;
+  sc->screenx_dir.x = cos_v2;
+  sc->screenx_dir.y = 0.0;
+  sc->screenx_dir.z = - sin_v2;
+  sc->screeny_dir.x = - sin_v1 * sin_v2;
+  sc->screeny_dir.y = - cos_v1;
+  sc->screeny_dir.z = - sin_v1 * cos_v2;
+  sc->viewpoint.x = sc->screen.x - sc->screenz_dir.x;
+  sc->viewpoint.y = sc->screen.y - sc->screenz_dir.y;
+  sc->viewpoint.z = sc->screen.z - sc->screenz_dir.z;
+}
+
+void read_screen_settings (scene_t *sc, word_reader_t *in) {
+  double sx, sy, sz, deg1, deg2;
+  sx = read_float(in);
+  sy = read_float(in);
+  sz = read_float(in);
+  deg1 = read_float(in);
+  deg2 = read_float(in);
+  setup_screen(sc, sx, sy, sz, deg1, deg2);
 }
 
 
-void read_light(void) {
-  int nl = read_int();
-  double l1 = rad(read_float());
+void read_light(scene_t *sc, word_reader_t *in) {
+  int nl = read_int(in);
+  double l1 = rad(read_float(in));
   double sl1 = sin(l1);
-  double l2 = rad(read_float());
+  double l2 = rad(read_float(in));
   double cl1 = cos(l1);
   double sl2 = sin(l2);
   double cl2 = cos(l2);
-  light.y = - sl1;
-  light.x = cl1 * sl2;
-  light.z = cl1 * cl2;
-  beam = read_float();
+  sc->light.y = - sl1;
+  sc->light.x = cl1 * sl2;
+  sc->light.z = cl1 * cl2;
+  sc->beam = read_float(in);
 }
 
 void rotate_quadratic_matrix(vec_t *abc, vec_t *rot) {
@@ -516,9 +845,9 @@ void rotate_quadratic_matrix(vec_t *abc, vec_t *rot) {
 }
 
 /**** オブジェクト1つのデータの読み込み ****/
-bool read_nth_object(int n) {
+bool read_nth_object(scene_t *sc, word_reader_t *in, int n) {
 
-  int texture = read_int();
+  int texture = read_int(in);
   if (texture != -1) {
     int form;
     int refltype;
@@ -531,32 +860,33 @@ bool read_nth_object(int n) {
     vec_t rotation;
 
     bool m_invert2;
-    vec4_t ctbl;
-    form = read_int();
-    refltype = read_int();
-    isrot_p = read_int();
-    abc.x = read_float();
-    abc.y = read_float();
-    abc.z = read_float();
+    form = read_int(in);
+    refltype = read_int(in);
+    isrot_p = read_int(in);
+    abc.x = read_float(in);
+    abc.y = read_float(in);
+    abc.z = read_float(in);
 
 
-    xyz.x = read_float();
-    xyz.y = read_float();
-    xyz.z = read_float();
+    xyz.x = read_float(in);
+    xyz.y = read_float(in);
+    xyz.z = read_float(in);
 
-    m_invert = fisneg (read_float());
+    m_invert = fisneg (read_float(in));
 
-    reflparam[0] = read_float(); /* diffuse */
-    reflparam[1] = read_float(); /* hilight */
+    reflparam[0] = read_float(in); /* diffuse */
+    reflparam[1] = read_float(in); /* hilight */
 
-    color.x = read_float();
-    color.y = read_float();
-    color.z = read_float(); /* 15 */
+    color.x = read_float(in);
+    color.y = read_float(in);
+    color.z = read_float(in); /* 15 */
 
+    /* 回転しない物体の rot123 も不定にしない (scene_hash で使う) */
+    vecbzero(&rotation);
     if (isrot_p != 0) {
-      rotation.x = rad (read_float());
-      rotation.y = rad (read_float());
-      rotation.z = rad (read_float());
+      rotation.x = rad (read_float(in));
+      rotation.y = rad (read_float(in));
+      rotation.z = rad (read_float(in));
     }
 
     /* パラメータの正規化 */
@@ -581,6 +911,7 @@ bool read_nth_object(int n) {
     }
 
     /* 2次形式行列に回転変換を施す */
+    sc->base_abc[n] = abc;
     if (isrot_p != 0) {
       rotate_quadratic_matrix(&abc, &rotation);
     }
@@ -588,24 +919,22 @@ bool read_nth_object(int n) {
 
     {
       /* ここからあとは abc と rotation しか操作しない。*/
-      objects[n].tex     = texture;
-      objects[n].shape   = form;
-      objects[n].surface = refltype;
-      objects[n].isrot   = isrot_p;
+      sc->objects[n].tex     = texture;
+      sc->objects[n].shape   = form;
+      sc->objects[n].surface = refltype;
+      sc->objects[n].isrot   = isrot_p;
 
-      objects[n].abc = abc;
-      objects[n].xyz = xyz;
+      sc->objects[n].abc = abc;
+      sc->objects[n].xyz = xyz;
 
-      objects[n].invert  = m_invert2;
+      sc->objects[n].invert  = m_invert2;
 
       /* reflection paramater */
-      objects[n].surfparams[0] = reflparam[0];
-      objects[n].surfparams[1] = reflparam[1];
+      sc->objects[n].surfparams[0] = reflparam[0];
+      sc->objects[n].surfparams[1] = reflparam[1];
 
-      objects[n].color = color;
-      objects[n].rot123 = rotation;
-
-      objects[n].ctbl = ctbl;
+      sc->objects[n].color = color;
+      sc->objects[n].rot123 = rotation;
     }
 
     return true;
@@ -615,65 +944,206 @@ bool read_nth_object(int n) {
 }
 
 /**** 物体データ全体の読み込み ****/
-void read_all_object() {
-  int i;
-  for(i = 0; i < 60; ++i) {
-    if(!read_nth_object(i)) {
-      n_objects = i;
-      return;
-    }
+void read_all_object(scene_t *sc, word_reader_t *in, int n_objects) {
+  int i = 0;
+  sc->objects = calloc(n_objects + 1, sizeof(obj_t));
+  sc->base_abc = malloc(sizeof(vec_t) * (n_objects + 1));
+  while (read_nth_object(sc, in, i)) {
+    ++i;
   }
-  assert(false); /* failwith "too many objects" */
+  sc->n_objects = i;
 }
 
 /**** AND, OR ネットワークの読み込み ****/
 
-/* ネットワーク1つを読み込みベクトルにして返す */
-int *read_net_item(int length) {
-  int item = read_int();
-  if (item == -1) {
-    int *ary = (int *) malloc(sizeof(int) * (length + 1));
-    memset(ary, -1, sizeof(int) * (length + 1));
-    return ary;
-  }else {
-    int *v = read_net_item(length + 1);
-    v[length] = item;
-    return v;
+/* シーンデータの大きさ (check_scene_words が数える) */
+typedef struct {
+  /* オブジェクトの個数 */
+  int n_objects;
+  /* ファイル中の AND ネットワークの個数 */
+  int n_and_net;
+  /* OR ネットワークが参照する番号までの AND ネットワークの個数 */
+  int n_groups;
+  /* OR 行列の行数 (終了マークを除く) */
+  int n_or_net;
+  /* ネットワークの要素数 (各行の終了マークを含む) */
+  int n_net_words;
+} scene_size_t;
+
+/* ワード列が in のバイト順のシーンデータとして読めるかを確かめ、
+   大きさを数える。in は値渡しなので読み進めない */
+bool check_scene_words(word_reader_t in, scene_size_t *size) {
+  long n_words = words_left(&in);
+  memset(size, 0, sizeof(scene_size_t));
+
+  /* 環境データ */
+  if (n_words < 9) {
+    return false;
   }
-}
+  in.p += 9 * 4;
 
-int **read_or_network(int length) {
-  int *net = read_net_item(0);
-  if (net[0] == -1) {
-    int **ary = (int **) malloc(sizeof(int*) * (length + 1));
-    int i;
-    for (i = 0; i < length + 1; ++i) {
-      ary[i] = net;
+  /* 物体データ: テクスチャ, 形, 反射特性, 回転の有無, 12個の実数, 回転角 */
+  while (1) {
+    int texture, form, refltype, isrot_p, len;
+    if (words_left(&in) < 1) {
+      return false;
     }
-    return ary;
-  } else {
-    int **v = read_or_network (length + 1);
-    v[length] = net;
-    return v;
+    texture = read_int(&in);
+    if (texture == -1) {
+      break;
+    }
+    if (words_left(&in) < 3) {
+      return false;
+    }
+    form = read_int(&in);
+    refltype = read_int(&in);
+    isrot_p = read_int(&in);
+    /* どれも小さな整数なので、バイト順を間違えると 2^24 以上か負になる */
+    if (texture < 0 || texture > 255 || form < 0 || form > 255
+        || refltype < 0 || refltype > 255 || isrot_p < 0 || isrot_p > 255) {
+      return false;
+    }
+    len = isrot_p != 0 ? 15 : 12;
+    if (words_left(&in) < len) {
+      return false;
+    }
+    in.p += len * 4;
+    ++size->n_objects;
+  }
+
+  /* AND ネットワーク: オブジェクト番号の行が続き、空の行で終わる */
+  while (1) {
+    int len = 0;
+    while (1) {
+      int id;
+      if (words_left(&in) < 1) {
+        return false;
+      }
+      id = read_int(&in);
+      if (id == -1) {
+        break;
+      }
+      if (id < 0 || id >= size->n_objects) {
+        return false;
+      }
+      ++len;
+    }
+    if (len == 0) {
+      break;
+    }
+    ++size->n_and_net;
+    size->n_net_words += len + 1;
+  }
+
+  /* OR 行列: 先頭が range primitive (99 なら無し), 残りが AND ネットワークの番号 */
+  size->n_groups = size->n_and_net;
+  while (1) {
+    int len = 0;
+    while (1) {
+      int id;
+      if (words_left(&in) < 1) {
+        return false;
+      }
+      id = read_int(&in);
+      if (id == -1) {
+        break;
+      }
+      if (len == 0) {
+        if (id != 99 && (id < 0 || id >= size->n_objects)) {
+          return false;
+        }
+      } else {
+        /* 読まれなかった AND ネットワークは空になる。
+           その数は入力の大きさまでに抑える */
+        if (id < 0 || id > n_words) {
+          return false;
+        }
+        if (id >= size->n_groups) {
+          size->n_groups = id + 1;
+        }
+      }
+      ++len;
+    }
+    if (len == 0) {
+      break;
+    }
+    ++size->n_or_net;
+    size->n_net_words += len + 1;
   }
+
+  /* 空のネットワーク兼 OR 行列の終了マーク */
+  size->n_net_words += 1;
+  return true;
 }
 
+/* ネットワークを読み込む。要素はすべて net_words の1つの配列に並べ、
+   各行はそこを指す。OR 行列が参照するのに読まれなかった AND ネットワークは
+   空のネットワークになる */
+void read_networks(scene_t *sc, word_reader_t *in, scene_size_t *size) {
+  int *w = malloc(sizeof(int) * size->n_net_words);
+  int i;
+
+  sc->net_words = w;
+  sc->and_net = malloc(sizeof(int *) * (size->n_groups + 1));
+  sc->n_and_net = size->n_groups;
+  for (i = 0; i < size->n_and_net; ++i) {
+    sc->and_net[i] = w;
+    while ((*w++ = read_int(in)) != -1);
+  }
+  read_int(in); /* AND ネットワークの終了 */
+
+  sc->or_net = malloc(sizeof(int *) * (size->n_or_net + 1));
+  for (i = 0; i < size->n_or_net; ++i) {
+    sc->or_net[i] = w;
+    while ((*w++ = read_int(in)) != -1);
+  }
+  read_int(in); /* OR 行列の終了 */
 
-void read_and_network (int n) {
-  int *net = read_net_item(0);
-  if (net[0] != -1) {
-    free(and_net[n]);
-    and_net[n] = net;
-    read_and_network(n + 1);
+  *w = -1;
+  sc->or_net[size->n_or_net] = w;
+  for (i = size->n_and_net; i < size->n_groups; ++i) {
+    sc->and_net[i] = w;
   }
 }
 
-void read_parameter() {
-  read_screen_settings();
-  read_light();
-  read_all_object();
-  read_and_network(0);
-  or_net = read_or_network(0);
+/* 標準入力のシーンを読み込む。入力は conv の出力 (バイナリ) でも SLD の
+   テキストでもよく、どちらもファイルをメモリに写し、検証してから
+   そのワード列を直接読む */
+void read_parameter(scene_t *sc) {
+  sld_buffer buf;
+  sld_reader text;
+  word_reader_t in;
+  scene_size_t size;
+  if (sld_load_buffer(fileno(stdin), &buf) != 0) {
+    perror("read_parameter");
+    exit(1);
+  }
+  text.words = NULL;
+  if (sld_is_text(&buf)) {
+    sld_read_text(&text, &buf);
+    in.p = (const unsigned char *) text.words;
+    in.end = in.p + sizeof(fi_union) * text.n_words;
+  } else {
+    in.p = (const unsigned char *) buf.data;
+    in.end = in.p + buf.len;
+  }
+
+  /* バイト順は、シーンデータとして読める方に決める */
+  in.big_endian = false;
+  if (!check_scene_words(in, &size)) {
+    in.big_endian = true;
+    if (!check_scene_words(in, &size)) {
+      fprintf(stderr, "read_parameter: invalid scene data\n");
+      exit(1);
+    }
+  }
+
+  read_screen_settings(sc, &in);
+  read_light(sc, &in);
+  read_all_object(sc, &in, size.n_objects);
+  read_networks(sc, &in, &size);
+  free(text.words);
+  sld_free_buffer(&buf);
 }
 
 /******************************************************************************
@@ -692,7 +1162,7 @@ void read_parameter() {
 
 /* 直方体の指定された面に衝突するかどうか判定する */
 /* i0 : 面に垂直な軸のindex X:0, Y:1, Z:2         i2,i3は他の2軸のindex */
-bool solver_rect_surface(obj_t *m, vec_t *dirvec, double b0, double b1, double b2, int i0, int i1, int i2) {
+bool solver_rect_surface(render_ctx_t *ctx, obj_t *m, vec_t *dirvec, double b0, double b1, double b2, int i0, int i1, int i2) {
   double *dirvec_arr = (double *) dirvec;
   if (dirvec_arr[i0] == 0.0) {
     return false;
@@ -704,7 +1174,7 @@ bool solver_rect_surface(obj_t *m, vec_t *dirvec, double b0, double b1, double b
     double d2 = (d - b0) / dirvec_arr[i0];
     if ((fabs(d2 * dirvec_arr[i1] + b1)) < abc_arr[i1]) {
       if ((fabs(d2 * dirvec_arr[i2] + b2)) < abc_arr[i2]) {
-        solver_dist = d2;
+        ctx->solver_dist = d2;
         return true;
       }else {
         return false;
@@ -719,12 +1189,12 @@ bool solver_rect_surface(obj_t *m, vec_t *dirvec, double b0, double b1, double b
 
 
 /***** 直方体オブジェクトの場合 ****/
-int solver_rect (obj_t *m, vec_t *dirvec, double b0, double b1, double b2) {
-  if (solver_rect_surface(m, dirvec, b0, b1, b2, 0, 1, 2)) {
+int solver_rect (render_ctx_t *ctx, obj_t *m, vec_t *dirvec, double b0, double b1, double b2) {
+  if (solver_rect_surface(ctx, m, dirvec, b0, b1, b2, 0, 1, 2)) {
     return 1;   /* YZ 平面 */
-  } else if (solver_rect_surface(m, dirvec, b1, b2, b0, 1, 2, 0)) {
+  } else if (solver_rect_surface(ctx, m, dirvec, b1, b2, b0, 1, 2, 0)) {
     return 2;   /* ZX 平面 */
-  } else if (solver_rect_surface(m, dirvec, b2, b0, b1, 2, 0, 1)) {
+  } else if (solver_rect_surface(ctx, m, dirvec, b2, b0, b1, 2, 0, 1)) {
     return 3;   /* XY 平面 */
   } else {
     return 0;
@@ -733,13 +1203,13 @@ int solver_rect (obj_t *m, vec_t *dirvec, double b0, double b1, double b2) {
 
 
 /* 平面オブジェクトの場合 */
-int solver_surface(obj_t *m, vec_t *dirvec, double b0, double b1, double b2) {
+int solver_surface(render_ctx_t *ctx, obj_t *m, vec_t *dirvec, double b0, double b1, double b2) {
   /* 点と平面の符号つき距離 */
   /* 平面は極性が負に統一されている */
   vec_t *abc = o_param_abc(m);
   double d = veciprod(dirvec, abc);
   if (d > 0.0) {
-    solver_dist = fneg(veciprod2(abc, b0, b1, b2)) / d;
+    ctx->solver_dist = fneg(veciprod2(abc, b0, b1, b2)) / d;
     return 1;
   } else {
     return 0;
@@ -785,7 +1255,7 @@ double bilinear(obj_t *m, double v0, double v1, double v2, double w0, double w1,
    展開すると (dirvec^t A dirvec)*t^2 + 2*(dirvec^t A base)*t  +
    (base^t A base) - (0か1) = 0 、よってtに関する2次方程式を解けば良い。*/
 
-int solver_second(obj_t *m, vec_t *dirvec, double b0, double b1, double b2) {
+int solver_second(render_ctx_t *ctx, obj_t *m, vec_t *dirvec, double b0, double b1, double b2) {
   /* 解の公式 (-b' ± sqrt(b'^2 - a*c)) / a  を使用(b' = b/2) */
   /* a = dirvec^t A dirvec */
   double aa = quadratic(m, dirvec->x, dirvec->y, dirvec->z);
@@ -805,7 +1275,7 @@ int solver_second(obj_t *m, vec_t *dirvec, double b0, double b1, double b2) {
     if (d > 0.0) {
       double sd = sqrt(d);
       double t1 = o_isinvert(m) ? sd : - sd;
-      solver_dist = (t1 - bb) /  aa;
+      ctx->solver_dist = (t1 - bb) /  aa;
       return 1;
     } else {
       return 0;
@@ -814,8 +1284,9 @@ int solver_second(obj_t *m, vec_t *dirvec, double b0, double b1, double b2) {
 }
 
 /**** solver のメインルーチン ****/
-int solver(int index, vec_t *dirvec, vec_t *org) {
-  obj_t *m = &objects[index];
+int solver(render_ctx_t *ctx, int index, vec_t *dirvec, vec_t *org) {
+  scene_t *sc = ctx->sc;
+  obj_t *m = &sc->objects[index];
   /* 直線の始点を物体の基準位置に合わせて平行移動 */
   double b0 =  org->x - o_param_x(m);
   double b1 =  org->y - o_param_y(m);
@@ -823,12 +1294,13 @@ int solver(int index, vec_t *dirvec, vec_t *org) {
   int m_shape = o_form(m);
   /* 物体の種類に応じた補助関数を呼ぶ */
   int ret;
+  STAT_INC(ctx, solver[stat_shape(m_shape)]);
   if (m_shape == 1) {
-    ret = solver_rect(m, dirvec, b0, b1, b2);    /* 直方体 */
+    ret = solver_rect(ctx, m, dirvec, b0, b1, b2);    /* 直方体 */
   } else if (m_shape == 2) {
-    ret = solver_surface(m, dirvec, b0, b1, b2); /* 平面 */
+    ret = solver_surface(ctx, m, dirvec, b0, b1, b2); /* 平面 */
   } else {
-    ret = solver_second(m, dirvec, b0, b1, b2);  /* 2次曲面/円錐 */
+    ret = solver_second(ctx, m, dirvec, b0, b1, b2);  /* 2次曲面/円錐 */
   }
   return ret;
 }
@@ -852,7 +1324,7 @@ int solver(int index, vec_t *dirvec, vec_t *org) {
 */
 
 /***** solver_rectのdirvecテーブル使用高速版 ******/
-int solver_rect_fast(obj_t *m, vec_t *v, double *dconst, double b0, double b1, double b2) {
+int solver_rect_fast(render_ctx_t *ctx, obj_t *m, vec_t *v, double *dconst, double b0, double b1, double b2) {
   double d0 = (dconst[0] - b0) * dconst[1];
   bool tmp0;
   double d1 = (dconst[2] - b1) * dconst[3];
@@ -871,7 +1343,7 @@ int solver_rect_fast(obj_t *m, vec_t *v, double *dconst, double b0, double b1, d
   }
   else tmp0 = false;
   if (tmp0 != false) {
-    solver_dist = d0;
+    ctx->solver_dist = d0;
     return 1;
   }
 
@@ -885,7 +1357,7 @@ int solver_rect_fast(obj_t *m, vec_t *v, double *dconst, double b0, double b1, d
   }
   else tmp_zx = false;
   if (tmp_zx != false) {
-    solver_dist = d1;
+    ctx->solver_dist = d1;
     return 2;
   }
 
@@ -898,7 +1370,7 @@ int solver_rect_fast(obj_t *m, vec_t *v, double *dconst, double b0, double b1, d
   }
   else tmp_xy = false;
   if (tmp_xy != false) {
-    solver_dist = d2;
+    ctx->solver_dist = d2;
     return 3;
   }
   return 0;
@@ -906,9 +1378,9 @@ int solver_rect_fast(obj_t *m, vec_t *v, double *dconst, double b0, double b1, d
 
 
 /**** solver_surfaceのdirvecテーブル使用高速版 ******/
-int solver_surface_fast(obj_t *m, double *dconst, double b0, double b1, double b2) {
+int solver_surface_fast(render_ctx_t *ctx, obj_t *m, double *dconst, double b0, double b1, double b2) {
   if (fisneg(dconst[0])) {
-    solver_dist = dconst[1] * b0 + dconst[2] * b1 + dconst[3] * b2;
+    ctx->solver_dist = dconst[1] * b0 + dconst[2] * b1 + dconst[3] * b2;
     return 1;
   } else {
     return 0;
@@ -917,7 +1389,7 @@ int solver_surface_fast(obj_t *m, double *dconst, double b0, double b1, double b
 
 
 /**** solver_second のdirvecテーブル使用高速版 ******/
-int solver_second_fast(obj_t *m, double *dconst, double b0, double b1, double b2) {
+int solver_second_fast(render_ctx_t *ctx, obj_t *m, double *dconst, double b0, double b1, double b2) {
   double aa = dconst[0];
   if (fiszero(aa)) {
     return 0;
@@ -928,9 +1400,9 @@ int solver_second_fast(obj_t *m, double *dconst, double b0, double b1, double b2
     double d = fsqr(neg_bb) - aa * cc;
     if (fispos(d)) {
       if (o_isinvert(m)) {
-        solver_dist = (neg_bb + sqrt(d)) * dconst[4];
+        ctx->solver_dist = (neg_bb + sqrt(d)) * dconst[4];
       } else {
-        solver_dist = (neg_bb - sqrt(d)) * dconst[4];
+        ctx->solver_dist = (neg_bb - sqrt(d)) * dconst[4];
       }
       return 1;
     } else {
@@ -940,30 +1412,31 @@ int solver_second_fast(obj_t *m, double *dconst, double b0, double b1, double b2
 }
 
 /**** solver のdirvecテーブル使用高速版 *******/
-int solver_fast(int index, dvec_t *dirvec, vec_t *org) {
-  obj_t *m = &objects[index];
+int solver_fast(render_ctx_t *ctx, int index, dvec_t *dirvec, vec_t *org) {
+  scene_t *sc = ctx->sc;
+  obj_t *m = &sc->objects[index];
   double b0 = org->x - o_param_x(m);
   double b1 = org->y - o_param_y(m);
   double b2 = org->z - o_param_z(m);
-  double **dconsts = d_const(dirvec);
-  double  *dconst  = dconsts[index];
+  double *dconst = d_const(sc, dirvec, index);
   int m_shape = o_form(m);
   int ret;
+  STAT_INC(ctx, solver[stat_shape(m_shape)]);
   if (m_shape == 1) {
-    ret = solver_rect_fast(m, d_vec(dirvec), dconst, b0, b1, b2);
+    ret = solver_rect_fast(ctx, m, d_vec(dirvec), dconst, b0, b1, b2);
   } else if (m_shape == 2) {
-    ret = solver_surface_fast(m, dconst, b0, b1, b2);
+    ret = solver_surface_fast(ctx, m, dconst, b0, b1, b2);
   } else {
-    ret = solver_second_fast(m, dconst, b0, b1, b2);
+    ret = solver_second_fast(ctx, m, dconst, b0, b1, b2);
   }
   return ret;
 }
 
 
 /* solver_surfaceのdirvec+startテーブル使用高速版 */
-int solver_surface_fast2(obj_t *m, double *dconst, vec4_t *sconst, double b0, double b1, double b2) {
+int solver_surface_fast2(render_ctx_t *ctx, obj_t *m, double *dconst, vec4_t *sconst, double b0, double b1, double b2) {
   if (fisneg(dconst[0])) {
-    solver_dist = dconst[0] * sconst->w;
+    ctx->solver_dist = dconst[0] * sconst->w;
     return 1;
   } else {
     return 0;
@@ -971,7 +1444,7 @@ int solver_surface_fast2(obj_t *m, double *dconst, vec4_t *sconst, double b0, do
 }
 
 /* solver_secondのdirvec+startテーブル使用高速版 */
-int solver_second_fast2(obj_t *m, double *dconst, vec4_t *sconst, double b0, double b1, double b2) {
+int solver_second_fast2(render_ctx_t *ctx, obj_t *m, double *dconst, vec4_t *sconst, double b0, double b1, double b2) {
   double aa = dconst[0];
   if (fiszero(aa)) {
     return 0;
@@ -981,9 +1454,9 @@ int solver_second_fast2(obj_t *m, double *dconst, vec4_t *sconst, double b0, dou
     double d = fsqr(neg_bb) - aa * cc;
     if (fispos(d)) {
       if (o_isinvert(m)) {
-        solver_dist = (neg_bb + sqrt(d)) * dconst[4];
+        ctx->solver_dist = (neg_bb + sqrt(d)) * dconst[4];
       } else {
-        solver_dist = (neg_bb - sqrt(d)) * dconst[4];
+        ctx->solver_dist = (neg_bb - sqrt(d)) * dconst[4];
       }
       return 1;
     } else {
@@ -993,21 +1466,22 @@ int solver_second_fast2(obj_t *m, double *dconst, vec4_t *sconst, double b0, dou
 }
 
 /* solverの、dirvec+startテーブル使用高速版 */
-int solver_fast2(int index, dvec_t *dirvec) {
-  obj_t *m = &objects[index];
-  vec4_t *sconst = o_param_ctbl(m);
+int solver_fast2(render_ctx_t *ctx, int index, dvec_t *dirvec) {
+  scene_t *sc = ctx->sc;
+  obj_t *m = &sc->objects[index];
+  vec4_t *sconst = o_param_ctbl(ctx, index);
   double b0 = sconst->x;
   double b1 = sconst->y;
   double b2 = sconst->z;
-  double **dconsts = d_const(dirvec);
-  double  *dconst  = dconsts[index];
+  double *dconst = d_const(sc, dirvec, index);
   int m_shape = o_form(m);
+  STAT_INC(ctx, solver[stat_shape(m_shape)]);
   if (m_shape == 1) {
-    return solver_rect_fast(m, d_vec(dirvec), dconst, b0, b1, b2);
+    return solver_rect_fast(ctx, m, d_vec(dirvec), dconst, b0, b1, b2);
   } else if (m_shape == 2) {
-    return solver_surface_fast2(m, dconst, sconst, b0, b1, b2);
+    return solver_surface_fast2(ctx, m, dconst, sconst, b0, b1, b2);
   } else {
-    return solver_second_fast2(m, dconst, sconst, b0, b1, b2);
+    return solver_second_fast2(ctx, m, dconst, sconst, b0, b1, b2);
   }
 }
 
@@ -1016,8 +1490,7 @@ int solver_fast2(int index, dvec_t *dirvec) {
 *****************************************************************************/
 
 /* 直方体オブジェクトに対する前処理 */
-double* setup_rect_table(vec_t *vec, obj_t *m) {
-  double *consts = (double*)malloc(6 * sizeof(double));
+void setup_rect_table(double *consts, vec_t *vec, obj_t *m) {
 
   if (fiszero(vec->x)) { /* YZ平面 */
     consts[1] = 0.0;
@@ -1039,12 +1512,10 @@ double* setup_rect_table(vec_t *vec, obj_t *m) {
     consts[4] = fneg_cond(o_isinvert(m)^fisneg(vec->z), o_param_c(m));
     consts[5] = 1.0 / vec->z;
   }
-  return consts;
 }
 
 /* 平面オブジェクトに対する前処理 */
-double* setup_surface_table(vec_t *vec, obj_t *m) {
-  double *consts = (double*)malloc(4 * sizeof(double));
+void setup_surface_table(double *consts, vec_t *vec, obj_t *m) {
   double d = vec->x * o_param_a(m) + vec->y * o_param_b(m) + vec->z * o_param_c(m);
   if (fispos(d)) {
     /* 方向ベクトルを何倍すれば平面の垂直方向に 1 進むか */
@@ -1059,13 +1530,11 @@ double* setup_surface_table(vec_t *vec, obj_t *m) {
     consts[2] = 0;
     consts[3] = 0;
   }
-  return consts;
 }
 
 
 /* 2次曲面に対する前処理 */
-double* setup_second_table(vec_t *v, obj_t *m) {
-  double *consts = malloc(5 * sizeof(double));
+void setup_second_table(double *consts, vec_t *v, obj_t *m) {
   double aa = quadratic(m, v->x, v->y, v->z);
   double c1 = fneg(v->x * o_param_a(m));
   double c2 = fneg(v->y * o_param_b(m));
@@ -1090,42 +1559,97 @@ double* setup_second_table(vec_t *v, obj_t *m) {
   } else {
     consts[4] = 0.0;
   }
-
-  return consts;
 }
 
 
+/* オブジェクト index の形に応じた補助関数を呼んでテーブルを作る */
+void setup_object_constants(scene_t *sc, dvec_t *dirvec, int index) {
+  obj_t *m = &sc->objects[index];
+  double *dconst = d_const(sc, dirvec, index);
+  vec_t *v = d_vec(dirvec);
+  int m_shape = o_form(m);
+
+  if (m_shape == 1) { /* rect */
+    setup_rect_table(dconst, v, m);
+  } else if (m_shape == 2) { /* surface */
+    setup_surface_table(dconst, v, m);
+  } else { /* second */
+    setup_second_table(dconst, v, m);
+  }
+}
+
 /* 各オブジェクトについて補助関数を呼んでテーブルを作る */
-void iter_setup_dirvec_constants (dvec_t *dirvec, int index) {
+void iter_setup_dirvec_constants (scene_t *sc, dvec_t *dirvec, int index) {
   while (index >= 0) {
-    obj_t *m = &objects[index];
-    double **dconst = d_const(dirvec);
-    vec_t *v = d_vec(dirvec);
-    int m_shape = o_form(m);
-
-    if (m_shape == 1) { /* rect */
-      dconst[index] = setup_rect_table(v, m);
-    } else if (m_shape == 2) { /* surface */
-      dconst[index] = setup_surface_table(v, m);
-    } else { /* second */
-      dconst[index] = setup_second_table(v, m);
-    }
+    setup_object_constants(sc, dirvec, index);
     --index;
   }
 }
 
-void setup_dirvec_constants(dvec_t *dirvec) {
-  iter_setup_dirvec_constants(dirvec, n_objects - 1);
+/* オブジェクトの形に応じた定数テーブルの長さ */
+int dconst_length(obj_t *m) {
+  int m_shape = o_form(m);
+  if (m_shape == 1) {
+    return 6;
+  } else if (m_shape == 2) {
+    return 4;
+  } else {
+    return 5;
+  }
+}
+
+/* 定数テーブル置き場を確保する。テーブルを持つ方向ベクトルは、間接光用の
+   600本と光源の1本と、鏡面反射用 (完全鏡面反射の直方体は3本、平面は1本) */
+void create_dconst_arena(scene_t *sc) {
+  int i;
+  sc->dconst_ofs = calloc(sc->n_objects + 1, sizeof(int));
+  sc->dconst_len = 0;
+  sc->dconst_cap = 5 * 120 + 1;
+  for (i = 0; i < sc->n_objects; ++i) {
+    obj_t *m = &sc->objects[i];
+    sc->dconst_ofs[i] = sc->dconst_len;
+    sc->dconst_len += dconst_length(m);
+    if (o_reflectiontype(m) == 2) {
+      sc->dconst_cap += o_form(m) == 1 ? 3 : 1;
+    }
+  }
+  sc->dconst_arena = calloc((size_t) sc->dconst_cap * sc->dconst_len + 1, sizeof(double));
+  sc->n_dconsts = 0;
+  if (sc->dconst_arena == NULL) {
+    perror("calloc");
+    exit(1);
+  }
+}
+
+/* 定数テーブル置き場を一度に解放する。テーブルを持つ方向ベクトルは使えなくなる */
+void free_dconst_arena(scene_t *sc) {
+  free(sc->dconst_arena);
+  free(sc->dconst_ofs);
+  sc->dconst_arena = NULL;
+  sc->dconst_ofs = NULL;
+  sc->dconst_cap = sc->n_dconsts = 0;
+}
+
+void setup_dirvec_constants(scene_t *sc, dvec_t *dirvec) {
+  if (sc->dconst_arena == NULL) {
+    create_dconst_arena(sc);
+  }
+  if (dirvec->cnst == NULL) {
+    assert(sc->n_dconsts < sc->dconst_cap);
+    dirvec->cnst = sc->dconst_arena + (size_t) sc->n_dconsts++ * sc->dconst_len;
+  }
+  iter_setup_dirvec_constants(sc, dirvec, sc->n_objects - 1);
 }
 
 /******************************************************************************
    直線の始点に関するテーブルを各オブジェクトに対して計算する関数群
 *****************************************************************************/
 
-void setup_startp_constants(vec_t *p, int index) {
-  if (index >= 0) {
-    obj_t *obj = &objects[index];
-    vec4_t *sconst = o_param_ctbl(obj);
+void setup_startp_constants(render_ctx_t *ctx, vec_t *p, int index) {
+  scene_t *sc = ctx->sc;
+  while (index >= 0) {
+    obj_t *obj = &sc->objects[index];
+    vec4_t *sconst = o_param_ctbl(ctx, index);
     int m_shape = o_form(obj);
 
     sconst->x = p->x - o_param_x(obj);
@@ -1139,13 +1663,13 @@ void setup_startp_constants(vec_t *p, int index) {
       sconst->w = (m_shape == 3 ? cc0 - 1.0 : cc0);
     }
 
-    setup_startp_constants(p, index - 1);
+    --index;
   }
 }
 
-void setup_startp(vec_t *p) {
-  startp_fast = *p;
-  setup_startp_constants(p, n_objects - 1);
+void setup_startp(render_ctx_t *ctx, vec_t *p) {
+  ctx->startp_fast = *p;
+  setup_startp_constants(ctx, p, ctx->sc->n_objects - 1);
 }
 
 /******************************************************************************
@@ -1194,11 +1718,12 @@ bool is_outside(obj_t *m, double q0, double q1, double q2) {
   }
 }
 
-bool check_all_inside(int ofs, int *iand, double q0, double q1, double q2) {
+bool check_all_inside(render_ctx_t *ctx, int ofs, int *iand, double q0, double q1, double q2) {
+  scene_t *sc = ctx->sc;
   int head;
   while((head = iand[ofs]) != -1){
 
-    if (is_outside(&objects[head], q0, q1, q2)) {
+    if (is_outside(&sc->objects[head], q0, q1, q2)) {
       return false;
     }
 
@@ -1209,171 +1734,798 @@ bool check_all_inside(int ofs, int *iand, double q0, double q1, double q2) {
 
 
 /******************************************************************************
-   衝突点が他の物体の影に入っているか否かを判定する関数群
+   AND グループの包含箱と BVH
 *****************************************************************************/
 
-/* 点 intersection_point から、光線ベクトルの方向に辿り、   */
-/* 物体にぶつかる (=影にはいっている) か否かを判定する。*/
+/* 交点の候補 q は AND グループのすべての要素の内部にあるので、各要素の内部を
+   含む箱の共通部分に入る。光線がこの箱を通らない AND グループは候補を生まない
+   ので、交差判定を省略できる。
 
-/**** AND ネットワーク iand の影内かどうかの判定 ****/
-bool shadow_check_and_group(int iand_ofs, int *and_group) {
+   ただし solve_each_element は t が現在の tmin + 0.01 未満の候補を採用する
+   ため、候補を調べる順番によって結果が変わりうる。出力を変えないよう、BVH で
+   集めた候補は OR 行列での順番に並べ直してから調べる */
 
-  while (and_group[iand_ofs] != -1) {
-    int obj   = and_group[iand_ofs];
-    int t0  = solver_fast(obj, &light_dirvec, &intersection_point);
-    double t0p = solver_dist;
+/* 包含箱の余裕。候補点の座標の丸め誤差を吸収する */
+#define bvh_pad(c) (1.0e-3 + 1.0e-6 * fabs(c))
 
-    if (t0 != 0 && t0p < -0.2) {
-      /* Q: 交点の候補。実際にすべてのオブジェクトに */
-      /* 入っているかどうかを調べる。*/
-      double t  = t0p + 0.01;
-      double q0 = light.x * t + intersection_point.x;
-      double q1 = light.y * t + intersection_point.y;
-      double q2 = light.z * t + intersection_point.z;
-      if (check_all_inside(0, and_group, q0, q1, q2)) {
-        return true;
+/* 2次形式 A の (i, j) 成分 */
+double quadratic_elem(obj_t *m, int i, int j) {
+  double *abc = (double *) o_param_abc(m);
+  double *rot = (double *) &m->rot123;
+  if (i == j) {
+    return abc[i];
+  } else if (o_isrot(m) == 0) {
+    return 0.0;
+  } else {
+    /* r1 は y*z, r2 は x*z, r3 は x*y 項の係数 */
+    return fhalf(rot[3 - i - j]);
+  }
+}
+
+/* オブジェクト m の内部を含む箱を [lo, hi] に求める */
+void object_bound(obj_t *m, vec_t *lo, vec_t *hi) {
+  double *lo_arr = (double *) lo;
+  double *hi_arr = (double *) hi;
+  double *abc = (double *) o_param_abc(m);
+  double *xyz = (double *) &m->xyz;
+  int m_shape = o_form(m);
+  int i;
+
+  vecset(lo, -HUGE_VAL, -HUGE_VAL, -HUGE_VAL);
+  vecset(hi,  HUGE_VAL,  HUGE_VAL,  HUGE_VAL);
+
+  if (m_shape == 1) {
+    /* 直方体 : 反転していれば外部が内側 */
+    if (!o_isinvert(m)) {
+      for (i = 0; i < 3; ++i) {
+        lo_arr[i] = xyz[i] - abc[i];
+        hi_arr[i] = xyz[i] + abc[i];
       }
-    } else {
-      /* 交点がない場合: 極性が正(内側が真)の場合、    */
-      /* AND ネットの共通部分はその内部に含まれるため、*/
-      /* 交点はないことは自明。探索を打ち切る。        */
-      if (!o_isinvert(&objects[obj])) {
-        return false;
+    }
+  } else if (m_shape == 2) {
+    /* 平面 : abc・(q - xyz) >= 0 が内側。軸に垂直な場合のみ片側を制限できる */
+    for (i = 0; i < 3; ++i) {
+      if (abc[(i + 1) % 3] == 0.0 && abc[(i + 2) % 3] == 0.0) {
+        if (fispos(abc[i])) {
+          lo_arr[i] = xyz[i];
+        } else if (fisneg(abc[i])) {
+          hi_arr[i] = xyz[i];
+        }
+      }
+    }
+  } else if (m_shape == 3 && !o_isinvert(m)) {
+    /* 2次曲面 : q^t A q < 1 が内側。A が正定値なら楕円体で、
+       その包含箱の半径は sqrt((A^-1)_ii) */
+    double a00 = quadratic_elem(m, 0, 0);
+    double a01 = quadratic_elem(m, 0, 1);
+    double a02 = quadratic_elem(m, 0, 2);
+    double a11 = quadratic_elem(m, 1, 1);
+    double a12 = quadratic_elem(m, 1, 2);
+    double a22 = quadratic_elem(m, 2, 2);
+    double c00 = a11 * a22 - a12 * a12;
+    double c11 = a00 * a22 - a02 * a02;
+    double c22 = a00 * a11 - a01 * a01;
+    double det = a00 * c00 - a01 * (a01 * a22 - a12 * a02) + a02 * (a01 * a12 - a11 * a02);
+    if (fispos(a00) && fispos(c22) && fispos(det)) {
+      double r[3];
+      r[0] = sqrt(c00 / det);
+      r[1] = sqrt(c11 / det);
+      r[2] = sqrt(c22 / det);
+      for (i = 0; i < 3; ++i) {
+        lo_arr[i] = xyz[i] - r[i];
+        hi_arr[i] = xyz[i] + r[i];
+      }
+    } else if (o_isrot(m) == 0 && !fisneg(abc[0]) && !fisneg(abc[1]) && !fisneg(abc[2])) {
+      /* 楕円柱など : 係数が正の軸だけ制限できる */
+      for (i = 0; i < 3; ++i) {
+        if (fispos(abc[i])) {
+          lo_arr[i] = xyz[i] - 1.0 / sqrt(abc[i]);
+          hi_arr[i] = xyz[i] + 1.0 / sqrt(abc[i]);
+        }
       }
     }
-
-    /* 次のオブジェクトから候補点を探す */
-    ++iand_ofs;
   }
-
-  return false;
+  /* 反転した2次曲面と円錐は有界でないとみなす */
 }
 
-/**** OR グループ or_group の影かどうかの判定 ****/
-bool shadow_check_one_or_group(int ofs, int *or_group) {
-  int head;
-  while((head = or_group[ofs]) != -1) {
-    int *and_group = and_net[head];
-    bool shadow_p = shadow_check_and_group(0, and_group);
-    if (shadow_p) {
-      return true;
+/* AND グループの包含箱を求める。共通部分が空なら偽を返す */
+bool and_group_bound(scene_t *sc, int *and_group, vec_t *lo, vec_t *hi) {
+  double *lo_arr = (double *) lo;
+  double *hi_arr = (double *) hi;
+  int ofs, i;
+
+  vecset(lo, -HUGE_VAL, -HUGE_VAL, -HUGE_VAL);
+  vecset(hi,  HUGE_VAL,  HUGE_VAL,  HUGE_VAL);
+  for (ofs = 0; and_group[ofs] != -1; ++ofs) {
+    vec_t olo, ohi;
+    double *olo_arr = (double *) &olo;
+    double *ohi_arr = (double *) &ohi;
+    object_bound(&sc->objects[and_group[ofs]], &olo, &ohi);
+    for (i = 0; i < 3; ++i) {
+      if (olo_arr[i] > lo_arr[i]) {
+        lo_arr[i] = olo_arr[i];
+      }
+      if (ohi_arr[i] < hi_arr[i]) {
+        hi_arr[i] = ohi_arr[i];
+      }
     }
-    ++ofs;
   }
-  return false;
-}
 
-/**** OR グループの列のどれかの影に入っているかどうかの判定 ****/
-bool shadow_check_one_or_matrix(int ofs, int **or_matrix) {
-
-  while(1) {
-    int *head = or_matrix[ofs];
-    int range_primitive = head[0];
-    bool test = false;
-    if (range_primitive == -1) { /* OR行列の終了マーク */
+  for (i = 0; i < 3; ++i) {
+    lo_arr[i] -= bvh_pad(lo_arr[i]);
+    hi_arr[i] += bvh_pad(hi_arr[i]);
+    if (lo_arr[i] > hi_arr[i]) {
       return false;
     }
+  }
+  return true;
+}
 
-    /* range primitive が無いか、またはrange_primitiveと交わる事を確認 */
-    if (range_primitive == 99) { /* range primitive が無い */
-      test = true;
+bool bound_is_finite(vec_t *lo, vec_t *hi) {
+  return fabs(lo->x) < HUGE_VAL && fabs(lo->y) < HUGE_VAL && fabs(lo->z) < HUGE_VAL
+    && fabs(hi->x) < HUGE_VAL && fabs(hi->y) < HUGE_VAL && fabs(hi->z) < HUGE_VAL;
+}
+
+/* 包含箱との判定用に前処理した直線 org + t * dir */
+typedef struct {
+  double org[3];
+  double inv[3];   /* 方向ベクトルの逆数。成分が 0 なら 0 */
+} bvh_ray_t;
+
+void setup_bvh_ray(bvh_ray_t *r, vec_t *org, vec_t *dir) {
+  double *org_arr = (double *) org;
+  double *dir_arr = (double *) dir;
+  int i;
+  for (i = 0; i < 3; ++i) {
+    r->org[i] = org_arr[i];
+    r->inv[i] = dir_arr[i] == 0.0 ? 0.0 : 1.0 / dir_arr[i];
+  }
+}
+
+/* 直線 r が箱 [lo, hi] を通る t の範囲を [*tn, *tf] に求める */
+bool ray_box(vec_t *lo, vec_t *hi, bvh_ray_t *r, double *tn, double *tf) {
+  double *lo_arr = (double *) lo;
+  double *hi_arr = (double *) hi;
+  double t0 = -HUGE_VAL;
+  double t1 =  HUGE_VAL;
+  int i;
+  for (i = 0; i < 3; ++i) {
+    if (r->inv[i] == 0.0) {
+      if (r->org[i] < lo_arr[i] || hi_arr[i] < r->org[i]) {
+        return false;
+      }
     } else {
-      int t = solver_fast(range_primitive, &light_dirvec, &intersection_point);
-      /* range primitive とぶつからなければ */
-      /* or group との交点はない            */
-      test = (t != 0 && solver_dist < -0.1 && shadow_check_one_or_group(1, head));
+      double ta = (lo_arr[i] - r->org[i]) * r->inv[i];
+      double tb = (hi_arr[i] - r->org[i]) * r->inv[i];
+      if (ta > tb) {
+        double tmp = ta;
+        ta = tb;
+        tb = tmp;
+      }
+      if (ta > t0) {
+        t0 = ta;
+      }
+      if (tb < t1) {
+        t1 = tb;
+      }
     }
+  }
+  *tn = t0;
+  *tf = t1;
+  return t0 <= t1;
+}
 
-    if (test && shadow_check_one_or_group(1, head)) {
-      return true; /* 交点があるので、影に入る事が判明。探索終了 */
+/* index[first] 〜 index[first + n - 1] の要素から節点 node 以下の木を作る */
+void build_bvh_node(bvh_t *b, int node, int first, int n) {
+  bvh_node_t *nd = &b->nodes[node];
+  vec_t clo, chi;
+  double *clo_arr = (double *) &clo;
+  double *chi_arr = (double *) &chi;
+  double *lo = (double *) &nd->lo;
+  double *hi = (double *) &nd->hi;
+  double mid;
+  int axis, i, j;
+
+  /* 節点の箱と、要素の中心の範囲を求める */
+  nd->lo = b->items[b->index[first]].lo;
+  nd->hi = b->items[b->index[first]].hi;
+  for (i = first; i < first + n; ++i) {
+    bvh_item_t *it = &b->items[b->index[i]];
+    double *ilo = (double *) &it->lo;
+    double *ihi = (double *) &it->hi;
+    vec_t c;
+    double *c_arr = (double *) &c;
+    c.x = fhalf(it->lo.x + it->hi.x);
+    c.y = fhalf(it->lo.y + it->hi.y);
+    c.z = fhalf(it->lo.z + it->hi.z);
+    if (i == first) {
+      clo = chi = c;
+    }
+    for (j = 0; j < 3; ++j) {
+      if (ilo[j] < lo[j]) {
+        lo[j] = ilo[j];
+      }
+      if (ihi[j] > hi[j]) {
+        hi[j] = ihi[j];
+      }
+      if (c_arr[j] < clo_arr[j]) {
+        clo_arr[j] = c_arr[j];
+      }
+      if (c_arr[j] > chi_arr[j]) {
+        chi_arr[j] = c_arr[j];
+      }
     }
+  }
 
-    ++ofs;
+  if (n == 1) {
+    nd->child = first;
+    nd->n = 1;
+    return;
+  }
 
+  /* 中心の広がりが最も大きい軸の中点で分ける */
+  axis = 0;
+  for (j = 1; j < 3; ++j) {
+    if (chi_arr[j] - clo_arr[j] > chi_arr[axis] - clo_arr[axis]) {
+      axis = j;
+    }
+  }
+  mid = fhalf(clo_arr[axis] + chi_arr[axis]);
+  i = first;
+  j = first + n - 1;
+  while (i <= j) {
+    bvh_item_t *it = &b->items[b->index[i]];
+    if (fhalf(((double *) &it->lo)[axis] + ((double *) &it->hi)[axis]) < mid) {
+      ++i;
+    } else {
+      int tmp = b->index[i];
+      b->index[i] = b->index[j];
+      b->index[j--] = tmp;
+    }
+  }
+  if (i == first || i == first + n) {
+    /* 中心が揃っている場合は半分に分ける */
+    i = first + n / 2;
   }
 
-  return false;
+  nd->child = b->n_nodes;
+  nd->n = 0;
+  b->n_nodes += 2;
+  build_bvh_node(b, nd->child,     first, i - first);
+  build_bvh_node(b, nd->child + 1, i,     first + n - i);
 }
 
+void free_bvh(bvh_t *b) {
+  free(b->items);
+  free(b->index);
+  free(b->unbounded);
+  free(b->nodes);
+  free(b);
+}
 
-/******************************************************************************
-   光線と物体の交差判定
-*****************************************************************************/
+/* OR 行列に現れる AND グループのうち交点を持ちうるものの包含箱を、
+   OR 行列を先頭から辿った順に並べて返す。その数を *n に入れる */
+bvh_item_t *collect_group_bounds(scene_t *sc, int *n) {
+  bvh_item_t *items;
+  int row, ofs, cap = 0;
 
-/**** あるANDネットワークが、レイトレースの方向に対し、****/
-/**** 交点があるかどうかを調べる。                    ****/
-void solve_each_element(int iand_ofs, int *and_group, vec_t *dirvec) {
-  int iobj;
-  while ((iobj = and_group[iand_ofs]) != -1) {
-    int t0 = solver(iobj, dirvec, &startp);
-    if (t0 != 0) {
-      /* 交点がある時は、その交点が他の要素の中に含まれるかどうか調べる。*/
-      /* 今までの中で最小の t の値と比べる。*/
-      double t0p = solver_dist;
-      if (0.0 < t0p && t0p < tmin) {
-        double t = t0p + 0.01;
-        vec_t *v = dirvec;
-        double q0 = v->x * t + startp.x;
-        double q1 = v->y * t + startp.y;
-        double q2 = v->z * t + startp.z;
-        if (check_all_inside(0, and_group, q0, q1, q2)) {
-          tmin = t;
-          vecset(&intersection_point, q0, q1, q2);
-          intersected_object_id = iobj;
-          intsec_rectside = t0;
-        }
-      }
-    } else {
-      /* 交点がなく、しかもその物体は内側が真ならこれ以上交点はない */
-      if (!o_isinvert(&objects[iobj])) {
-        return;
+  for (row = 0; sc->or_net[row][0] != -1; ++row) {
+    for (ofs = 1; sc->or_net[row][ofs] != -1; ++ofs) {
+      ++cap;
+    }
+  }
+  items = calloc(cap + 1, sizeof(bvh_item_t));
+
+  *n = 0;
+  for (row = 0; sc->or_net[row][0] != -1; ++row) {
+    for (ofs = 1; sc->or_net[row][ofs] != -1; ++ofs) {
+      bvh_item_t *it = &items[*n];
+      it->row = row;
+      it->and_group = sc->and_net[sc->or_net[row][ofs]];
+      /* 空の AND グループと、共通部分が空のものは交点を持たない */
+      if (it->and_group[0] == -1 || !and_group_bound(sc, it->and_group, &it->lo, &it->hi)) {
+        continue;
       }
+      ++*n;
     }
-    ++iand_ofs;
   }
+  return items;
 }
 
+/* 包含箱を持つ AND グループがこれより少ないシーンでは、箱の判定の手間が
+   省ける交差判定の手間を上回るので BVH を使わない */
+#define BVH_MIN_ITEMS 12
+
+/* read_parameter の後に呼び、OR 行列の各 AND グループの BVH を作る。
+   force が偽なら、小さなシーンでは作らない */
+void build_bvh(scene_t *sc, bool force) {
+  bvh_t *b = calloc(1, sizeof(bvh_t));
+  int n_bounded = 0;
+  int i, n;
+
+  b->items = collect_group_bounds(sc, &b->n_items);
+  n = b->n_items;
+  b->index = calloc(n + 1, sizeof(int));
+  b->unbounded = calloc(n + 1, sizeof(int));
+  b->nodes = calloc(2 * n + 1, sizeof(bvh_node_t));
+
+  for (i = 0; i < n; ++i) {
+    bvh_item_t *it = &b->items[i];
+    if (bound_is_finite(&it->lo, &it->hi)) {
+      b->index[n_bounded++] = i;
+    } else {
+      b->unbounded[b->n_unbounded++] = i;
+    }
+  }
 
-/**** 1つの OR-group について交点を調べる ****/
-void solve_one_or_network(int ofs, int *or_group, vec_t *dirvec) {
-  int head;
-  while ((head = or_group[ofs]) != -1) {
-    int *and_group = and_net[head];
-    solve_each_element(0, and_group, dirvec);
-    ++ofs;
+  if (!force && n_bounded < BVH_MIN_ITEMS) {
+    free_bvh(b);
+    return;
   }
+  if (n_bounded > 0) {
+    b->n_nodes = 1;
+    build_bvh_node(b, 0, 0, n_bounded);
+  }
+  sc->bvh = b;
 }
 
+/* 直線 org + t * dir が t_lo < t < t_hi の範囲で包含箱を通る要素を集め、
+   OR 行列での順に ctx->bvh_hits に並べる。候補の数を返す */
+int bvh_collect(render_ctx_t *ctx, vec_t *org, vec_t *dir, double t_lo, double t_hi) {
+  bvh_t *b = ctx->sc->bvh;
+  bvh_hit_t *hits = ctx->bvh_hits;
+  int *stack = ctx->bvh_stack;
+  int n = 0, sp = 0;
+  bvh_ray_t r;
+  double tn, tf;
+  int i, j;
+
+  setup_bvh_ray(&r, org, dir);
+
+  for (i = 0; i < b->n_unbounded; ++i) {
+    bvh_item_t *it = &b->items[b->unbounded[i]];
+    if (ray_box(&it->lo, &it->hi, &r, &tn, &tf) && t_lo < tf && tn < t_hi) {
+      hits[n].id = b->unbounded[i];
+      hits[n++].tnear = tn;
+    }
+  }
 
-/**** ORマトリクス全体について交点を調べる。****/
-void trace_or_matrix(int ofs, int **or_network, vec_t *dirvec) {
-  while (1) { /* 全オブジェクト終了 */
-    int *head = or_network[ofs++];
-    int range_primitive = head[0];
-    if (range_primitive == -1) {
-      return;
+  if (b->n_nodes > 0) {
+    stack[sp++] = 0;
+  }
+  while (sp > 0) {
+    bvh_node_t *nd = &b->nodes[stack[--sp]];
+    if (!ray_box(&nd->lo, &nd->hi, &r, &tn, &tf) || !(t_lo < tf && tn < t_hi)) {
+      continue;
     }
-    if (range_primitive == 99) { /* range primitive なし */
-      solve_one_or_network(1, head, dirvec);
+    if (nd->n == 0) {
+      stack[sp++] = nd->child + 1;
+      stack[sp++] = nd->child;
     } else {
-      /* range primitive の衝突しなければ交点はない */
-      double t = solver(range_primitive, dirvec, &startp);
-      if (t != 0 && solver_dist < tmin) {
-        solve_one_or_network(1, head, dirvec);
-      }
+      /* 葉の箱は要素の箱そのもの */
+      hits[n].id = b->index[nd->child];
+      hits[n++].tnear = tn;
     }
   }
-}
 
-/**** トレース本体 ****/
-/* トレース開始点 ViewPoint と、その点からのスキャン方向ベクトル */
+  /* OR 行列での順番に並べ直す (候補は少ないので挿入ソート) */
+  for (i = 1; i < n; ++i) {
+    bvh_hit_t h = hits[i];
+    for (j = i; j > 0 && hits[j - 1].id > h.id; --j) {
+      hits[j] = hits[j - 1];
+    }
+    hits[j] = h;
+  }
+  return n;
+}
+
+
+/******************************************************************************
+   衝突点が他の物体の影に入っているか否かを判定する関数群
+*****************************************************************************/
+
+/* 点 intersection_point から、光線ベクトルの方向に辿り、   */
+/* 物体にぶつかる (=影にはいっている) か否かを判定する。*/
+
+/**** AND ネットワーク iand の影内かどうかの判定 ****/
+bool shadow_check_and_group(render_ctx_t *ctx, int iand_ofs, int *and_group) {
+  scene_t *sc = ctx->sc;
+
+  while (and_group[iand_ofs] != -1) {
+    int obj   = and_group[iand_ofs];
+    int t0  = solver_fast(ctx, obj, &sc->light_dirvec, &ctx->intersection_point);
+    double t0p = ctx->solver_dist;
+
+    if (t0 != 0 && t0p < -0.2) {
+      /* Q: 交点の候補。実際にすべてのオブジェクトに */
+      /* 入っているかどうかを調べる。*/
+      double t  = t0p + 0.01;
+      double q0 = sc->light.x * t + ctx->intersection_point.x;
+      double q1 = sc->light.y * t + ctx->intersection_point.y;
+      double q2 = sc->light.z * t + ctx->intersection_point.z;
+      if (check_all_inside(ctx, 0, and_group, q0, q1, q2)) {
+        return true;
+      }
+    } else {
+      /* 交点がない場合: 極性が正(内側が真)の場合、    */
+      /* AND ネットの共通部分はその内部に含まれるため、*/
+      /* 交点はないことは自明。探索を打ち切る。        */
+      if (!o_isinvert(&sc->objects[obj])) {
+        return false;
+      }
+    }
+
+    /* 次のオブジェクトから候補点を探す */
+    ++iand_ofs;
+  }
+
+  return false;
+}
+
+/* shadow_check_last_occluder の結果 */
+#define LAST_NONE   0 /* 影を落とした AND グループの記録が無い */
+#define LAST_MISSED 1 /* 記録した行の range primitive と交わらない */
+#define LAST_PASSED 2 /* range primitive とは交わるが、記録した AND グループの影ではない */
+#define LAST_HIT    3 /* 記録した AND グループの影に入る */
+
+/**** 直前に影を落とした AND グループの影に入っているかどうかの判定 ****/
+/* 隣り合う交点は同じ物体の影に入っていることが多いので、全体を調べる前に
+   試す。影の判定は交点と光源だけで決まり、結果は全グループの OR なので、
+   ここで影と分かれば全体を調べても影になる。影でなければ、分かったことを
+   全体の探索で使い回す */
+int shadow_check_last_occluder(render_ctx_t *ctx) {
+  scene_t *sc = ctx->sc;
+  int range_primitive;
+  if (ctx->shadow_group == NULL) {
+    return LAST_NONE;
+  }
+  range_primitive = sc->or_net[ctx->shadow_row][0];
+  if (range_primitive != 99) {
+    int t = solver_fast(ctx, range_primitive, &sc->light_dirvec, &ctx->intersection_point);
+    if (t == 0 || ctx->solver_dist >= -0.1) {
+      return LAST_MISSED;
+    }
+  }
+  return shadow_check_and_group(ctx, 0, ctx->shadow_group) ? LAST_HIT : LAST_PASSED;
+}
+
+/**** OR 行列の row 行目 (先頭は head) の range primitive と交わるかどうかの判定 ****/
+/* last は shadow_check_last_occluder の結果。記録した行なら解き直さない */
+bool shadow_check_range(render_ctx_t *ctx, int *head, int row, int last) {
+  int range_primitive = head[0];
+  int t;
+  if (last != LAST_NONE && row == ctx->shadow_row) {
+    return last == LAST_PASSED;
+  }
+  if (range_primitive == 99) { /* range primitive が無い */
+    return true;
+  }
+  t = solver_fast(ctx, range_primitive, &ctx->sc->light_dirvec, &ctx->intersection_point);
+  /* range primitive とぶつからなければ */
+  /* or group との交点はない            */
+  return (t != 0 && ctx->solver_dist < -0.1);
+}
+
+/**** OR グループ or_group の影かどうかの判定 ****/
+/* skip は影を落とさないと分かっている AND グループ (無ければ NULL) */
+bool shadow_check_one_or_group(render_ctx_t *ctx, int ofs, int *or_group, int *skip) {
+  scene_t *sc = ctx->sc;
+  int head;
+  while((head = or_group[ofs]) != -1) {
+    int *and_group = sc->and_net[head];
+    if (and_group != skip && shadow_check_and_group(ctx, 0, and_group)) {
+      ctx->shadow_group = and_group;
+      return true;
+    }
+    ++ofs;
+  }
+  return false;
+}
+
+/**** OR 行列の順に集めた要素 it の影に入っているかどうかの判定 ****/
+/* *row と *test は直前に調べた要素の行と、その行の range primitive と交わるか。
+   行が変わったときだけ range primitive を確認する */
+bool shadow_check_item(render_ctx_t *ctx, bvh_item_t *it, int *row, bool *test, int last, int *skip) {
+  if (it->row != *row) {
+    *row = it->row;
+    *test = shadow_check_range(ctx, ctx->sc->or_net[*row], *row, last);
+  }
+  if (*test && it->and_group != skip && shadow_check_and_group(ctx, 0, it->and_group)) {
+    ctx->shadow_row = it->row;
+    ctx->shadow_group = it->and_group;
+    return true;
+  }
+  return false;
+}
+
+/**** shadow_check_one_or_matrix の BVH 版 ****/
+bool shadow_check_bvh(render_ctx_t *ctx, int last) {
+  scene_t *sc = ctx->sc;
+  /* 候補点は t0p + 0.01 < -0.19 の範囲にある */
+  int n = bvh_collect(ctx, &ctx->intersection_point, &sc->light, -HUGE_VAL, -0.19);
+  int *skip = last == LAST_PASSED ? ctx->shadow_group : NULL;
+  int row = -1;
+  bool test = false;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    if (shadow_check_item(ctx, &sc->bvh->items[ctx->bvh_hits[i].id], &row, &test, last, skip)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**** 影の格子で点 p を含むセルの要素の列を求める ****/
+/* wide の要素は含まない。格子の外なら空。要素の数を *n に入れる */
+int *light_map_items(light_map_t *lm, vec_t *p, int *n) {
+  double fu = (veciprod(p, &lm->u) - lm->u0) / lm->cell;
+  double fv = (veciprod(p, &lm->v) - lm->v0) / lm->cell;
+  int c;
+  if (!(fu >= 0.0 && fu < lm->nu && fv >= 0.0 && fv < lm->nv)) {
+    *n = 0;
+    return lm->cell_items;
+  }
+  c = (int) fv * lm->nu + (int) fu;
+  *n = lm->cell_start[c + 1] - lm->cell_start[c];
+  return &lm->cell_items[lm->cell_start[c]];
+}
+
+/**** shadow_check_one_or_matrix の影の格子版 ****/
+/* 光源の方向に見て交点と重なり、交点より光源側にある要素だけを調べる。
+   セルの要素と wide の要素はどちらも OR 行列の順なので、併合しながら辿る */
+bool shadow_check_light_map(render_ctx_t *ctx, int last) {
+  light_map_t *lm = ctx->sc->light_map;
+  vec_t *p = &ctx->intersection_point;
+  /* 候補点の深さは交点より 0.19 以上浅い。丸め誤差の分だけ余裕を持たせる */
+  double w_cand = veciprod(p, &lm->w) - 0.18;
+  int *skip = last == LAST_PASSED ? ctx->shadow_group : NULL;
+  int row = -1;
+  bool test = false;
+  int n, i = 0, j = 0;
+  int *ids = light_map_items(lm, p, &n);
+
+  while (i < n || j < lm->n_wide) {
+    int id;
+    if (j >= lm->n_wide || (i < n && ids[i] < lm->wide[j])) {
+      id = ids[i++];
+    } else {
+      id = lm->wide[j++];
+    }
+    if (lm->wmin[id] < w_cand &&
+        shadow_check_item(ctx, &lm->items[id], &row, &test, last, skip)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void free_light_map(light_map_t *lm) {
+  free(lm->items);
+  free(lm->wmin);
+  free(lm->cell_start);
+  free(lm->cell_items);
+  free(lm->wide);
+  free(lm->cells);
+  free(lm);
+}
+
+/* 速い版の影の格子のセルの種類 */
+#define LIGHT_CELL_EXACT  0 /* 格子からは決めない */
+#define LIGHT_CELL_LIT    1 /* 深さ w_hi まで照らされる */
+#define LIGHT_CELL_SHADOW 2 /* 深さ w_lo から影になる */
+#define LIGHT_CELL_PLANE  3 /* depth, du, dv の平面より深ければ影 */
+
+/* light_map_fast の結果 */
+#define LIGHT_UNKNOWN 0
+#define LIGHT_LIT     1
+#define LIGHT_SHADOW  2
+
+/**** 速い版の影の格子で点 p が影かどうかを決める ****/
+/* 格子の外や、影になり始める深さに近い点は LIGHT_UNKNOWN を返す */
+int light_map_fast(light_map_t *lm, vec_t *p) {
+  double pu = veciprod(p, &lm->u);
+  double pv = veciprod(p, &lm->v);
+  double pw = veciprod(p, &lm->w);
+  double fu = (pu - lm->u0) / lm->cell;
+  double fv = (pv - lm->v0) / lm->cell;
+  light_cell_t *c;
+  double d;
+  if (!(fu >= 0.0 && fu < lm->nu && fv >= 0.0 && fv < lm->nv) ||
+      !(pw >= lm->w_lo && pw <= lm->w_hi)) {
+    return LIGHT_UNKNOWN;
+  }
+  c = &lm->cells[(int) fv * lm->nu + (int) fu];
+  switch (c->kind) {
+  case LIGHT_CELL_LIT:
+    return LIGHT_LIT;
+  case LIGHT_CELL_SHADOW:
+    return LIGHT_SHADOW;
+  case LIGHT_CELL_PLANE:
+    /* セルの中心からのずれの分だけ深さを補正する */
+    d = c->depth + c->du * (fu - (int) fu - 0.5) + c->dv * (fv - (int) fv - 0.5);
+    if (pw < d - lm->band) {
+      return LIGHT_LIT;
+    } else if (pw > d + lm->band) {
+      return LIGHT_SHADOW;
+    }
+    return LIGHT_UNKNOWN;
+  default:
+    return LIGHT_UNKNOWN;
+  }
+}
+
+/**** OR グループの列のどれかの影に入っているかどうかの判定 ****/
+bool shadow_check_one_or_matrix(render_ctx_t *ctx, int ofs, int **or_matrix) {
+  scene_t *sc = ctx->sc;
+  int last;
+
+  ++ctx->count.n_rays;
+  ++ctx->count.n_shadow;
+  if (sc->light_map != NULL && sc->light_map->fast) {
+    int lit = light_map_fast(sc->light_map, &ctx->intersection_point);
+    if (lit != LIGHT_UNKNOWN) {
+      ++ctx->count.n_map_hits;
+      ctx->count.n_shadowed += lit == LIGHT_SHADOW;
+      return lit == LIGHT_SHADOW;
+    }
+  }
+  last = shadow_check_last_occluder(ctx);
+  if (last == LAST_HIT) {
+    ++ctx->count.n_cache_hits;
+    ++ctx->count.n_shadowed;
+    return true;
+  }
+  if (sc->light_map != NULL) {
+    bool shadow_p = shadow_check_light_map(ctx, last);
+    ctx->count.n_shadowed += shadow_p;
+    return shadow_p;
+  }
+  if (sc->bvh != NULL) {
+    bool shadow_p = shadow_check_bvh(ctx, last);
+    ctx->count.n_shadowed += shadow_p;
+    return shadow_p;
+  }
+
+  while(1) {
+    int *head = or_matrix[ofs];
+    int *skip = (last == LAST_PASSED && ofs == ctx->shadow_row) ? ctx->shadow_group : NULL;
+    if (head[0] == -1) { /* OR行列の終了マーク */
+      return false;
+    }
+
+    /* range primitive が無いか、またはrange_primitiveと交わる事を確認 */
+    if (shadow_check_range(ctx, head, ofs, last) &&
+        shadow_check_one_or_group(ctx, 1, head, skip)) {
+      ctx->shadow_row = ofs;
+      ++ctx->count.n_shadowed;
+      return true; /* 交点があるので、影に入る事が判明。探索終了 */
+    }
+
+    ++ofs;
+
+  }
+
+  return false;
+}
+
+
+/******************************************************************************
+   光線と物体の交差判定
+*****************************************************************************/
+
+/**** あるANDネットワークが、レイトレースの方向に対し、****/
+/**** 交点があるかどうかを調べる。                    ****/
+void solve_each_element(render_ctx_t *ctx, int iand_ofs, int *and_group, vec_t *dirvec) {
+  scene_t *sc = ctx->sc;
+  int iobj;
+  while ((iobj = and_group[iand_ofs]) != -1) {
+    int t0 = solver(ctx, iobj, dirvec, &ctx->startp);
+    if (t0 != 0) {
+      /* 交点がある時は、その交点が他の要素の中に含まれるかどうか調べる。*/
+      /* 今までの中で最小の t の値と比べる。*/
+      double t0p = ctx->solver_dist;
+      if (0.0 < t0p && t0p < ctx->tmin) {
+        double t = t0p + 0.01;
+        vec_t *v = dirvec;
+        double q0 = v->x * t + ctx->startp.x;
+        double q1 = v->y * t + ctx->startp.y;
+        double q2 = v->z * t + ctx->startp.z;
+        if (check_all_inside(ctx, 0, and_group, q0, q1, q2)) {
+          ctx->tmin = t;
+          vecset(&ctx->intersection_point, q0, q1, q2);
+          ctx->intersected_object_id = iobj;
+          ctx->intsec_rectside = t0;
+        }
+      }
+    } else {
+      /* 交点がなく、しかもその物体は内側が真ならこれ以上交点はない */
+      if (!o_isinvert(&sc->objects[iobj])) {
+        STAT_INC(ctx, and_early_exits);
+        return;
+      }
+    }
+    ++iand_ofs;
+  }
+}
+
+
+/**** 1つの OR-group について交点を調べる ****/
+void solve_one_or_network(render_ctx_t *ctx, int ofs, int *or_group, vec_t *dirvec) {
+  scene_t *sc = ctx->sc;
+  int head;
+  while ((head = or_group[ofs]) != -1) {
+    int *and_group = sc->and_net[head];
+    solve_each_element(ctx, 0, and_group, dirvec);
+    ++ofs;
+  }
+}
+
+
+/**** ORマトリクス全体について交点を調べる。****/
+void trace_or_matrix(render_ctx_t *ctx, int ofs, int **or_network, vec_t *dirvec) {
+  while (1) { /* 全オブジェクト終了 */
+    int *head = or_network[ofs++];
+    int range_primitive = head[0];
+    if (range_primitive == -1) {
+      return;
+    }
+    if (range_primitive == 99) { /* range primitive なし */
+      solve_one_or_network(ctx, 1, head, dirvec);
+    } else {
+      /* range primitive の衝突しなければ交点はない */
+      double t = solver(ctx, range_primitive, dirvec, &ctx->startp);
+      if (t != 0 && ctx->solver_dist < ctx->tmin) {
+        solve_one_or_network(ctx, 1, head, dirvec);
+      }
+    }
+  }
+}
+
+/**** trace_or_matrix の BVH 版 ****/
+/* 包含箱を通る AND グループだけを OR 行列での順に調べる */
+void trace_bvh(render_ctx_t *ctx, vec_t *dirvec) {
+  scene_t *sc = ctx->sc;
+  /* 候補点は 0.01 < t0p + 0.01 < tmin + 0.01 の範囲にある */
+  int n = bvh_collect(ctx, &ctx->startp, dirvec, 0.01, ctx->tmin + 0.01);
+  int row = -1;
+  bool test = false;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    bvh_hit_t *h = &ctx->bvh_hits[i];
+    bvh_item_t *it = &sc->bvh->items[h->id];
+    if (it->row != row) {
+      /* 行が変わったら、その時点の tmin で range primitive を確認 */
+      int range_primitive = sc->or_net[it->row][0];
+      row = it->row;
+      if (range_primitive == 99) {
+        test = true;
+      } else {
+        int t = solver(ctx, range_primitive, dirvec, &ctx->startp);
+        test = (t != 0 && ctx->solver_dist < ctx->tmin);
+      }
+    }
+    if (test && h->tnear < ctx->tmin + 0.01) {
+      solve_each_element(ctx, 0, it->and_group, dirvec);
+    }
+  }
+}
+
+/**** トレース本体 ****/
+/* トレース開始点 ViewPoint と、その点からのスキャン方向ベクトル */
 /* Vscan から、交点 crashed_point と衝突したオブジェクト        */
 /* crashed_object を返す。関数自体の返り値は交点の有無の真偽値。 */
-bool judge_intersection(vec_t *dirvec) {
+bool judge_intersection(render_ctx_t *ctx, vec_t *dirvec) {
   double t;
-  tmin = 1000000000.0;
-  trace_or_matrix(0, or_net, dirvec);
-  t = tmin;
+  ctx->tmin = 1000000000.0;
+  ++ctx->count.n_rays;
+  if (ctx->sc->bvh != NULL) {
+    trace_bvh(ctx, dirvec);
+  } else {
+    trace_or_matrix(ctx, 0, ctx->sc->or_net, dirvec);
+  }
+  t = ctx->tmin;
   if (-0.1 < t) {
     return t < 100000000.0;
   }
@@ -1384,44 +2536,47 @@ bool judge_intersection(vec_t *dirvec) {
    光線と物体の交差判定 高速版
 *****************************************************************************/
 
-void solve_each_element_fast(int iand_ofs, int *and_group, dvec_t *dirvec) {
+void solve_each_element_fast(render_ctx_t *ctx, int iand_ofs, int *and_group, dvec_t *dirvec) {
+  scene_t *sc = ctx->sc;
   vec_t *vec = d_vec(dirvec);
   int iobj;
   while ((iobj = and_group[iand_ofs++]) != -1) {
-    int t0 = solver_fast2(iobj, dirvec);
+    int t0 = solver_fast2(ctx, iobj, dirvec);
     if (t0 != 0) {
       /* 交点がある時は、その交点が他の要素の中に含まれるかどうか調べる。*/
       /* 今までの中で最小の t の値と比べる。*/
-      if (0.0 < solver_dist && solver_dist < tmin) {
-        double t  = solver_dist + 0.01;
-        double q0 = vec->x * t + startp_fast.x;
-        double q1 = vec->y * t + startp_fast.y;
-        double q2 = vec->z * t + startp_fast.z;
-        if (check_all_inside(0, and_group, q0, q1, q2)) {
-          tmin = t;
-          vecset(&intersection_point, q0, q1, q2);
-          intersected_object_id = iobj;
-          intsec_rectside = t0;
+      if (0.0 < ctx->solver_dist && ctx->solver_dist < ctx->tmin) {
+        double t  = ctx->solver_dist + 0.01;
+        double q0 = vec->x * t + ctx->startp_fast.x;
+        double q1 = vec->y * t + ctx->startp_fast.y;
+        double q2 = vec->z * t + ctx->startp_fast.z;
+        if (check_all_inside(ctx, 0, and_group, q0, q1, q2)) {
+          ctx->tmin = t;
+          vecset(&ctx->intersection_point, q0, q1, q2);
+          ctx->intersected_object_id = iobj;
+          ctx->intsec_rectside = t0;
         }
       }
-    } else if (!o_isinvert(&objects[iobj])) {
+    } else if (!o_isinvert(&sc->objects[iobj])) {
       /* 交点がなく、しかもその物体は内側が真ならこれ以上交点はない */
+      STAT_INC(ctx, and_early_exits);
       return;
     }
   }
 }
 
 /**** 1つの OR-group について交点を調べる ****/
-void solve_one_or_network_fast(int ofs, int *or_group, dvec_t *dirvec) {
+void solve_one_or_network_fast(render_ctx_t *ctx, int ofs, int *or_group, dvec_t *dirvec) {
+  scene_t *sc = ctx->sc;
   int head;
   while ((head = or_group[ofs++]) != -1) {
-    int *and_group = and_net[head];
-    solve_each_element_fast(0, and_group, dirvec);
+    int *and_group = sc->and_net[head];
+    solve_each_element_fast(ctx, 0, and_group, dirvec);
   }
 }
 
 /**** ORマトリクス全体について交点を調べる。****/
-void trace_or_matrix_fast(int ofs, int **or_network, dvec_t *dirvec) {
+void trace_or_matrix_fast(render_ctx_t *ctx, int ofs, int **or_network, dvec_t *dirvec) {
   while (1) {
     int *head = or_network[ofs++];
     int range_primitive = head[0];
@@ -1429,23 +2584,56 @@ void trace_or_matrix_fast(int ofs, int **or_network, dvec_t *dirvec) {
       return;
     }
     if (range_primitive == 99) { /* range primitive なし */
-      solve_one_or_network_fast(1, head, dirvec);
+      solve_one_or_network_fast(ctx, 1, head, dirvec);
     } else {
       /* range primitive の衝突しなければ交点はない */
-      double t = solver_fast2(range_primitive, dirvec);
-      if (t != 0 && solver_dist < tmin) {
-        solve_one_or_network_fast(1, head, dirvec);
+      double t = solver_fast2(ctx, range_primitive, dirvec);
+      if (t != 0 && ctx->solver_dist < ctx->tmin) {
+        solve_one_or_network_fast(ctx, 1, head, dirvec);
+      }
+    }
+  }
+}
+
+/**** trace_or_matrix_fast の BVH 版 ****/
+void trace_bvh_fast(render_ctx_t *ctx, dvec_t *dirvec) {
+  scene_t *sc = ctx->sc;
+  int n = bvh_collect(ctx, &ctx->startp_fast, d_vec(dirvec), 0.01, ctx->tmin + 0.01);
+  int row = -1;
+  bool test = false;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    bvh_hit_t *h = &ctx->bvh_hits[i];
+    bvh_item_t *it = &sc->bvh->items[h->id];
+    if (it->row != row) {
+      int range_primitive = sc->or_net[it->row][0];
+      row = it->row;
+      if (range_primitive == 99) {
+        test = true;
+      } else {
+        int t = solver_fast2(ctx, range_primitive, dirvec);
+        test = (t != 0 && ctx->solver_dist < ctx->tmin);
       }
     }
+    if (test && h->tnear < ctx->tmin + 0.01) {
+      solve_each_element_fast(ctx, 0, it->and_group, dirvec);
+    }
   }
 }
 
+
 /**** トレース本体 ****/
-bool judge_intersection_fast(dvec_t *dirvec) {
+bool judge_intersection_fast(render_ctx_t *ctx, dvec_t *dirvec) {
   double t;
-  tmin = 1000000000.0;
-  trace_or_matrix_fast(0, or_net, dirvec);
-  t = tmin;
+  ctx->tmin = 1000000000.0;
+  ++ctx->count.n_rays;
+  if (ctx->sc->bvh != NULL) {
+    trace_bvh_fast(ctx, dirvec);
+  } else {
+    trace_or_matrix_fast(ctx, 0, ctx->sc->or_net, dirvec);
+  }
+  t = ctx->tmin;
   if (-0.1 < t) {
     return t < 100000000.0;
   } else {
@@ -1453,7 +2641,6 @@ bool judge_intersection_fast(dvec_t *dirvec) {
   }
 }
 
-
 /******************************************************************************
    物体と光の交差点の法線ベクトルを求める関数
 *****************************************************************************/
@@ -1462,19 +2649,19 @@ bool judge_intersection_fast(dvec_t *dirvec) {
 /* 衝突したオブジェクトを求めた際の solver の返り値を */
 /* 変数 intsec_rectside 経由で渡してやる必要がある。 */
 /* nvector もグローバル。 */
-void get_nvector_rect(vec_t *dirvec) {
-  int rectside = intsec_rectside;
+void get_nvector_rect(render_ctx_t *ctx, vec_t *dirvec) {
+  int rectside = ctx->intsec_rectside;
   /* solver の返り値はぶつかった面の方向を示す */
-  vecbzero(&nvector);
+  vecbzero(&ctx->nvector);
   switch(rectside-1) {
   case 0:
-    nvector.x = fneg(sgn(dirvec->x));
+    ctx->nvector.x = fneg(sgn(dirvec->x));
     break;
   case 1:
-    nvector.y = fneg(sgn(dirvec->y));
+    ctx->nvector.y = fneg(sgn(dirvec->y));
     break;
   case 2:
-    nvector.z = fneg(sgn(dirvec->z));
+    ctx->nvector.z = fneg(sgn(dirvec->z));
     break;
   default:
     abort(); /* Error */
@@ -1484,43 +2671,43 @@ void get_nvector_rect(vec_t *dirvec) {
 
 
 /* 平面 */
-void get_nvector_plane(obj_t *m) {
+void get_nvector_plane(render_ctx_t *ctx, obj_t *m) {
   /* m_invert は常に true のはず */
-  nvector.x = fneg(o_param_a(m));
-  nvector.y = fneg(o_param_b(m));
-  nvector.z = fneg(o_param_c(m));
+  ctx->nvector.x = fneg(o_param_a(m));
+  ctx->nvector.y = fneg(o_param_b(m));
+  ctx->nvector.z = fneg(o_param_c(m));
 }
 
 /* 2次曲面 :  grad x^t A x = 2 A x を正規化する */
-void get_nvector_second(obj_t *m) {
-  double p0 = intersection_point.x - o_param_x(m);
-  double p1 = intersection_point.y - o_param_y(m);
-  double p2 = intersection_point.z - o_param_z(m);
+void get_nvector_second(render_ctx_t *ctx, obj_t *m) {
+  double p0 = ctx->intersection_point.x - o_param_x(m);
+  double p1 = ctx->intersection_point.y - o_param_y(m);
+  double p2 = ctx->intersection_point.z - o_param_z(m);
 
   double d0 = p0 * o_param_a(m);
   double d1 = p1 * o_param_b(m);
   double d2 = p2 * o_param_c(m);
 
   if (o_isrot(m) == 0) {
-    nvector.x = d0;
-    nvector.y = d1;
-    nvector.z = d2;
+    ctx->nvector.x = d0;
+    ctx->nvector.y = d1;
+    ctx->nvector.z = d2;
   } else {
-    nvector.x = d0 + fhalf(p1 * o_param_r3(m) + p2 * o_param_r2(m));
-    nvector.y = d1 + fhalf(p0 * o_param_r3(m) + p2 * o_param_r1(m));
-    nvector.z = d2 + fhalf(p0 * o_param_r2(m) + p1 * o_param_r1(m));
+    ctx->nvector.x = d0 + fhalf(p1 * o_param_r3(m) + p2 * o_param_r2(m));
+    ctx->nvector.y = d1 + fhalf(p0 * o_param_r3(m) + p2 * o_param_r1(m));
+    ctx->nvector.z = d2 + fhalf(p0 * o_param_r2(m) + p1 * o_param_r1(m));
   }
-  vecunit_sgn(&nvector, o_isinvert(m));
+  vecunit_sgn(&ctx->nvector, o_isinvert(m));
 }
 
-void get_nvector(obj_t *m, vec_t *dirvec) {
+void get_nvector(render_ctx_t *ctx, obj_t *m, vec_t *dirvec) {
   int m_shape = o_form(m);
   if (m_shape == 1) {
-    get_nvector_rect(dirvec);
+    get_nvector_rect(ctx, dirvec);
   } else if (m_shape == 2) {
-    get_nvector_plane(m);
+    get_nvector_plane(ctx, m);
   } else { /* 2次曲面 or 錐体 */
-    get_nvector_second(m);
+    get_nvector_second(ctx, m);
   }
 }
 
@@ -1531,12 +2718,12 @@ void get_nvector(obj_t *m, vec_t *dirvec) {
 
 
 /**** 交点上のテクスチャの色を計算する ****/
-void utexture(obj_t *m, vec_t *p) {
+void utexture(render_ctx_t *ctx, obj_t *m, vec_t *p) {
   int m_tex = o_texturetype(m);
   /* 基本はオブジェクトの色 */
-  texture_color.x = o_color_red(m);
-  texture_color.y = o_color_green(m);
-  texture_color.z = o_color_blue(m);
+  ctx->texture_color.x = o_color_red(m);
+  ctx->texture_color.y = o_color_green(m);
+  ctx->texture_color.z = o_color_blue(m);
   if (m_tex == 1) {
     /* zx方向のチェッカー模様 (G) */
     double w1 = p->x - o_param_x(m);
@@ -1546,15 +2733,15 @@ void utexture(obj_t *m, vec_t *p) {
     int flag1 = (w1-d1 < 10.0);
     int flag2 = (w3-d2 < 10.0);
     if (flag1 ^ flag2) {
-      texture_color.y = 0.0;
+      ctx->texture_color.y = 0.0;
     } else {
-      texture_color.y = 255.0;
+      ctx->texture_color.y = 255.0;
     }
   } else if (m_tex == 2) {
     /* y軸方向のストライプ (R-G) */
     double w2 = fsqr(sin(p->y * 0.25));
-    texture_color.x = 255.0 * w2;
-    texture_color.y = 255.0 * (1.0 - w2);
+    ctx->texture_color.x = 255.0 * w2;
+    ctx->texture_color.y = 255.0 * (1.0 - w2);
   } else if (m_tex == 3) {
     /* ZX面方向の同心円 (G-B) */
     double w1 = p->x - o_param_x(m);
@@ -1562,8 +2749,8 @@ void utexture(obj_t *m, vec_t *p) {
     double w2 = sqrt (fsqr(w1) + fsqr(w3)) / 10.0;
     double w4 = (w2 - floor(w2)) * 3.1415927;
     double cws= fsqr(cos(w4));
-    texture_color.y = cws * 255.0;
-    texture_color.z = (1.0 - cws) * 255.0;
+    ctx->texture_color.y = cws * 255.0;
+    ctx->texture_color.z = (1.0 - cws) * 255.0;
   } else if (m_tex == 4) {
     /* 球面上の斑点 (B) */
     double w1 = (p->x - o_param_x(m)) * (sqrt(o_param_a(m)));
@@ -1587,7 +2774,7 @@ void utexture(obj_t *m, vec_t *p) {
     w10 = w8 - floor(w8);
     w11 = 0.15 - fsqr(0.5 - w9) - fsqr(0.5 - w10);
     w12 = (fisneg(w11)) ? 0.0 : w11;
-    texture_color.z = (255.0 * w12) / 0.3;
+    ctx->texture_color.z = (255.0 * w12) / 0.3;
   }
 }
 
@@ -1596,42 +2783,43 @@ void utexture(obj_t *m, vec_t *p) {
 *****************************************************************************/
 
 /* 当たった光による拡散光と不完全鏡面反射光による寄与をRGB値に加算 */
-void add_light(double bright, double hilight, double hilight_scale) {
+void add_light(render_ctx_t *ctx, double bright, double hilight, double hilight_scale) {
 
   /* 拡散光 */
   if (fispos(bright)) {
-    vecaccum(&rgb, bright, &texture_color);
+    vecaccum(&ctx->rgb, bright, &ctx->texture_color);
   }
 
   /* 不完全鏡面反射 cos ^4 モデル */
   if (fispos(hilight)) {
     double ihl = fsqr(fsqr(hilight)) * hilight_scale;
-    rgb.x += ihl;
-    rgb.y += ihl;
-    rgb.z += ihl;
+    ctx->rgb.x += ihl;
+    ctx->rgb.y += ihl;
+    ctx->rgb.z += ihl;
   }
 
 }
 
 
 /* 各物体による光源の反射光を計算する関数(直方体と平面のみ) */
-void trace_reflections(int index, double diffuse, double hilight_scale, vec_t *dirvec) {
+void trace_reflections(render_ctx_t *ctx, int index, double diffuse, double hilight_scale, vec_t *dirvec) {
+  scene_t *sc = ctx->sc;
   while (index >= 0) {
-    refl_t *rinfo = &reflections[index--]; /* 鏡平面の反射情報 */
+    refl_t *rinfo = &sc->reflections[index--]; /* 鏡平面の反射情報 */
     dvec_t *dvec  = r_dvec(rinfo);       /* 反射光の方向ベクトル(光と逆向き */
 
     /*反射光を逆にたどり、実際にその鏡面に当たれば、反射光が届く可能性有り */
-    if (judge_intersection_fast(dvec)) {
-      int surface_id = intersected_object_id * 4 + intsec_rectside;
+    if (judge_intersection_fast(ctx, dvec)) {
+      int surface_id = ctx->intersected_object_id * 4 + ctx->intsec_rectside;
       if (surface_id == r_surface_id(rinfo)) {
         /* 鏡面との衝突点が光源の影になっていなければ反射光は届く */
-        if (!shadow_check_one_or_matrix(0, or_net)) {
+        if (!shadow_check_one_or_matrix(ctx, 0, ctx->sc->or_net)) {
           /* 届いた反射光による RGB成分への寄与を加算 */
-          double p = veciprod_d(dvec, &nvector);
+          double p = veciprod_d(dvec, &ctx->nvector);
           double scale = r_bright(rinfo);
           double bright = scale  * diffuse * p;
           double hilight = scale * veciprod(dirvec, d_vec(dvec));
-          add_light(bright, hilight, hilight_scale);
+          add_light(ctx, bright, hilight, hilight_scale);
         }
       }
     }
@@ -1641,85 +2829,88 @@ void trace_reflections(int index, double diffuse, double hilight_scale, vec_t *d
 /******************************************************************************
    直接光を追跡する
 *****************************************************************************/
-// iteration TODO
-void trace_ray(int nref, double energy, vec_t *dirvec, pixel_t *pixel, double dist) {
-  if (nref <= 4) {
-    int *surface_ids = p_surface_ids(pixel);
-    if (judge_intersection(dirvec)) {
-      /* オブジェクトにぶつかった場合 */
-      int obj_id = intersected_object_id;
-      obj_t *obj = &objects[obj_id];
-      int m_surface = o_reflectiontype(obj);
-      double diffuse = o_diffuse(obj) * energy;
-      vec_t *intersection_points;
-      int *calc_diffuse;
-      double w, hilight_scale;
-      get_nvector(obj, dirvec); /* 法線ベクトルを get */
-      startp = intersection_point;  /* 交差点を新たな光の発射点とする */
-      utexture(obj, &intersection_point); /*テクスチャを計算 */
-
-      /* pixel tupleに情報を格納する */
-      surface_ids[nref] = obj_id * 4 + intsec_rectside;
-      intersection_points = p_intersection_points(pixel);
-      intersection_points[nref] = intersection_point;
-      /* 拡散反射率が0.5以上の場合のみ間接光のサンプリングを行う */
-
-      calc_diffuse = p_calc_diffuse(pixel);
-      if (o_diffuse(obj) < 0.5) {
-        calc_diffuse[nref] = false;
-      } else {
-        vec_t *energya  = p_energy(pixel);
-        vec_t *nvectors = p_nvectors(pixel);
-        calc_diffuse[nref] = true;
-        energya[nref] = texture_color;
-        vecscale(&energya[nref],
-                 (1.0 / 256.0) * diffuse);
-        nvectors[nref] = nvector;
-      }
-
-      w = (-2.0) * veciprod(dirvec, &nvector);
-      vecaccum(dirvec, w, &nvector);
-
-      hilight_scale = energy * o_hilight(obj);
-      /* 光源光が直接届く場合、RGB成分にこれを加味する */
-      if (!(shadow_check_one_or_matrix(0, or_net))) {
-        double bright = fneg(veciprod(&nvector, &light)) * diffuse;
-        double hilight = fneg(veciprod(dirvec, &light));
-        add_light(bright, hilight, hilight_scale);
-      }
-
-      /* 光源光の反射光が無いか探す */
-      setup_startp(&intersection_point);
-      trace_reflections(n_reflections-1, diffuse, hilight_scale, dirvec);
-
-      /* 重みが 0.1より多く残っていたら、鏡面反射元を追跡する */
-      if (0.1 < energy) {
-        if (nref < 4) {
-          surface_ids[nref+1] = -1;
-        }
-        if (m_surface == 2) {
-          double energy2 = energy * (1.0 - o_diffuse(obj));
-          trace_ray(nref+1, energy2, dirvec, pixel, dist + tmin);
-        }
-      }
-
-    } else {
+/* 元のプログラムと同じく、視点からの光線は4回まで鏡面反射を辿り、重みが
+   0.1 以下になったら打ち切る。-depth と -cutoff で変えられる */
+#define DEFAULT_MAX_DEPTH 5
+#define DEFAULT_ENERGY_CUTOFF 0.1
+
+/* 視点からの光線を、鏡面反射を辿りながら最大 sc->max_depth 回まで追跡する。
+   反射の後に要るのは残りの重みと反射方向だけなので、再帰せずに
+   dirvec を書き換えてループを回す */
+void trace_ray(render_ctx_t *ctx, double energy, vec_t *dirvec, pixel_t *pixel) {
+  scene_t *sc = ctx->sc;
+  int nref;
+  for (nref = 0; nref < sc->max_depth; ++nref) {
+    int obj_id, m_surface;
+    obj_t *obj;
+    double diffuse, w, hilight_scale;
+    if (!judge_intersection(ctx, dirvec)) {
       /* どの物体にも当たらなかった場合。光源からの光を加味 */
-      surface_ids[nref] = -1;
+      p_surface_id(pixel, nref) = -1;
       if (nref != 0) {
-        double hl = fneg(veciprod(dirvec, &light));
+        double hl = fneg(veciprod(dirvec, &sc->light));
         /* 90°を超える場合は0 (光なし) */
         if (fispos(hl)) {
           /* ハイライト強度は角度の cos^3 に比例 */
-          double ihl = fsqr(hl) * hl * energy * beam;
-          rgb.x += ihl;
-          rgb.y += ihl;
-          rgb.z += ihl;
+          double ihl = fsqr(hl) * hl * energy * sc->beam;
+          ctx->rgb.x += ihl;
+          ctx->rgb.y += ihl;
+          ctx->rgb.z += ihl;
         }
-
       }
+      return;
+    }
+
+    /* オブジェクトにぶつかった場合 */
+    obj_id = ctx->intersected_object_id;
+    obj = &sc->objects[obj_id];
+    m_surface = o_reflectiontype(obj);
+    diffuse = o_diffuse(obj) * energy;
+    get_nvector(ctx, obj, dirvec); /* 法線ベクトルを get */
+    ctx->startp = ctx->intersection_point;  /* 交差点を新たな光の発射点とする */
+    utexture(ctx, obj, &ctx->intersection_point); /*テクスチャを計算 */
+
+    /* pixel tupleに情報を格納する */
+    p_surface_id(pixel, nref) = obj_id * 4 + ctx->intsec_rectside;
+    p_intersection_point(pixel, nref) = ctx->intersection_point;
+    /* 拡散反射率が0.5以上の場合のみ間接光のサンプリングを行う */
+
+    if (o_diffuse(obj) < 0.5) {
+      p_calc_diffuse(pixel, nref) = false;
+    } else {
+      p_calc_diffuse(pixel, nref) = true;
+      p_energy(pixel, nref) = ctx->texture_color;
+      vecscale(&p_energy(pixel, nref),
+               (1.0 / 256.0) * diffuse);
+      p_nvector(pixel, nref) = ctx->nvector;
+    }
+
+    w = (-2.0) * veciprod(dirvec, &ctx->nvector);
+    vecaccum(dirvec, w, &ctx->nvector);
+
+    hilight_scale = energy * o_hilight(obj);
+    /* 光源光が直接届く場合、RGB成分にこれを加味する */
+    if (!(shadow_check_one_or_matrix(ctx, 0, ctx->sc->or_net))) {
+      double bright = fneg(veciprod(&ctx->nvector, &sc->light)) * diffuse;
+      double hilight = fneg(veciprod(dirvec, &sc->light));
+      add_light(ctx, bright, hilight, hilight_scale);
+    }
 
+    /* 光源光の反射光が無いか探す */
+    setup_startp(ctx, &ctx->intersection_point);
+    trace_reflections(ctx, sc->n_reflections-1, diffuse, hilight_scale, dirvec);
+
+    /* 重みが energy_cutoff (標準 0.1) より多く残っていたら、鏡面反射元を追跡する */
+    if (!(sc->energy_cutoff < energy)) {
+      return;
+    }
+    if (nref + 1 < sc->max_depth) {
+      p_surface_id(pixel, nref+1) = -1;
+    }
+    if (m_surface != 2) {
+      return;
     }
+    energy *= 1.0 - o_diffuse(obj);
   }
 }
 
@@ -1728,159 +2919,475 @@ void trace_ray(int nref, double energy, vec_t *dirvec, pixel_t *pixel, double di
    間接光を追跡する
 *****************************************************************************/
 
+/* 間接光の光線が当たった物体 (交点は ctx に入っている) から来る光を加算する */
+void add_diffuse_light(render_ctx_t *ctx, dvec_t *dirvec, double energy) {
+  scene_t *sc = ctx->sc;
+  obj_t *obj = &sc->objects[ctx->intersected_object_id];
+  get_nvector(ctx, obj, d_vec(dirvec));
+  utexture(ctx, obj, &ctx->intersection_point);
+
+  if (ctx->irr_measure) {
+    ctx->irr_inv_dist += 1.0 / (ctx->tmin > 0.01 ? ctx->tmin : 0.01);
+  }
+
+  /* その物体が放射する光の強さを求める。直接光源光のみを計算 */
+  if (!shadow_check_one_or_matrix(ctx, 0, ctx->sc->or_net)) {
+    double br = fneg(veciprod(&ctx->nvector, &sc->light));
+    double bright = (fispos(br) ? br : 0.0);
+    vecaccum(&ctx->diffuse_ray,
+             energy * bright * o_diffuse(obj),
+             &ctx->texture_color);
+  }
+}
+
 /* ある点が特定の方向から受ける間接光の強さを計算する */
 /* 間接光の方向ベクトル dirvecに関しては定数テーブルが作られており、衝突判定
    が高速に行われる。物体に当たったら、その後の反射は追跡しない */
-void trace_diffuse_ray(dvec_t *dirvec, double energy) {
+void trace_diffuse_ray(render_ctx_t *ctx, dvec_t *dirvec, double energy) {
   /* どれかの物体に当たるか調べる */
-  if (judge_intersection_fast(dirvec)) {
-    obj_t *obj = &objects[intersected_object_id];
-    get_nvector(obj, d_vec(dirvec));
-    utexture(obj, &intersection_point);
-
-    /* その物体が放射する光の強さを求める。直接光源光のみを計算 */
-    if (!shadow_check_one_or_matrix(0, or_net)) {
-      double br = fneg(veciprod(&nvector, &light));
-      double bright = (fispos(br) ? br : 0.0);
-      vecaccum(&diffuse_ray,
-               energy * bright * o_diffuse(obj),
-               &texture_color);
-    }
+  if (judge_intersection_fast(ctx, dirvec)) {
+    add_diffuse_light(ctx, dirvec, energy);
   }
 
 }
 
+
 /* あらかじめ決められた方向ベクトルの配列に対し、各ベクトルの方角から来る
    間接光の強さをサンプリングして加算する */
-void iter_trace_diffuse_rays(dvec_t *dirvec_group, vec_t *nvector, vec_t *org, int index) {
+void iter_trace_diffuse_rays(render_ctx_t *ctx, dvec_t *dirvec_group, vec_t *nvector, vec_t *org, int index) {
   while (index >= 0) {
     double p = veciprod(d_vec(&dirvec_group[index]), nvector);
 
     /* 配列の 2n 番目と 2n+1 番目には互いに逆向の方向ベクトルが入っている
        法線ベクトルと同じ向きの物を選んで使う */
     if (fisneg(p)) {
-      trace_diffuse_ray(&dirvec_group[index+1], p / -150.0);
+      trace_diffuse_ray(ctx, &dirvec_group[index+1], p / -150.0);
     } else {
-      trace_diffuse_ray(&dirvec_group[index],   p /  150.0);
+      trace_diffuse_ray(ctx, &dirvec_group[index],   p /  150.0);
     }
     index -= 2;
   }
 }
 
 /* 与えられた方向ベクトルの集合に対し、その方向の間接光をサンプリングする */
-void trace_diffuse_rays(dvec_t *dirvec_group, vec_t *nvector, vec_t *org) {
-  setup_startp(org);
+void trace_diffuse_rays(render_ctx_t *ctx, dvec_t *dirvec_group, vec_t *nvector, vec_t *org) {
+  setup_startp(ctx, org);
 
   /* 配列の 2n 番目と 2n+1 番目には互いに逆向の方向ベクトルが入っていて、
      法線ベクトルと同じ向きの物のみサンプリングに使われる */
   /* 全部で 120 / 2 = 60本のベクトルを追跡 */
-  iter_trace_diffuse_rays(dirvec_group, nvector, org, 118);
+  iter_trace_diffuse_rays(ctx, dirvec_group, nvector, org, 118);
 }
 
 /* 半球方向の全部で300本のベクトルのうち、まだ追跡していない残りの240本の
    ベクトルについて間接光追跡する。60本のベクトル追跡を4セット行う */
-void trace_diffuse_ray_80percent(int group_id, vec_t *nvector, vec_t *org) {
+void trace_diffuse_ray_80percent(render_ctx_t *ctx, int group_id, vec_t *nvector, vec_t *org) {
 
   int i;
 
   for (i = 0; i <= 4; ++i) {
     if (group_id != i) {
-      trace_diffuse_rays(dirvecs[i], nvector, org);
+      trace_diffuse_rays(ctx, ctx->sc->dirvecs[i], nvector, org);
     }
   }
 
 }
 
-/* 上下左右4点の間接光追跡結果を使わず、300本全部のベクトルを追跡して間接光を
-   計算する。20%(60本)は追跡済なので、残り80%(240本)を追跡する */
-void calc_diffuse_using_1point(pixel_t *pixel, int nref) {
-  vec_t *ray20p = p_received_ray_20percent(pixel);
-  vec_t *nvectors = p_nvectors(pixel);
-  vec_t *intersection_points = p_intersection_points(pixel);
-  vec_t *energya = p_energy(pixel);
-  diffuse_ray = ray20p[nref];
-  trace_diffuse_ray_80percent(p_group_id(pixel),
-                              &nvectors[nref],
-                              &intersection_points[nref]);
-  vecaccumv(&rgb, &energya[nref], &diffuse_ray);
-}
-
-/* 自分と上下左右4点の追跡結果を加算して間接光を求める。本来は 300 本の光を
-   追跡する必要があるが、5点加算するので1点あたり60本(20%)追跡するだけで済む */
-void calc_diffuse_using_5points(int x, pixel_t *prev, pixel_t *cur, pixel_t *next, int nref) {
-  vec_t *r_up     = p_received_ray_20percent(&prev[x]);
-  vec_t *r_left   = p_received_ray_20percent(&cur[x-1]);
-  vec_t *r_center = p_received_ray_20percent(&cur[x]);
-  vec_t *r_right  = p_received_ray_20percent(&cur[x+1]);
-  vec_t *r_down   = p_received_ray_20percent(&next[x]);
+/******************************************************************************
+   放射照度キャッシュ
+*****************************************************************************/
 
-  vec_t *energya  = p_energy(&cur[x]);
+/* 300本の方向ベクトルで求めた間接受光を、衝突点の位置と法線ごとに記録して
+   おき、近くの点では記録を補間して使う (Ward の irradiance caching)。
+   記録 i の点 p, 法線 n に対する誤差の見積もりは
+     e_i = |p - p_i| / R_i + sqrt(1 - n・n_i)
+   で、R_i は記録を作ったときに光線が当たった物体までの距離の調和平均。
+   e_i が許容誤差 a 未満の記録を重み 1 / e_i で平均する。使える記録が無い
+   点では calc_diffuse_using_1point と同じく残り240本を追跡して記録を足す */
+
+/* 記録の半径の範囲。近くに物体がある隅では小さく、開けた所では大きくなる */
+#define IRR_MIN_RADIUS 1.0
+#define IRR_MAX_RADIUS 20.0
+/* -irrfile だけを指定したときの許容誤差 */
+#define IRR_DEFAULT_ERROR 0.3
+/* ハッシュ表の大きさ (2 の冪) */
+#define IRR_BUCKETS (1 << 16)
+
+irr_cache_t *create_irr_cache(double error) {
+  irr_cache_t *c = calloc(1, sizeof(irr_cache_t));
+  int i;
+  c->error = error;
+  c->cell = error * IRR_MAX_RADIUS;
+  c->buckets = malloc(sizeof(int) * IRR_BUCKETS);
+  for (i = 0; i < IRR_BUCKETS; ++i) {
+    c->buckets[i] = -1;
+  }
+  pthread_rwlock_init(&c->lock, NULL);
+  return c;
+}
 
-  diffuse_ray = r_up[nref];
+void free_irr_cache(irr_cache_t *c) {
+  pthread_rwlock_destroy(&c->lock);
+  free(c->records);
+  free(c->entries);
+  free(c->buckets);
+  free(c);
+}
 
-  vecadd(&diffuse_ray, &r_left[nref]);
-  vecadd(&diffuse_ray, &r_center[nref]);
-  vecadd(&diffuse_ray, &r_right[nref]);
-  vecadd(&diffuse_ray, &r_down[nref]);
+int irr_hash(int *key) {
+  unsigned h = (unsigned) key[0] * 73856093u ^ (unsigned) key[1] * 19349663u
+    ^ (unsigned) key[2] * 83492791u;
+  return (int) (h & (IRR_BUCKETS - 1));
+}
 
-  vecaccumv(&rgb, &energya[nref], &diffuse_ray);
+/* 点 p の属するセルの座標 */
+void irr_cell_key(irr_cache_t *c, vec_t *p, int *key) {
+  key[0] = (int) floor(p->x / c->cell);
+  key[1] = (int) floor(p->y / c->cell);
+  key[2] = (int) floor(p->z / c->cell);
+}
 
+/* 記録 rec をセル key に登録する (ロックは呼び出し側で取る) */
+void irr_add_entry(irr_cache_t *c, int *key, int rec) {
+  int h = irr_hash(key);
+  irr_entry_t *e;
+  c->entries = grow_array(c->entries, &c->cap_entries, c->n_entries, sizeof(irr_entry_t));
+  e = &c->entries[c->n_entries];
+  memcpy(e->key, key, sizeof(e->key));
+  e->record = rec;
+  e->next = c->buckets[h];
+  c->buckets[h] = c->n_entries++;
 }
 
-/* 上下左右4点を使わずに直接光の各衝突点における間接受光を計算する */
-void do_without_neighbors(pixel_t *pixel, int nref) {
-  while (nref <= 4) {
-    /* 衝突面番号が有効(非負)かチェック */
-    int *surface_ids = p_surface_ids(pixel), *calc_diffuse;
-    if (surface_ids[nref] < 0) {
-      return;
-    }
-    calc_diffuse = p_calc_diffuse(pixel);
-    if (calc_diffuse[nref]) {
-      calc_diffuse_using_1point(pixel, nref);
+/* 点 p, 法線 n で求めた間接受光 irr を、半径 radius の記録として加える */
+void irr_cache_insert(irr_cache_t *c, vec_t *p, vec_t *n, vec_t *irr, double radius) {
+  irr_record_t *r;
+  double reach;
+  int lo[3], hi[3], key[3], rec;
+  vec_t q;
+
+  radius = radius < IRR_MIN_RADIUS ? IRR_MIN_RADIUS
+    : radius > IRR_MAX_RADIUS ? IRR_MAX_RADIUS : radius;
+  /* 記録を使えるのは p から error * radius (<= セルの幅) 以内の点 */
+  reach = c->error * radius;
+
+  pthread_rwlock_wrlock(&c->lock);
+  c->records = grow_array(c->records, &c->cap_records, c->n_records, sizeof(irr_record_t));
+  rec = c->n_records++;
+  r = &c->records[rec];
+  r->pos = *p;
+  r->nvector = *n;
+  r->irr = *irr;
+  r->radius = radius;
+
+  vecset(&q, p->x - reach, p->y - reach, p->z - reach);
+  irr_cell_key(c, &q, lo);
+  vecset(&q, p->x + reach, p->y + reach, p->z + reach);
+  irr_cell_key(c, &q, hi);
+  for (key[0] = lo[0]; key[0] <= hi[0]; ++key[0]) {
+    for (key[1] = lo[1]; key[1] <= hi[1]; ++key[1]) {
+      for (key[2] = lo[2]; key[2] <= hi[2]; ++key[2]) {
+        irr_add_entry(c, key, rec);
+      }
     }
-    ++nref;
   }
+  pthread_rwlock_unlock(&c->lock);
 }
 
-/* 画像上で上下左右に点があるか(要するに、画像の端で無い事)を確認 */
-bool neighbors_exist(int x, int y, pixel_t *next) {
-  if (0 < y && y+1 < image_size[1]) {
-    if (0 < x && x+1 < image_size[0]) {
-      return true;
+/* 点 p, 法線 n での間接受光を記録から補間して *irr に求める。
+   使える記録が無ければ偽を返す */
+bool irr_cache_lookup(irr_cache_t *c, vec_t *p, vec_t *n, vec_t *irr) {
+  double wsum = 0.0;
+  int key[3], e;
+
+  irr_cell_key(c, p, key);
+  vecbzero(irr);
+  pthread_rwlock_rdlock(&c->lock);
+  for (e = c->buckets[irr_hash(key)]; e >= 0; e = c->entries[e].next) {
+    irr_entry_t *en = &c->entries[e];
+    irr_record_t *r;
+    double d, nn, err, w;
+    if (en->key[0] != key[0] || en->key[1] != key[1] || en->key[2] != key[2]) {
+      continue;
     }
+    r = &c->records[en->record];
+    nn = veciprod(n, &r->nvector);
+    if (nn <= 0.0) {
+      continue;
+    }
+    d = sqrt(fsqr(p->x - r->pos.x) + fsqr(p->y - r->pos.y) + fsqr(p->z - r->pos.z));
+    err = d / r->radius + sqrt(nn < 1.0 ? 1.0 - nn : 0.0);
+    if (err >= c->error) {
+      continue;
+    }
+    w = 1.0 / (err > 1.0e-6 ? err : 1.0e-6);
+    vecaccum(irr, w, &r->irr);
+    wsum += w;
   }
-  return false;
+  pthread_rwlock_unlock(&c->lock);
+  if (wsum == 0.0) {
+    return false;
+  }
+  vecscale(irr, 1.0 / wsum);
+  return true;
 }
 
-int get_surface_id(pixel_t *pixel, int index) {
-  int *surface_ids = p_surface_ids(pixel);
-  return surface_ids[index];
-}
+/* シーンに放射照度キャッシュがあれば irr_cache_lookup を行い、回数を数える */
+bool irr_cache_lookup_ctx(render_ctx_t *ctx, vec_t *p, vec_t *n, vec_t *irr) {
+  if (ctx->sc->irr_cache == NULL) {
+    return false;
+  }
+  ++ctx->count.n_irr_lookups;
+  if (irr_cache_lookup(ctx->sc->irr_cache, p, n, irr)) {
+    ++ctx->count.n_irr_hits;
+    return true;
+  }
+  return false;
+}
 
-/* 上下左右4点の直接光追跡の結果、自分と同じ面に衝突しているかをチェック
-   もし同じ面に衝突していれば、これら4点の結果を使うことで計算を省略出来る */
-bool neighbors_are_available(int x, pixel_t *prev, pixel_t *cur, pixel_t *next, int nref) {
-  int sid_center = get_surface_id(&cur[x], nref);
-  if (get_surface_id(&prev[x],  nref) == sid_center) {
-    if (get_surface_id(&next[x],  nref) == sid_center) {
-      if (get_surface_id(&cur[x-1], nref) == sid_center) {
-        if (get_surface_id(&cur[x+1], nref) == sid_center) {
-          return true;
-        }
-      }
+/* 放射照度キャッシュのファイルは、ホストのバイト順や構造体の詰め物に
+   よらないよう、先頭の IRR_FILE_MAGIC に続けて、シーンの値 (scene_hash) と
+   記録の数を 32ビットで、各記録の pos, nvector, irr, radius の10個の値を
+   IEEE 754 の64ビットで、どれもビッグエンディアンで書く */
+#define IRR_FILE_MAGIC "minrtir2"
+#define IRR_FILE_HEADER 16
+#define IRR_FILE_RECORD 80
+
+void put_be32(unsigned char *b, unsigned u) {
+  int k;
+  for (k = 0; k < 4; ++k) {
+    b[k] = (unsigned char) (u >> (24 - 8 * k));
+  }
+}
+
+unsigned get_be32(const unsigned char *b) {
+  return (unsigned) b[0] << 24 | (unsigned) b[1] << 16 | (unsigned) b[2] << 8 | b[3];
+}
+
+/* double のバイト列を、ホストのバイト順とビッグエンディアンとの間で並べ替える */
+void swap_double_bytes(unsigned char *to, const unsigned char *from) {
+  union {double d; unsigned char c[8];} one;
+  int k;
+  one.d = 1.0;
+  for (k = 0; k < 8; ++k) {
+    /* 1.0 の符号と指数のバイト 0x3f が先頭ならホストはビッグエンディアン */
+    to[k] = from[one.c[0] == 0x3f ? k : 7 - k];
+  }
+}
+
+void put_be_double(unsigned char *b, double d) {
+  swap_double_bytes(b, (unsigned char *) &d);
+}
+
+double get_be_double(const unsigned char *b) {
+  double d;
+  swap_double_bytes((unsigned char *) &d, b);
+  return d;
+}
+
+/* FNV-1a で h に n バイトを加える */
+unsigned fnv_bytes(unsigned h, const void *p, size_t n) {
+  const unsigned char *b = p;
+  size_t i;
+  for (i = 0; i < n; ++i) {
+    h = (h ^ b[i]) * 16777619u;
+  }
+  return h;
+}
+
+/* キャッシュを別のシーンに使わないよう、物体と光源から求める値。
+   obj_t の詰め物は初期化されていないので、フィールドごとに加える */
+unsigned scene_hash(scene_t *sc) {
+  unsigned h = 2166136261u;
+  int i;
+  for (i = 0; i < sc->n_objects; ++i) {
+    obj_t *m = &sc->objects[i];
+    h = fnv_bytes(h, &m->tex, sizeof(int));
+    h = fnv_bytes(h, &m->shape, sizeof(int));
+    h = fnv_bytes(h, &m->surface, sizeof(int));
+    h = fnv_bytes(h, &m->isrot, sizeof(bool));
+    h = fnv_bytes(h, &m->abc, sizeof(vec_t));
+    h = fnv_bytes(h, &m->xyz, sizeof(vec_t));
+    h = fnv_bytes(h, &m->invert, sizeof(bool));
+    h = fnv_bytes(h, m->surfparams, sizeof(m->surfparams));
+    h = fnv_bytes(h, &m->color, sizeof(vec_t));
+    h = fnv_bytes(h, &m->rot123, sizeof(vec_t));
+  }
+  return fnv_bytes(h, &sc->light, sizeof(vec_t));
+}
+
+/* path の記録を c に加える。ファイルが無いか、c->scene と別のシーンのもの
+   なら何もしない */
+void load_irr_cache(irr_cache_t *c, const char *path) {
+  FILE *fp = fopen(path, "rb");
+  unsigned char hd[IRR_FILE_HEADER], b[IRR_FILE_RECORD];
+  unsigned i, n;
+  if (fp == NULL) {
+    return;
+  }
+  if (fread(hd, IRR_FILE_HEADER, 1, fp) != 1 || memcmp(hd, IRR_FILE_MAGIC, 8) != 0
+      || get_be32(hd + 8) != c->scene) {
+    fprintf(stderr, "%s : not an irradiance cache of this scene, ignored\n", path);
+    fclose(fp);
+    return;
+  }
+  n = get_be32(hd + 12);
+  for (i = 0; i < n && fread(b, IRR_FILE_RECORD, 1, fp) == 1; ++i) {
+    vec_t pos, nvector, irr;
+    vecset(&pos, get_be_double(b), get_be_double(b + 8), get_be_double(b + 16));
+    vecset(&nvector, get_be_double(b + 24), get_be_double(b + 32), get_be_double(b + 40));
+    vecset(&irr, get_be_double(b + 48), get_be_double(b + 56), get_be_double(b + 64));
+    irr_cache_insert(c, &pos, &nvector, &irr, get_be_double(b + 72));
+  }
+  fclose(fp);
+}
+
+/* c の記録をすべて、シーン c->scene のものとして path に書き出す。
+   物体を動かした後の記録は読み込んだシーンには使えないので書かない */
+void save_irr_cache(irr_cache_t *c, const char *path) {
+  FILE *fp;
+  unsigned char hd[IRR_FILE_HEADER], b[IRR_FILE_RECORD];
+  bool ok;
+  int i;
+  if (c->moved) {
+    return;
+  }
+  fp = fopen(path, "wb");
+  if (fp == NULL) {
+    perror(path);
+    return;
+  }
+  memcpy(hd, IRR_FILE_MAGIC, 8);
+  put_be32(hd + 8, c->scene);
+  put_be32(hd + 12, (unsigned) c->n_records);
+  ok = fwrite(hd, IRR_FILE_HEADER, 1, fp) == 1;
+  for (i = 0; ok && i < c->n_records; ++i) {
+    irr_record_t *r = &c->records[i];
+    put_be_double(b,      r->pos.x);
+    put_be_double(b + 8,  r->pos.y);
+    put_be_double(b + 16, r->pos.z);
+    put_be_double(b + 24, r->nvector.x);
+    put_be_double(b + 32, r->nvector.y);
+    put_be_double(b + 40, r->nvector.z);
+    put_be_double(b + 48, r->irr.x);
+    put_be_double(b + 56, r->irr.y);
+    put_be_double(b + 64, r->irr.z);
+    put_be_double(b + 72, r->radius);
+    ok = fwrite(b, IRR_FILE_RECORD, 1, fp) == 1;
+  }
+  if (!ok) {
+    perror(path);
+  }
+  fclose(fp);
+}
+
+/* -aa のときは、求めた間接受光 ctx->diffuse_ray を反射回数ごとに覚えておく。
+   エッジのピクセルを追跡し直すとき、同じ面に当たった光線で使い回す */
+void remember_diffuse(render_ctx_t *ctx, int nref) {
+  if (ctx->aa_irr != NULL) {
+    ctx->aa_irr[nref] = ctx->diffuse_ray;
+  }
+}
+
+/* 上下左右4点の間接光追跡結果を使わず、300本全部のベクトルを追跡して間接光を
+   計算する。20%(60本)は追跡済なので、残り80%(240本)を追跡する */
+/* 放射照度キャッシュを使うなら、まず記録の補間を試し、追跡したら記録を足す */
+void calc_diffuse_using_1point(render_ctx_t *ctx, pixel_t *pixel, int nref) {
+  vec_t *nvector = &p_nvector(pixel, nref);
+  vec_t *intersection_point = &p_intersection_point(pixel, nref);
+  vec_t *energy = &p_energy(pixel, nref);
+  irr_cache_t *ic = ctx->sc->irr_cache;
+  STAT_INC(ctx, one_point);
+  if (irr_cache_lookup_ctx(ctx, intersection_point, nvector, &ctx->diffuse_ray)) {
+    remember_diffuse(ctx, nref);
+    vecaccumv(&ctx->rgb, energy, &ctx->diffuse_ray);
+    return;
+  }
+  if (ic != NULL) {
+    ctx->irr_measure = true;
+    ctx->irr_inv_dist = 0.0;
+  }
+  ctx->diffuse_ray = p_received_ray_20percent(pixel, nref);
+  trace_diffuse_ray_80percent(ctx, p_group_id(pixel),
+                              nvector,
+                              intersection_point);
+  if (ic != NULL) {
+    /* 追跡した240本の、当たらなかったものも含めた距離の調和平均 */
+    ctx->irr_measure = false;
+    irr_cache_insert(ic, intersection_point, nvector, &ctx->diffuse_ray,
+                     ctx->irr_inv_dist > 0.0 ? 240.0 / ctx->irr_inv_dist : HUGE_VAL);
+  }
+  remember_diffuse(ctx, nref);
+  vecaccumv(&ctx->rgb, energy, &ctx->diffuse_ray);
+}
+
+/* 自分と上下左右4点の追跡結果を加算して間接光を求める。本来は 300 本の光を
+   追跡する必要があるが、5点加算するので1点あたり60本(20%)追跡するだけで済む */
+void calc_diffuse_using_5points(render_ctx_t *ctx, int x, pixel_t *prev, pixel_t *cur, pixel_t *next, int nref) {
+  vec_t *r_up     = &p_received_ray_20percent(&prev[x], nref);
+  vec_t *r_left   = &p_received_ray_20percent(&cur[x-1], nref);
+  vec_t *r_center = &p_received_ray_20percent(&cur[x], nref);
+  vec_t *r_right  = &p_received_ray_20percent(&cur[x+1], nref);
+  vec_t *r_down   = &p_received_ray_20percent(&next[x], nref);
+
+  STAT_INC(ctx, five_point);
+  ctx->diffuse_ray = *r_up;
+
+  vecadd(&ctx->diffuse_ray, r_left);
+  vecadd(&ctx->diffuse_ray, r_center);
+  vecadd(&ctx->diffuse_ray, r_right);
+  vecadd(&ctx->diffuse_ray, r_down);
+
+  remember_diffuse(ctx, nref);
+  vecaccumv(&ctx->rgb, &p_energy(&cur[x], nref), &ctx->diffuse_ray);
+
+}
+
+/* 上下左右4点を使わずに直接光の各衝突点における間接受光を計算する */
+void do_without_neighbors(render_ctx_t *ctx, pixel_t *pixel, int nref) {
+  while (nref < p_depth(pixel)) {
+    /* 衝突面番号が有効(非負)かチェック */
+    if (p_surface_id(pixel, nref) < 0) {
+      return;
+    }
+    if (p_calc_diffuse(pixel, nref)) {
+      calc_diffuse_using_1point(ctx, pixel, nref);
+    }
+    ++nref;
+  }
+}
+
+/* 画像上で上下左右に点があるか(要するに、画像の端で無い事)を確認 */
+bool neighbors_exist(scene_t *sc, int x, int y, pixel_t *next) {
+  if (0 < y && y+1 < sc->image_size[1]) {
+    if (0 < x && x+1 < sc->image_size[0]) {
+      return true;
     }
   }
   return false;
 }
 
+int get_surface_id(pixel_t *pixel, int index) {
+  return p_surface_id(pixel, index);
+}
+
+/* 上下左右4点の直接光追跡の結果、自分と同じ面に衝突しているかをチェック
+   もし同じ面に衝突していれば、これら4点の結果を使うことで計算を省略出来る */
+/* 物体面番号は反射回数ごとに連続した int の行なので、3行を分岐なしで比べる */
+bool neighbors_are_available(int x, pixel_t *prev, pixel_t *cur, pixel_t *next, int nref) {
+  const int *up   = p_surface_id_row(&prev[x-1], nref);
+  const int *row  = p_surface_id_row(&cur[x-1],  nref);
+  const int *down = p_surface_id_row(&next[x-1], nref);
+  int c = row[1];
+  return ((up[1] ^ c) | (down[1] ^ c) | (row[0] ^ c) | (row[2] ^ c)) == 0;
+}
+
 /* 直接光の各衝突点における間接受光の強さを、上下左右4点の結果を使用して計算
    する。もし上下左右4点の計算結果を使えない場合は、その時点で
    do_without_neighborsに切り替える */
-void try_exploit_neighbors(int x, int y, pixel_t *prev, pixel_t *cur, pixel_t *next, int nref) {
+void try_exploit_neighbors(render_ctx_t *ctx, int x, int y, pixel_t *prev, pixel_t *cur, pixel_t *next, int nref) {
   pixel_t *pixel = &cur[x];
-  while (nref <= 4) {
-    int *calc_diffuse;
+  while (nref < p_depth(pixel)) {
     /* 衝突面番号が有効(非負)か */
     if (get_surface_id(pixel, nref) < 0) {
       return;
@@ -1889,14 +3396,14 @@ void try_exploit_neighbors(int x, int y, pixel_t *prev, pixel_t *cur, pixel_t *n
     /* 周囲4点を補完に使えるか */
     if (!neighbors_are_available(x, prev, cur, next, nref)) {
       /* 周囲4点を補完に使えないので、これらを使わない方法に切り替える */
-        do_without_neighbors(&cur[x], nref);
+        STAT_INC(ctx, neighbor_fallbacks);
+        do_without_neighbors(ctx, &cur[x], nref);
         return;
     }
 
     /* 間接受光を計算するフラグが立っていれば実際に計算する */
-    calc_diffuse = p_calc_diffuse(pixel);
-    if (calc_diffuse[nref]) {
-      calc_diffuse_using_5points(x, prev, cur, next, nref);
+    if (p_calc_diffuse(pixel, nref)) {
+      calc_diffuse_using_5points(ctx, x, prev, cur, next, nref);
     }
     /* 次の反射衝突点へ */
     ++nref;
@@ -1908,19 +3415,201 @@ void try_exploit_neighbors(int x, int y, pixel_t *prev, pixel_t *cur, pixel_t *n
 /******************************************************************************
    PPMファイルの書き込み関数
 *****************************************************************************/
-void write_ppm_header() {
+
+/* 浮動小数点の画像の形式 (-hdr) */
+#define HDR_NONE  0 /* 使わず PPM を書く */
+#define HDR_PFM   1 /* PFM */
+#define HDR_TILED 2 /* HDR_TILE x HDR_TILE のタイルに分けた PFM */
+#define HDR_TILE  64
+
+/* PPM の出力先。ピクセル値は1ラインずつまとめて書き込む */
+typedef struct {
+  /* 真なら P6 (バイナリ)、偽なら P3 (テキスト) */
+  bool binary;
+  int  width, height;
+  /* P6 の1ライン分の出力バッファ */
+  unsigned char *row;
+  /* 0 以上なら、標準出力の代わりにラインを1つずつ枠に入れて送る先の
+     ファイル記述子 (-stream) */
+  int sink;
+  /* HDR_NONE でなければ、ピクセル値を切り捨てずに画像1枚分の float の
+     配列 fb に溜め、最後のラインを受け取ったらその形式でまとめて書く */
+  int hdr;
+  float *fb;
+  /* 次に書くラインの行番号 */
+  int y;
+} ppm_writer_t;
+
+/* -stream の出力は枠の並びで、枠は 4バイトの行番号と 4バイトのデータの
+   長さ (どちらもビッグエンディアン) に続くデータからなる。画像ごとに、
+   行番号 -1 の枠で P6 のヘッダを送り、続けて上のラインから順に
+   行番号 0, 1, ... の枠で P6 の1ライン分 (3 * 幅 バイト) を送る。
+   書き込みは送り切るまで待つので、受け手が遅ければ追跡もそこで待つ
+   (UNIX ドメインソケットでは送信バッファを小さくして、先行する量を抑える) */
+#define SINK_SNDBUF 16384
+
+/* -stream の送り先を開く。"unix:パス" ならその UNIX ドメインソケットに接続し、
+   "-" なら標準出力、それ以外はファイル (名前付きパイプでもよい) を開く */
+int open_row_sink(const char *target) {
+  int fd;
+  if (strncmp(target, "unix:", 5) == 0) {
+    struct sockaddr_un addr;
+    int sndbuf = SINK_SNDBUF;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(target + 5) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "%s: socket path too long\n", target + 5);
+      exit(1);
+    }
+    strcpy(addr.sun_path, target + 5);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+      perror(target + 5);
+      exit(1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  } else if (strcmp(target, "-") == 0) {
+    fd = dup(1);
+  } else {
+    fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  }
+  if (fd < 0) {
+    perror(target);
+    exit(1);
+  }
+  return fd;
+}
+
+/* n バイトを送り切る */
+void sink_write(int fd, const void *buf, size_t n) {
+  const char *p = buf;
+  while (n > 0) {
+    ssize_t k = write(fd, p, n);
+    if (k < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("stream");
+      exit(1);
+    }
+    p += k;
+    n -= (size_t) k;
+  }
+}
+
+/* 行番号 y の枠で n バイトのデータを送る */
+void sink_frame(ppm_writer_t *w, int y, const void *data, size_t n) {
+  unsigned char head[8];
+  unsigned u = (unsigned) y;
+  int k;
+  for (k = 0; k < 4; ++k) {
+    head[k]     = (unsigned char) (u >> (24 - 8 * k));
+    head[4 + k] = (unsigned char) (n >> (24 - 8 * k));
+  }
+  sink_write(w->sink, head, 8);
+  sink_write(w->sink, data, n);
+}
+
+/* -hdr の画像は、PPM の値 255 を 1.0 とした線形の RGB を float で持つ。
+   HDR_PFM は PFM ("PF\n幅 高さ\n尺度\n" に続いて下のラインから順に
+   RGB の float、尺度が負ならリトルエンディアン)。
+   HDR_TILED は、ヘッダを "PT\n幅 高さ タイルの大きさ\n尺度\n" として、
+   画像を左上から HDR_TILE x HDR_TILE のタイルに分け、タイルを上の列から
+   左から順に、各タイルの中は上のラインから順に並べる (右端と下端の
+   タイルは画像からはみ出す分を除く)。どちらもヘッダの後ろは fb を
+   そのまま書くので、ラインを受け取るときに書き込む位置に置いておく */
+
+/* (x, y) のピクセルの fb 中の位置 */
+size_t hdr_offset(ppm_writer_t *w, int x, int y) {
+  int t = HDR_TILE;
+  int ty, tx, th, tw;
+  if (w->hdr == HDR_PFM) {
+    return (size_t) (w->height - 1 - y) * w->width + x;
+  }
+  ty = y / t;
+  tx = x / t;
+  th = w->height - ty * t < t ? w->height - ty * t : t;
+  tw = w->width - tx * t < t ? w->width - tx * t : t;
+  return (size_t) ty * t * w->width + (size_t) tx * t * th + (y - ty * t) * tw + (x - tx * t);
+}
+
+/* 溜めた画像を、ヘッダに続けて1回の fwrite で書く */
+void write_hdr_image(ppm_writer_t *w) {
+  union {int i; char c;} endian;
+  const char *scale;
+  endian.i = 1;
+  scale = endian.c ? "-1.0" : "1.0";
+  if (w->hdr == HDR_PFM) {
+    printf("PF\n%d %d\n%s\n", w->width, w->height, scale);
+  } else {
+    printf("PT\n%d %d %d\n%s\n", w->width, w->height, HDR_TILE, scale);
+  }
+  fwrite(w->fb, sizeof(float), (size_t) 3 * w->width * w->height, stdout);
+}
+
+/* 1ライン分の値を fb に置き、最後のラインなら画像を書く */
+void write_hdr_row(ppm_writer_t *w, vec_t *rgbs) {
+  int x;
+  for (x = 0; x < w->width; ++x) {
+    float *p = w->fb + 3 * hdr_offset(w, x, w->y);
+    p[0] = (float) (rgbs[x].x * (1.0 / 255.0));
+    p[1] = (float) (rgbs[x].y * (1.0 / 255.0));
+    p[2] = (float) (rgbs[x].z * (1.0 / 255.0));
+  }
+  if (++w->y == w->height) {
+    write_hdr_image(w);
+  }
+}
+
+/* sink が 0 以上なら、ピクセル値を標準出力ではなくそこに枠に入れて送る。
+   hdr が HDR_NONE でなければ、PPM の代わりにその形式の画像を書く */
+void init_ppm_writer(ppm_writer_t *w, scene_t *sc, bool binary, int hdr, int sink) {
+  w->binary = binary;
+  w->width  = sc->image_size[0];
+  w->height = sc->image_size[1];
+  w->row    = binary || sink >= 0 ? malloc(3 * w->width) : NULL;
+  w->sink   = sink;
+  w->hdr    = hdr;
+  w->fb     = hdr != HDR_NONE ? malloc(sizeof(float) * 3 * w->width * w->height) : NULL;
+  w->y      = 0;
+}
+
+void free_ppm_writer(ppm_writer_t *w) {
+  free(w->row);
+  free(w->fb);
+  w->row = NULL;
+  w->fb = NULL;
+  if (w->sink >= 0) {
+    close(w->sink);
+    w->sink = -1;
+  }
+}
+
+void write_ppm_header(ppm_writer_t *w, scene_t *sc) {
+  w->y = 0;
+  if (w->hdr != HDR_NONE) {
+    /* ヘッダは画像と一緒に書く */
+    return;
+  }
+  if (w->sink >= 0) {
+    char head[64];
+    sprintf(head, "P6\n%d %d 255\n", sc->image_size[0], sc->image_size[1]);
+    sink_frame(w, -1, head, strlen(head));
+    return;
+  }
   print_char(80); /* 'P' */
-  print_char(48 + 3); /* +6 if binary */ /* 48 = '0' */
+  print_char(48 + (w->binary ? 6 : 3)); /* 48 = '0' */
   print_char(10);
-  print_int(image_size[0]);
+  print_int(sc->image_size[0]);
   print_char(32);
-  print_int(image_size[1]);
+  print_int(sc->image_size[1]);
   print_char(32);
   print_int(255);
   print_char(10);
 }
 
-void write_rgb_element(double x) {
+/* 出力するRGB値の要素。整数に切り捨てて 0 〜 255 に収める */
+int rgb_element(double x) {
   int ix = int_of_double(x);
   int elem = ix;
   if (ix > 255) {
@@ -1928,19 +3617,47 @@ void write_rgb_element(double x) {
   } else if (ix < 0) {
     elem = 0;
   }
-  print_int(elem);
+  return elem;
 }
 
+void write_rgb_element(double x) {
+  print_int(rgb_element(x));
+}
 
-void write_rgb() {
-  write_rgb_element(rgb.x); /* Red */
+
+void write_rgb(vec_t *rgb) {
+  write_rgb_element(rgb->x); /* Red */
   print_char(32);
-  write_rgb_element(rgb.y); /* Green */
+  write_rgb_element(rgb->y); /* Green */
   print_char(32);
-  write_rgb_element(rgb.z); /* Blue */
+  write_rgb_element(rgb->z); /* Blue */
   print_char(10);
 }
 
+/* 1ライン分のRGB値を出力する。P6 ならバッファに詰めて一度に書き込む */
+void write_rgb_row(ppm_writer_t *w, vec_t *rgbs) {
+  int x;
+  if (w->hdr != HDR_NONE) {
+    write_hdr_row(w, rgbs);
+  } else if (w->binary || w->sink >= 0) {
+    unsigned char *p = w->row;
+    for (x = 0; x < w->width; ++x) {
+      *p++ = rgb_element(rgbs[x].x);
+      *p++ = rgb_element(rgbs[x].y);
+      *p++ = rgb_element(rgbs[x].z);
+    }
+    if (w->sink >= 0) {
+      sink_frame(w, w->y++, w->row, 3 * w->width);
+    } else {
+      fwrite(w->row, 1, 3 * w->width, stdout);
+    }
+  } else {
+    for (x = 0; x < w->width; ++x) {
+      write_rgb(&rgbs[x]);
+    }
+  }
+}
+
 /******************************************************************************
    あるラインの計算に必要な情報を集めるため次のラインの追跡を行っておく関数群
 *****************************************************************************/
@@ -1949,50 +3666,70 @@ void write_rgb() {
    行わないと最終的なピクセルの値を計算できない */
 
 /* 間接光を 60本(20%)だけ計算しておく関数 */
-void pretrace_diffuse_rays(pixel_t *pixel, int nref) {
-  while (nref <= 4 && get_surface_id(pixel, nref) >= 0) {
+void pretrace_diffuse_rays(render_ctx_t *ctx, pixel_t *pixel, int nref) {
+  STAT_BEGIN(ctx);
+  while (nref < p_depth(pixel) && get_surface_id(pixel, nref) >= 0) {
     /* 間接光を計算するフラグが立っているか */
-    int *calc_diffuse = p_calc_diffuse(pixel);
-    if (calc_diffuse[nref]) {
+    if (p_calc_diffuse(pixel, nref)) {
       int group_id = p_group_id(pixel);
-      vec_t *nvectors;
-      vec_t *intersection_points;
+      vec_t *nvector;
+      vec_t *intersection_point;
       vec_t *ray20p;
-      vecbzero(&diffuse_ray);
-
-      /* 5つの方向ベクトル集合(各60本)から自分のグループIDに対応する物を
-         一つ選んで追跡 */
-      nvectors = p_nvectors(pixel);
-      intersection_points = p_intersection_points(pixel);
-      trace_diffuse_rays(dirvecs[group_id],
-                         &nvectors[nref],
-                         &intersection_points[nref]);
-      ray20p = p_received_ray_20percent(pixel);
-      ray20p[nref] = diffuse_ray;
+      vecbzero(&ctx->diffuse_ray);
+
+      nvector = &p_nvector(pixel, nref);
+      intersection_point = &p_intersection_point(pixel, nref);
+      ray20p = &p_received_ray_20percent(pixel, nref);
+      /* 放射照度キャッシュに使える記録があれば、300本分の 1/5 を60本分とする */
+      if (irr_cache_lookup_ctx(ctx, intersection_point, nvector, ray20p)) {
+        vecscale(ray20p, 0.2);
+      } else {
+        /* 5つの方向ベクトル集合(各60本)から自分のグループIDに対応する物を
+           一つ選んで追跡 */
+        trace_diffuse_rays(ctx, ctx->sc->dirvecs[group_id],
+                           nvector,
+                           intersection_point);
+        *ray20p = ctx->diffuse_ray;
+      }
     }
     ++nref;
   }
+  STAT_END(ctx, t_pretrace_diffuse);
+}
+
+
+/* ラインの中心から横に xdisp ずれた点を通る視点からの光線で、直接光追跡を行う */
+void pretrace_ray(render_ctx_t *ctx, pixel_t *pixel, double xdisp, int group_id, double lc0, double lc1, double lc2) {
+  scene_t *sc = ctx->sc;
+  ctx->ptrace_dirvec.x = xdisp * sc->screenx_dir.x + lc0;
+  ctx->ptrace_dirvec.y = xdisp * sc->screenx_dir.y + lc1;
+  ctx->ptrace_dirvec.z = xdisp * sc->screenx_dir.z + lc2;
+  vecunit_sgn(&ctx->ptrace_dirvec, false);
+  vecbzero(&ctx->rgb);
+  ctx->startp = sc->viewpoint;
+
+  /* 直接光追跡 */
+  STAT_BEGIN(ctx);
+  trace_ray(ctx, 1.0, &ctx->ptrace_dirvec, pixel);
+  STAT_END(ctx, t_direct);
+  *p_rgb(pixel) = ctx->rgb;
+  p_set_group_id(pixel, group_id);
 }
 
+/* x 番目のピクセルに対して直接光追跡を行う */
+void pretrace_pixel(render_ctx_t *ctx, pixel_t *pixel, int x, int group_id, double lc0, double lc1, double lc2) {
+  scene_t *sc = ctx->sc;
+  double xdisp = sc->scan_pitch * float_of_int(x - sc->image_center[0]);
+  pretrace_ray(ctx, pixel, xdisp, group_id, lc0, lc1, lc2);
+}
 
 /* 各ピクセルに対して直接光追跡と間接受光の20%分の計算を行う */
-void pretrace_pixels(pixel_t *line, int x, int group_id, double lc0, double lc1, double lc2) {
+void pretrace_pixels(render_ctx_t *ctx, pixel_t *line, int x, int group_id, double lc0, double lc1, double lc2) {
   while (x >= 0) {
-    double xdisp = scan_pitch * float_of_int(x - image_center[0]);
-    ptrace_dirvec.x = xdisp * screenx_dir.x + lc0;
-    ptrace_dirvec.y = xdisp * screenx_dir.y + lc1;
-    ptrace_dirvec.z = xdisp * screenx_dir.z + lc2;
-    vecunit_sgn(&ptrace_dirvec, false);
-    vecbzero(&rgb);
-    startp = viewpoint;
-
-    /* 直接光追跡 */
-    trace_ray(0, 1.0, &ptrace_dirvec, &line[x], 0.0);
-    *p_rgb(&line[x]) = rgb;
-    p_set_group_id(&line[x], group_id);
+    pretrace_pixel(ctx, &line[x], x, group_id, lc0, lc1, lc2);
 
     /* 間接光の20%を追跡 */
-    pretrace_diffuse_rays(&line[x], 0);
+    pretrace_diffuse_rays(ctx, &line[x], 0);
 
     --x;
     group_id = (group_id + 1) % 5;
@@ -2001,43 +3738,180 @@ void pretrace_pixels(pixel_t *line, int x, int group_id, double lc0, double lc1,
 
 
 /* あるラインの各ピクセルに対し直接光追跡と間接受光20%分の計算をする */
-void pretrace_line(pixel_t *line, int y, int group_id) {
-  double ydisp = scan_pitch * float_of_int(y - image_center[1]);
+void pretrace_line(render_ctx_t *ctx, pixel_t *line, int y, int group_id) {
+  scene_t *sc = ctx->sc;
+  double ydisp = sc->scan_pitch * float_of_int(y - sc->image_center[1]);
   /* ラインの中心に向かうベクトルを計算 */
-  double lc0 = ydisp * screeny_dir.x + screenz_dir.x;
-  double lc1 = ydisp * screeny_dir.y + screenz_dir.y;
-  double lc2 = ydisp * screeny_dir.z + screenz_dir.z;
-  pretrace_pixels(line, image_size[0] - 1, group_id, lc0, lc1, lc2);
+  double lc0 = ydisp * sc->screeny_dir.x + sc->screenz_dir.x;
+  double lc1 = ydisp * sc->screeny_dir.y + sc->screenz_dir.y;
+  double lc2 = ydisp * sc->screeny_dir.z + sc->screenz_dir.z;
+  pretrace_pixels(ctx, line, sc->image_size[0] - 1, group_id, lc0, lc1, lc2);
+}
+
+/******************************************************************************
+   エッジのピクセルの適応的なアンチエイリアス (-aa)
+*****************************************************************************/
+
+/* 上下左右のどれかと違う面に当たったか、直接光の色がどれかの成分で
+   sc->aa_threshold を超えて違うピクセルだけを、ピクセル内に aa x aa の格子状に
+   並べた点を通る光線で追跡し直し、元の光線と合わせた aa * aa + 1 本の平均を
+   ピクセル値とする。追加の光線の間接受光は、元の光線や先に追跡した光線と
+   同じ反射回数で同じ面に当たっていればその値を使い回し、初めての面に
+   当たったときだけ300本を追跡して求める。そのため手間はエッジの
+   ピクセルの数に比例して増える */
+#define DEFAULT_AA_THRESHOLD 16.0
+
+/* ピクセル a と b の直接光追跡の結果が、違う面に当たったか、色が閾値を超えて
+   違うか */
+bool aa_differ(scene_t *sc, pixel_t *a, pixel_t *b) {
+  vec_t *ca = p_rgb(a);
+  vec_t *cb = p_rgb(b);
+  double t = sc->aa_threshold;
+  return p_surface_id(a, 0) != p_surface_id(b, 0)
+    || fabs(ca->x - cb->x) > t || fabs(ca->y - cb->y) > t || fabs(ca->z - cb->z) > t;
+}
+
+/* 画像上の (x, y) のピクセル cur[i] が、上下左右にある点のどれかと違うか */
+bool is_aa_edge(scene_t *sc, int x, int y, int i, pixel_t *prev, pixel_t *cur, pixel_t *next) {
+  pixel_t *c = &cur[i];
+  return (x > 0 && aa_differ(sc, c, &cur[i-1]))
+    || (x + 1 < sc->image_size[0] && aa_differ(sc, c, &cur[i+1]))
+    || (y > 0 && aa_differ(sc, c, &prev[i]))
+    || (y + 1 < sc->image_size[1] && aa_differ(sc, c, &next[i]));
+}
+
+/* 反射回数 nref で面 sid に当たった点の間接受光を探す。無ければ NULL */
+vec_t *find_aa_diffuse(render_ctx_t *ctx, int key) {
+  int k;
+  for (k = 0; k < ctx->n_aa_vals; ++k) {
+    if (ctx->aa_keys[k] == key) {
+      return &ctx->aa_vals[k];
+    }
+  }
+  return NULL;
+}
+
+void add_aa_diffuse(render_ctx_t *ctx, int key, vec_t *irr) {
+  ctx->aa_keys[ctx->n_aa_vals] = key;
+  ctx->aa_vals[ctx->n_aa_vals] = *irr;
+  ++ctx->n_aa_vals;
+}
+
+/* 追加の光線の追跡結果 pixel の各衝突点に間接受光を加え、ctx->rgb に
+   その光線の値を求める */
+void shade_aa_sample(render_ctx_t *ctx, pixel_t *pixel) {
+  scene_t *sc = ctx->sc;
+  int nref;
+  ctx->rgb = *p_rgb(pixel);
+  for (nref = 0; nref < p_depth(pixel) && p_surface_id(pixel, nref) >= 0; ++nref) {
+    int key;
+    vec_t *irr;
+    if (!p_calc_diffuse(pixel, nref)) {
+      continue;
+    }
+    key = nref * sc->n_objects * 4 + p_surface_id(pixel, nref);
+    irr = find_aa_diffuse(ctx, key);
+    if (irr != NULL) {
+      vecaccumv(&ctx->rgb, &p_energy(pixel, nref), irr);
+      continue;
+    }
+    /* 初めての面なので、自分のグループの60本と残りの240本を追跡する */
+    ++ctx->count.n_aa_diffuse;
+    vecbzero(&ctx->diffuse_ray);
+    trace_diffuse_rays(ctx, sc->dirvecs[p_group_id(pixel)],
+                       &p_nvector(pixel, nref), &p_intersection_point(pixel, nref));
+    p_received_ray_20percent(pixel, nref) = ctx->diffuse_ray;
+    calc_diffuse_using_1point(ctx, pixel, nref);
+    add_aa_diffuse(ctx, key, &ctx->diffuse_ray);
+  }
+}
+
+/* ctx->rgb に求めた (x, y) のピクセル cur[i] の値を、エッジならピクセル内の
+   aa * aa 本の光線を加えた平均に置き換える */
+void antialias_pixel(render_ctx_t *ctx, int x, int y, int i, pixel_t *prev, pixel_t *cur, pixel_t *next) {
+  scene_t *sc = ctx->sc;
+  pixel_t *c = &cur[i];
+  pixel_t *sub = ctx->aa_pixel;
+  int n = sc->aa;
+  int nref, u, v;
+  vec_t sum;
+  if (!is_aa_edge(sc, x, y, i, prev, cur, next)) {
+    return;
+  }
+  ++ctx->count.n_aa_pixels;
+  sum = ctx->rgb;
+
+  /* 元の光線の間接受光を覚えておく */
+  ctx->n_aa_vals = 0;
+  for (nref = 0; nref < p_depth(c) && p_surface_id(c, nref) >= 0; ++nref) {
+    if (p_calc_diffuse(c, nref)) {
+      add_aa_diffuse(ctx, nref * sc->n_objects * 4 + p_surface_id(c, nref), &ctx->aa_irr[nref]);
+    }
+  }
+
+  for (v = 0; v < n; ++v) {
+    double ydisp = sc->scan_pitch * (float_of_int(y - sc->image_center[1]) + (v + 0.5) / n - 0.5);
+    double lc0 = ydisp * sc->screeny_dir.x + sc->screenz_dir.x;
+    double lc1 = ydisp * sc->screeny_dir.y + sc->screenz_dir.y;
+    double lc2 = ydisp * sc->screeny_dir.z + sc->screenz_dir.z;
+    for (u = 0; u < n; ++u) {
+      double xdisp = sc->scan_pitch * (float_of_int(x - sc->image_center[0]) + (u + 0.5) / n - 0.5);
+      for (nref = 0; nref < p_depth(sub); ++nref) {
+        p_surface_id(sub, nref) = -1;
+      }
+      pretrace_ray(ctx, sub, xdisp, p_group_id(c), lc0, lc1, lc2);
+      shade_aa_sample(ctx, sub);
+      vecadd(&sum, &ctx->rgb);
+    }
+  }
+  vecscale(&sum, 1.0 / (n * n + 1));
+  ctx->rgb = sum;
 }
 
 /******************************************************************************
    直接光追跡と間接光20%追跡の結果から最終的なピクセル値を計算する関数
 *****************************************************************************/
 
+/* 画像上の (x, y) のピクセル値を ctx->rgb に計算する。
+   そのピクセルは cur[i] で、上下のラインは前処理済みのこと */
+void scan_pixel(render_ctx_t *ctx, int x, int y, int i, pixel_t *prev, pixel_t *cur, pixel_t *next) {
+  STAT_BEGIN(ctx);
+  /* まず、直接光追跡で得られたRGB値を得る */
+  ctx->rgb = *p_rgb(&cur[i]);
+
+  /* 次に、直接光の各衝突点について、間接受光による寄与を加味する */
+  if (neighbors_exist(ctx->sc, x, y, next)) {
+    try_exploit_neighbors(ctx, i, y, prev, cur, next, 0);
+  } else {
+    STAT_INC(ctx, edge_pixels);
+    do_without_neighbors(ctx, &cur[i], 0);
+  }
+  STAT_END(ctx, t_scan);
+  if (ctx->sc->aa > 0) {
+    antialias_pixel(ctx, x, y, i, prev, cur, next);
+  }
+}
+
 /* ピクセル値を計算 */
-void scan_lines(pixel_t *prev, pixel_t *cur, pixel_t *next, int group_id) {
+void scan_lines(render_ctx_t *ctx, ppm_writer_t *out, pixel_t *prev, pixel_t *cur, pixel_t *next, int group_id) {
+  scene_t *sc = ctx->sc;
+  vec_t *rgbs = calloc(sc->image_size[0], sizeof(vec_t));
   int y, x;
   pixel_t *t;
-  for (y = 0; y < image_size[1]; ++y) {
+  for (y = 0; y < sc->image_size[1]; ++y) {
 
-    if (y < image_size[1] - 1) {
-      pretrace_line(next, y + 1, group_id);
+    if (y < sc->image_size[1] - 1) {
+      pretrace_line(ctx, next, y + 1, group_id);
     }
 
-    for (x = 0; x < image_size[0]; ++x) {
-      /* まず、直接光追跡で得られたRGB値を得る */
-      rgb = *p_rgb(&cur[x]);
+    for (x = 0; x < sc->image_size[0]; ++x) {
+      scan_pixel(ctx, x, y, x, prev, cur, next);
+      rgbs[x] = ctx->rgb;
+    }
 
-      /* 次に、直接光の各衝突点について、間接受光による寄与を加味する */
-      if (neighbors_exist(x, y, next)) {
-        try_exploit_neighbors(x, y, prev, cur, next, 0);
-      } else {
-        do_without_neighbors(&cur[x], 0);
-      }
+    /* 得られた値をPPMファイルに出力 */
+    write_rgb_row(out, rgbs);
 
-      /* 得られた値をPPMファイルに出力 */
-      write_rgb();
-    }
     t = prev;
     prev = cur;
     cur  = next;
@@ -2047,34 +3921,75 @@ void scan_lines(pixel_t *prev, pixel_t *cur, pixel_t *next, int group_id) {
       group_id -= 5;
     }
   }
+  free(rgbs);
 }
 
 
 /******************************************************************************
    ピクセルの情報を格納するデータ構造の割り当て関数群
  *****************************************************************************/
-/* ピクセルを表すtupleを割り当て */
-void create_pixel(pixel_t *pixel) {
-  vecbzero(&pixel->rgb);
-  pixel->isect_ps = calloc(sizeof(vec_t), 5);
-  pixel->sids = calloc(sizeof(int), 5);
-  pixel->cdif = calloc(sizeof(int), 5);
-  pixel->engy = calloc(sizeof(vec_t), 5);
-  pixel->r20p = calloc(sizeof(vec_t), 5);
-  pixel->gid = 0;
-  pixel->nvectors = calloc(sizeof(vec_t), 5);
+/* n 個のピクセルの depth 回分の反射ごとの情報を、ヘッダと配列を合わせて
+   1回で割り当てる */
+pixel_block_t *create_pixel_block(int n, int depth) {
+  size_t nv = (size_t)depth * n;
+  pixel_block_t *blk = calloc(1, sizeof(pixel_block_t) + sizeof(vec_t) * 4 * nv + sizeof(int) * 2 * nv);
+  vec_t *v = (vec_t *)(blk + 1);
+  int *k = (int *)(v + 4 * nv);
+  blk->n        = n;
+  blk->depth    = depth;
+  blk->isect_ps = v;
+  blk->engy     = v + nv;
+  blk->r20p     = v + 2 * nv;
+  blk->nvectors = v + 3 * nv;
+  blk->sids     = k;
+  blk->cdif     = k + nv;
+  return blk;
 }
 
-/* 横方向1ライン分のピクセル配列を作る */
-pixel_t *create_pixelline() {
-  pixel_t *line = calloc(sizeof(pixel_t), image_size[0]);
+/* 反射を sc->max_depth 回分記録できる n 個のピクセル配列を作る。
+   ピクセルごとの割り当ては行わない */
+pixel_t *create_pixels(scene_t *sc, int n) {
+  pixel_t *line = calloc(sizeof(pixel_t), n + 1);
+  pixel_block_t *blk = create_pixel_block(n, sc->max_depth);
   int i;
-  for (i = 0; i < image_size[0]; ++i) {
-    create_pixel(&line[i]);
+  for (i = 0; i < n; ++i) {
+    line[i].x   = i;
+    line[i].blk = blk;
   }
+  /* n が 0 でも free_pixels でブロックを見つけられるよう、番兵にも持たせる */
+  line[n].blk = blk;
   return line;
 }
 
+void free_pixels(pixel_t *line, int n) {
+  free(line[n].blk);
+  free(line);
+}
+
+/* 横方向1ライン分のピクセル配列を作る */
+pixel_t *create_pixelline(scene_t *sc) {
+  return create_pixels(sc, sc->image_size[0]);
+}
+
+void free_pixelline(scene_t *sc, pixel_t *line) {
+  free_pixels(line, sc->image_size[0]);
+}
+
+/* ピクセルの内容を複製する */
+void copy_pixel(pixel_t *dst, pixel_t *src) {
+  int i;
+  dst->rgb = src->rgb;
+  dst->gid = src->gid;
+  for (i = 0; i < p_depth(dst); ++i) {
+    p_intersection_point(dst, i)     = p_intersection_point(src, i);
+    p_surface_id(dst, i)             = p_surface_id(src, i);
+    p_calc_diffuse(dst, i)           = p_calc_diffuse(src, i);
+    p_energy(dst, i)                 = p_energy(src, i);
+    p_received_ray_20percent(dst, i) = p_received_ray_20percent(src, i);
+    p_nvector(dst, i)                = p_nvector(src, i);
+  }
+}
+
 /******************************************************************************
    間接光のサンプリングにつかう方向ベクトル群を計算する関数群
 *****************************************************************************/
@@ -2094,7 +4009,7 @@ double adjust_position(double h, double ratio) {
 }
 
 /* ベクトル達が出来るだけ球面状に一様に分布するような向きを計算する */
-void calc_dirvec(int icount, double x, double y, double rx, double ry, int group_id, int index) {
+void calc_dirvec(scene_t *sc, int icount, double x, double y, double rx, double ry, int group_id, int index) {
   double l, vx, vy, vz;
   dvec_t *dgroup;
 
@@ -2109,7 +4024,7 @@ void calc_dirvec(int icount, double x, double y, double rx, double ry, int group
   vz = 1.0 / l;
 
   /* 立方体的に対称に分布させる */
-  dgroup = dirvecs[group_id];
+  dgroup = sc->dirvecs[group_id];
   vecset(d_vec(&dgroup[index]),    vx, vy, vz);
   vecset(d_vec(&dgroup[index+40]), vx, vz, fneg(vy));
   vecset(d_vec(&dgroup[index+80]), vz, fneg(vx), fneg(vy));
@@ -2120,15 +4035,15 @@ void calc_dirvec(int icount, double x, double y, double rx, double ry, int group
 }
 
 /* 立方体上の 10x10格子の行中の各ベクトルを計算する */
-void calc_dirvecs(int col, double ry, int group_id, int index) {
+void calc_dirvecs(scene_t *sc, int col, double ry, int group_id, int index) {
   while (col >= 0) {
     double rx, rx2;
     /* 左半分 */
     rx = float_of_int(col) * 0.2 - 0.9; /* 列の座標 */
-    calc_dirvec(0, 0.0, 0.0, rx, ry, group_id, index);
+    calc_dirvec(sc, 0, 0.0, 0.0, rx, ry, group_id, index);
     /* 右半分 */
     rx2 = float_of_int(col) * 0.2 + 0.1;  /* 列の座標 */
-    calc_dirvec(0, 0.0, 0.0, rx2, ry, group_id, (index + 2));
+    calc_dirvec(sc, 0, 0.0, 0.0, rx2, ry, group_id, (index + 2));
 
     --col;
     if(++group_id >= 5) {
@@ -2138,10 +4053,10 @@ void calc_dirvecs(int col, double ry, int group_id, int index) {
 }
 
 /* 立方体上の10x10格子の各行に対しベクトルの向きを計算する */
-void calc_dirvec_rows(int row, int group_id, int index) {
+void calc_dirvec_rows(scene_t *sc, int row, int group_id, int index) {
   while (row >= 0) {
     double ry = float_of_int(row) * 0.2 - 0.9; /* 行の座標 */
-    calc_dirvecs(4, ry, group_id, index); /* 一行分計算 */
+    calc_dirvecs(sc, 4, ry, group_id, index); /* 一行分計算 */
     --row;
     group_id += 2;
     if(group_id >= 5) {
@@ -2151,10 +4066,10 @@ void calc_dirvec_rows(int row, int group_id, int index) {
   }
 }
 
-void create_dirvecs(int index) {
+void create_dirvecs(scene_t *sc, int index) {
 
   while(index >= 0) {
-    dirvecs[index] = calloc(120, sizeof(dvec_t));
+    sc->dirvecs[index] = calloc(120, sizeof(dvec_t));
     --index;
   }
 
@@ -2164,24 +4079,24 @@ void create_dirvecs(int index) {
 /******************************************************************************
    補助関数達を呼び出してdirvecの初期化を行う
 *****************************************************************************/
-void init_dirvec_constants(dvec_t vecset[], int index) {
+void init_dirvec_constants(scene_t *sc, dvec_t vecset[], int index) {
   while (index >= 0) {
-    setup_dirvec_constants(&vecset[index]);
+    setup_dirvec_constants(sc, &vecset[index]);
     --index;
   }
 }
 
-void init_vecset_constants(int index) {
+void init_vecset_constants(scene_t *sc, int index) {
   while (index >= 0) {
-    init_dirvec_constants(dirvecs[index], 119);
+    init_dirvec_constants(sc, sc->dirvecs[index], 119);
     --index;
   }
 }
 
-void init_dirvecs() {
-  create_dirvecs(4);
-  calc_dirvec_rows(9, 0, 0);
-  init_vecset_constants(4);
+void init_dirvecs(scene_t *sc) {
+  create_dirvecs(sc, 4);
+  calc_dirvec_rows(sc, 9, 0, 0);
+  init_vecset_constants(sc, 4);
 }
 
 
@@ -2190,94 +4105,1983 @@ void init_dirvecs() {
 *****************************************************************************/
 
 /* 反射平面を追加する */
-void add_reflection(int index, int surface_id, double bright, double v0, double v1, double v2) {
-  dvec_t *dvec = &reflections[index].dv;
+void add_reflection(scene_t *sc, int index, int surface_id, double bright, double v0, double v1, double v2) {
+  dvec_t *dvec;
+  sc->reflections = grow_array(sc->reflections, &sc->cap_reflections, index, sizeof(refl_t));
+  dvec = &sc->reflections[index].dv;
+  dvec->cnst = NULL;
   vecset(d_vec(dvec), v0, v1, v2); /* 反射光の向き */
-  setup_dirvec_constants(dvec);
-  reflections[index].sid = surface_id;
-  reflections[index].br  = bright;
+  setup_dirvec_constants(sc, dvec);
+  sc->reflections[index].sid = surface_id;
+  sc->reflections[index].br  = bright;
 }
 
 /* 直方体の各面について情報を追加する */
-void setup_rect_reflection(int obj_id, obj_t *obj) {
+void setup_rect_reflection(scene_t *sc, int obj_id, obj_t *obj) {
   int sid = obj_id * 4;
-  int nr  = n_reflections;
+  int nr  = sc->n_reflections;
   double br = 1.0 - o_diffuse(obj);
-  double n0 = fneg(light.x);
-  double n1 = fneg(light.y);
-  double n2 = fneg(light.z);
-  add_reflection(nr, sid + 1, br, light.x, n1, n2);
-  add_reflection(nr + 1, sid + 2, br, n0, light.y, n2);
-  add_reflection(nr + 2, sid + 3, br, n0, n1, light.z);
-  n_reflections += 3;
+  double n0 = fneg(sc->light.x);
+  double n1 = fneg(sc->light.y);
+  double n2 = fneg(sc->light.z);
+  add_reflection(sc, nr, sid + 1, br, sc->light.x, n1, n2);
+  add_reflection(sc, nr + 1, sid + 2, br, n0, sc->light.y, n2);
+  add_reflection(sc, nr + 2, sid + 3, br, n0, n1, sc->light.z);
+  sc->n_reflections += 3;
 }
 
 
 /* 平面について情報を追加する */
-void setup_surface_reflection(int obj_id, obj_t *obj) {
+void setup_surface_reflection(scene_t *sc, int obj_id, obj_t *obj) {
   int sid = obj_id * 4 + 1;
-  int nr  = n_reflections;
+  int nr  = sc->n_reflections;
   double br = 1.0 - o_diffuse(obj);
-  double p = veciprod(&light, o_param_abc(obj));
-  add_reflection(nr, sid, br,
-                 2.0 * o_param_a(obj) * p - light.x,
-                 2.0 * o_param_b(obj) * p - light.y,
-                 2.0 * o_param_c(obj) * p - light.z);
-  n_reflections += 1;
+  double p = veciprod(&sc->light, o_param_abc(obj));
+  add_reflection(sc, nr, sid, br,
+                 2.0 * o_param_a(obj) * p - sc->light.x,
+                 2.0 * o_param_b(obj) * p - sc->light.y,
+                 2.0 * o_param_c(obj) * p - sc->light.z);
+  sc->n_reflections += 1;
 }
 
 /* 各オブジェクトに対し、反射する平面があればその情報を追加する */
-void setup_reflections(int obj_id) {
+void setup_reflections(scene_t *sc, int obj_id) {
   if (obj_id >= 0) {
-    obj_t *obj = &objects[obj_id];
+    obj_t *obj = &sc->objects[obj_id];
     if (o_reflectiontype(obj) == 2) {
       if (o_diffuse(obj) < 1.0) {
         int m_shape = o_form(obj);
         if (m_shape == 1) {
-          setup_rect_reflection(obj_id, obj);
+          setup_rect_reflection(sc, obj_id, obj);
         } else if (m_shape == 2) {
-          setup_surface_reflection(obj_id, obj);
+          setup_surface_reflection(sc, obj_id, obj);
         }
       }
     }
   }
 }
 
-/*****************************************************************************
-   全体の制御
+/******************************************************************************
+   シーンと追跡状態の割り当て関数群
 *****************************************************************************/
 
-/* レイトレの各ステップを行う関数を順次呼び出す */
-void rt (int size_x, int size_y) {
-  pixel_t *prev, *cur, *next;
-  image_size[0] = size_x;
-  image_size[1] = size_y;
-  image_center[0] = size_x / 2;
-  image_center[1] = size_y / 2;
-  scan_pitch = 128.0 / float_of_int(size_x);
-  prev = create_pixelline();
-  cur  = create_pixelline();
-  next = create_pixelline();
-  read_parameter();
-  write_ppm_header();
-  init_dirvecs();
-  *d_vec(&light_dirvec) = light;
-  setup_dirvec_constants(&light_dirvec);
-  setup_reflections(n_objects - 1);
-  pretrace_line(cur, 0, 0);
-  scan_lines(prev, cur, next, 2);
-}
-
-
-int main() {
+/* 空のシーンを割り当てる */
+scene_t *create_scene(void) {
+  scene_t *sc = calloc(1, sizeof(scene_t));
+  sc->beam = 255.0;
+  sc->max_depth = DEFAULT_MAX_DEPTH;
+  sc->energy_cutoff = DEFAULT_ENERGY_CUTOFF;
+  return sc;
+}
+
+/* シーンとその前処理済みデータを解放する */
+void free_scene(scene_t *sc) {
+  int i;
+  free(sc->net_words);
+  free(sc->or_net);
+  for (i = 0; i < 5; ++i) {
+    free(sc->dirvecs[i]);
+  }
+  if (sc->bvh != NULL) {
+    free_bvh(sc->bvh);
+  }
+  if (sc->light_map != NULL) {
+    free_light_map(sc->light_map);
+  }
+  if (sc->irr_cache != NULL) {
+    free_irr_cache(sc->irr_cache);
+  }
+  free_dconst_arena(sc);
+  free(sc->and_net);
+  free(sc->objects);
+  free(sc->base_abc);
+  free(sc->reflections);
+  free(sc);
+}
+
+/* 前処理済みのシーンが使うメモリ量を標準エラーに出力する */
+void report_scene_memory(scene_t *sc) {
+  double objects = sizeof(obj_t) * (double) sc->n_objects;
+  double tables = sizeof(double) * (double) sc->dconst_cap * sc->dconst_len
+    + sizeof(int) * (double) sc->n_objects;
+  double nets = sizeof(int *) * (double) sc->n_and_net;
+  int i;
+  for (i = 0; i < sc->n_and_net; ++i) {
+    int len = 0;
+    while (sc->and_net[i][len] != -1) {
+      ++len;
+    }
+    nets += (len + 1) * sizeof(int);
+  }
+  fprintf(stderr, "scene: %d objects, %.0f bytes (objects %.0f, dirvec tables %.0f, and networks %.0f)\n",
+          sc->n_objects, objects + tables + nets, objects, tables, nets);
+  if (sc->n_objects > 0) {
+    fprintf(stderr, "scene: %.0f bytes/object (obj_t %.0f, dirvec tables %.0f)\n",
+            (objects + tables + nets) / sc->n_objects,
+            objects / sc->n_objects, tables / sc->n_objects);
+  }
+}
+
+/* シーン sc を追跡するための状態を初期化する (シーンの読み込み後に呼ぶ) */
+void init_render_ctx(render_ctx_t *ctx, scene_t *sc) {
+  memset(ctx, 0, sizeof(render_ctx_t));
+  ctx->sc = sc;
+  ctx->tmin = 1000000000.0;
+  ctx->ctbl = calloc(sc->n_objects + 1, sizeof(vec4_t));
+  if (sc->bvh != NULL) {
+    ctx->bvh_hits  = calloc(sc->bvh->n_items + 1, sizeof(bvh_hit_t));
+    ctx->bvh_stack = calloc(sc->bvh->n_nodes + 1, sizeof(int));
+  }
+  if (sc->aa > 0) {
+    int n = sc->max_depth * (sc->aa * sc->aa + 1);
+    ctx->aa_pixel = create_pixels(sc, 1);
+    ctx->aa_irr   = calloc(sc->max_depth, sizeof(vec_t));
+    ctx->aa_keys  = calloc(n, sizeof(int));
+    ctx->aa_vals  = calloc(n, sizeof(vec_t));
+  }
+}
+
+void free_render_ctx(render_ctx_t *ctx) {
+  free(ctx->ctbl);
+  free(ctx->bvh_hits);
+  free(ctx->bvh_stack);
+  ctx->ctbl = NULL;
+  ctx->bvh_hits = NULL;
+  ctx->bvh_stack = NULL;
+  if (ctx->aa_pixel != NULL) {
+    free_pixels(ctx->aa_pixel, 1);
+    ctx->aa_pixel = NULL;
+  }
+  free(ctx->aa_irr);
+  free(ctx->aa_keys);
+  free(ctx->aa_vals);
+  ctx->aa_irr = NULL;
+  ctx->aa_keys = NULL;
+  ctx->aa_vals = NULL;
+}
+
+/* スレッドごとの計測値 src を total に足し込む */
+void add_ray_count(ray_count_t *total, ray_count_t *src) {
+  total->n_rays       += src->n_rays;
+  total->n_shadow     += src->n_shadow;
+  total->n_shadowed   += src->n_shadowed;
+  total->n_cache_hits += src->n_cache_hits;
+  total->n_map_hits   += src->n_map_hits;
+  total->n_irr_lookups += src->n_irr_lookups;
+  total->n_irr_hits    += src->n_irr_hits;
+  total->n_aa_pixels   += src->n_aa_pixels;
+  total->n_aa_diffuse  += src->n_aa_diffuse;
+#ifdef RT_STATS
+  {
+    rt_stats_t *t = &total->stats, *s = &src->stats;
+    int k;
+    for (k = 0; k < N_SHAPE_CLASS; ++k) {
+      t->solver[k]        += s->solver[k];
+    }
+    t->and_early_exits    += s->and_early_exits;
+    t->five_point         += s->five_point;
+    t->one_point          += s->one_point;
+    t->neighbor_fallbacks += s->neighbor_fallbacks;
+    t->edge_pixels        += s->edge_pixels;
+    t->t_direct           += s->t_direct;
+    t->t_pretrace_diffuse += s->t_pretrace_diffuse;
+    t->t_scan             += s->t_scan;
+  }
+#endif
+}
+
+#ifdef RT_STATS
+/* 形の分類ごとの計測値を JSON のオブジェクトとして書く */
+void print_shape_counts(FILE *fp, const char *name, unsigned long *n) {
+  fprintf(fp, "  \"%s\": {\"rect\": %lu, \"plane\": %lu, \"second\": %lu},\n",
+          name, n[0], n[1], n[2]);
+}
+
+/* RT_STATS の計測値を JSON で fp に書く。時間はスレッドの合計 */
+void print_stats_json(FILE *fp, ray_count_t *c, int n_threads, double t_init_dirvecs, double wall) {
+  rt_stats_t *s = &c->stats;
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"threads\": %d,\n", n_threads);
+  fprintf(fp, "  \"rays\": %lu,\n", c->n_rays);
+  fprintf(fp, "  \"shadow_tests\": %lu,\n", c->n_shadow);
+  fprintf(fp, "  \"shadowed\": %lu,\n", c->n_shadowed);
+  print_shape_counts(fp, "solver_calls", s->solver);
+  fprintf(fp, "  \"and_early_exits\": %lu,\n", s->and_early_exits);
+  fprintf(fp, "  \"diffuse\": {\"five_point\": %lu, \"one_point\": %lu, "
+          "\"neighbor_fallbacks\": %lu, \"edge_pixels\": %lu},\n",
+          s->five_point, s->one_point, s->neighbor_fallbacks, s->edge_pixels);
+  fprintf(fp, "  \"seconds\": {\"init_dirvecs\": %.6f, \"pretrace_direct\": %.6f, "
+          "\"pretrace_diffuse\": %.6f, \"scan\": %.6f, \"wall\": %.6f}\n",
+          t_init_dirvecs, s->t_direct, s->t_pretrace_diffuse, s->t_scan, wall);
+  fprintf(fp, "}\n");
+}
+#endif
+
+/******************************************************************************
+   光源から見た影の格子
+*****************************************************************************/
+
+/* 光源は平行光線で、シーンは動かないので、点が影に入るかどうかは点だけで
+   決まる。光の方向に垂直な平面 (u, v) を格子に分け、各セルに、光の方向に
+   見てそのセルと重なる AND グループ (包含箱を平面に写した長方形が重なるもの)
+   を並べておく。影の判定は全 AND グループの結果の OR なので、交点のセルの
+   要素だけを調べても結果は変わらない (厳密版)。
+
+   速い版は、さらに各セルの中心を通る直線上で影になり始める深さを二分法で
+   求めておく。直線上の点は深い (光源から遠い) ほど影に入りやすいので、
+   この深さより浅ければ照らされ、深ければ影に入る。周りのセルとこの深さが
+   平面でつながるセルでは、その平面から band 以上離れた点を調べずに答える。
+   影の境界の近くや、セルより小さな物体の影の周り、格子の外の点は厳密に
+   調べる。セルの中に収まってしまう小さな影は見落としうるので、出力は
+   厳密版と一致しない */
+
+/* 格子の長い辺のセル数 */
+#define LIGHT_MAP_RES 128
+/* セルに入れる要素の延べ数の目安 (セル1つあたり)。要素の数で割った数、
+   ただし LIGHT_MAP_WIDE 以上のセルに重なる要素は、セルではなく wide に入れる */
+#define LIGHT_MAP_FILL 16
+#define LIGHT_MAP_WIDE 64
+/* 影になり始める深さを求める二分法の回数 */
+#define LIGHT_MAP_ITER 24
+/* 速い版の誤差を測る標本の数 */
+#define LIGHT_MAP_SAMPLES 20000
+
+/* 包含箱 it を平面に写した長方形 r (u の下限、上限、v の下限、上限) と、
+   深さの範囲 [*wlo, *whi] を求める。有界でない箱は全体に広がるとみなす */
+void light_map_project(light_map_t *lm, bvh_item_t *it, double *r, double *wlo, double *whi) {
+  int k;
+  if (!bound_is_finite(&it->lo, &it->hi)) {
+    r[0] = r[2] = *wlo = -HUGE_VAL;
+    r[1] = r[3] = *whi = HUGE_VAL;
+    return;
+  }
+  r[0] = r[2] = *wlo = HUGE_VAL;
+  r[1] = r[3] = *whi = -HUGE_VAL;
+  for (k = 0; k < 8; ++k) {
+    vec_t q;
+    double pu, pv, pw;
+    vecset(&q, (k & 1) ? it->hi.x : it->lo.x,
+                (k & 2) ? it->hi.y : it->lo.y,
+                (k & 4) ? it->hi.z : it->lo.z);
+    pu = veciprod(&q, &lm->u);
+    pv = veciprod(&q, &lm->v);
+    pw = veciprod(&q, &lm->w);
+    r[0] = pu < r[0] ? pu : r[0];
+    r[1] = pu > r[1] ? pu : r[1];
+    r[2] = pv < r[2] ? pv : r[2];
+    r[3] = pv > r[3] ? pv : r[3];
+    *wlo = pw < *wlo ? pw : *wlo;
+    *whi = pw > *whi ? pw : *whi;
+  }
+  /* 交点の座標の丸め誤差の分だけ広げる */
+  for (k = 0; k < 4; ++k) {
+    r[k] += (k & 1 ? 1.0 : -1.0) * bvh_pad(r[k]);
+  }
+}
+
+/* 長方形 r と重なるセルの範囲 [i[0], i[1]] x [i[2], i[3]] */
+void light_map_cells(light_map_t *lm, double *r, int *i) {
+  int k;
+  for (k = 0; k < 4; ++k) {
+    double f = floor((r[k] - (k < 2 ? lm->u0 : lm->v0)) / lm->cell);
+    int lim = (k < 2 ? lm->nu : lm->nv) - 1;
+    i[k] = f < 0.0 ? 0 : f > lim ? lim : (int) f;
+  }
+}
+
+/* 平面上の (pu, pv) の、深さ pw の点が影に入るかを厳密に調べる */
+bool light_map_shadow_at(render_ctx_t *ctx, double pu, double pv, double pw) {
+  scene_t *sc = ctx->sc;
+  light_map_t *lm = sc->light_map;
+  vec_t *p = &ctx->intersection_point;
+  vecset(p, pu * lm->u.x + pv * lm->v.x + pw * sc->light.x,
+            pu * lm->u.y + pv * lm->v.y + pw * sc->light.y,
+            pu * lm->u.z + pv * lm->v.z + pw * sc->light.z);
+  return shadow_check_one_or_matrix(ctx, 0, sc->or_net);
+}
+
+/* 各セルの中心を通る直線上で影になり始める深さを求め、周りのセルと平面で
+   つながるセルだけ答えを決められるようにする */
+void build_light_cells(render_ctx_t *ctx, light_map_t *lm) {
+  int n_cells = lm->nu * lm->nv;
+  light_cell_t *raw = calloc(n_cells + 1, sizeof(light_cell_t));
+  int iu, iv, k;
+
+  lm->cells = calloc(n_cells + 1, sizeof(light_cell_t));
+  for (iv = 0; iv < lm->nv; ++iv) {
+    for (iu = 0; iu < lm->nu; ++iu) {
+      light_cell_t *c = &raw[iv * lm->nu + iu];
+      double pu = lm->u0 + (iu + 0.5) * lm->cell;
+      double pv = lm->v0 + (iv + 0.5) * lm->cell;
+      if (lm->n_wide == 0 && lm->cell_start[iv * lm->nu + iu + 1] == lm->cell_start[iv * lm->nu + iu]) {
+        c->kind = LIGHT_CELL_LIT;   /* 影を落としうる要素が無い */
+      } else if (light_map_shadow_at(ctx, pu, pv, lm->w_lo)) {
+        c->kind = LIGHT_CELL_SHADOW;
+      } else if (!light_map_shadow_at(ctx, pu, pv, lm->w_hi)) {
+        c->kind = LIGHT_CELL_LIT;
+      } else {
+        double lo = lm->w_lo, hi = lm->w_hi;
+        for (k = 0; k < LIGHT_MAP_ITER; ++k) {
+          double mid = 0.5 * (lo + hi);
+          if (light_map_shadow_at(ctx, pu, pv, mid)) {
+            hi = mid;
+          } else {
+            lo = mid;
+          }
+        }
+        c->kind = LIGHT_CELL_PLANE;
+        c->depth = 0.5 * (lo + hi);
+      }
+    }
+  }
+
+  /* 周りの8つのセルがすべて同じ種類で、平面の場合は深さが平面に乗るものだけ残す */
+  for (iv = 0; iv < lm->nv; ++iv) {
+    for (iu = 0; iu < lm->nu; ++iu) {
+      light_cell_t *c = &raw[iv * lm->nu + iu];
+      light_cell_t *out = &lm->cells[iv * lm->nu + iu];
+      bool smooth = iu > 0 && iv > 0 && iu < lm->nu - 1 && iv < lm->nv - 1;
+      int du, dv;
+      *out = *c;
+      if (smooth && c->kind == LIGHT_CELL_PLANE) {
+        out->du = 0.5 * (raw[iv * lm->nu + iu + 1].depth - raw[iv * lm->nu + iu - 1].depth);
+        out->dv = 0.5 * (raw[(iv + 1) * lm->nu + iu].depth - raw[(iv - 1) * lm->nu + iu].depth);
+      }
+      for (dv = -1; smooth && dv <= 1; ++dv) {
+        for (du = -1; smooth && du <= 1; ++du) {
+          light_cell_t *nb = &raw[(iv + dv) * lm->nu + iu + du];
+          smooth = nb->kind == c->kind &&
+            (c->kind != LIGHT_CELL_PLANE ||
+             fabs(nb->depth - (c->depth + out->du * du + out->dv * dv)) <= lm->band);
+        }
+      }
+      if (!smooth) {
+        out->kind = LIGHT_CELL_EXACT;
+      }
+    }
+  }
+  free(raw);
+}
+
+/* 速い版の答えを厳密版と比べる。点は格子の範囲から一様に選び、深さは
+   交点が集まる影の境界の近く (そのセルの影になり始める深さの ±1 の範囲)
+   から選ぶ。境界の無いセルでは深さの範囲全体から選ぶ。
+   答えを決めた点の数を *n_answered に、そのうち誤った数を *n_wrong に入れる */
+void measure_light_map(render_ctx_t *ctx, light_map_t *lm, int *n_answered, int *n_wrong) {
+  unsigned seed = 12345;
   int i;
+  *n_answered = *n_wrong = 0;
+  for (i = 0; i < LIGHT_MAP_SAMPLES; ++i) {
+    double f[3], pw;
+    int k, lit;
+    bool shadow_p;
+    light_cell_t *c;
+    for (k = 0; k < 3; ++k) {
+      seed = seed * 1103515245u + 12345u;
+      f[k] = (double) (seed >> 8 & 0xffffff) / 16777216.0;
+    }
+    c = &lm->cells[(int) (f[1] * lm->nv) * lm->nu + (int) (f[0] * lm->nu)];
+    if (c->kind == LIGHT_CELL_PLANE) {
+      pw = c->depth + 2.0 * f[2] - 1.0;
+    } else {
+      pw = lm->w_lo + f[2] * (lm->w_hi - lm->w_lo);
+    }
+    lm->fast = false;
+    shadow_p = light_map_shadow_at(ctx, lm->u0 + f[0] * lm->nu * lm->cell,
+                                   lm->v0 + f[1] * lm->nv * lm->cell, pw);
+    lm->fast = true;
+    lit = light_map_fast(lm, &ctx->intersection_point);
+    if (lit != LIGHT_UNKNOWN) {
+      ++*n_answered;
+      *n_wrong += (lit == LIGHT_SHADOW) != shadow_p;
+    }
+  }
+}
 
-  for(i = 0; i < 50; ++i) {
-    and_net[i] = malloc(sizeof(int));
-    and_net[i][0] = -1;
+/* read_parameter と光源の方向ベクトルの前処理の後に呼び、影の格子を作る。
+   fast が真なら速い版にする。bench が真なら大きさと作る時間、速い版の
+   誤りの割合を標準エラーに出力する */
+void build_light_map(scene_t *sc, bool fast, bool bench) {
+  light_map_t *lm = calloc(1, sizeof(light_map_t));
+  double t0 = get_time();
+  double ll = veciprod(&sc->light, &sc->light);
+  double u1 = -HUGE_VAL, v1 = -HUGE_VAL;
+  double *rect, *whi;
+  int *cnt;
+  int n, i, iu, iv, n_cells, n_bounded = 0, max_cover;
+
+  /* 光の方向と、それに垂直な2軸 */
+  lm->w = sc->light;
+  vecscale(&lm->w, 1.0 / ll);
+  if (fabs(sc->light.x) < fabs(sc->light.y) && fabs(sc->light.x) < fabs(sc->light.z)) {
+    vecset(&lm->u, 0.0, -sc->light.z, sc->light.y);
+  } else if (fabs(sc->light.y) < fabs(sc->light.z)) {
+    vecset(&lm->u, sc->light.z, 0.0, -sc->light.x);
+  } else {
+    vecset(&lm->u, -sc->light.y, sc->light.x, 0.0);
+  }
+  vecunit_sgn(&lm->u, 0);
+  vecset(&lm->v, sc->light.y * lm->u.z - sc->light.z * lm->u.y,
+                 sc->light.z * lm->u.x - sc->light.x * lm->u.z,
+                 sc->light.x * lm->u.y - sc->light.y * lm->u.x);
+  vecunit_sgn(&lm->v, 0);
+
+  /* 要素を平面に写し、有界なものが収まる範囲を格子にする */
+  lm->items = collect_group_bounds(sc, &n);
+  lm->wmin = calloc(n + 1, sizeof(double));
+  whi = calloc(n + 1, sizeof(double));
+  rect = calloc(4 * n + 1, sizeof(double));
+  lm->u0 = lm->v0 = lm->w_lo = HUGE_VAL;
+  lm->w_hi = -HUGE_VAL;
+  for (i = 0; i < n; ++i) {
+    bvh_item_t *it = &lm->items[i];
+    light_map_project(lm, it, &rect[4 * i], &lm->wmin[i], &whi[i]);
+    if (bound_is_finite(&it->lo, &it->hi)) {
+      lm->u0 = rect[4 * i]     < lm->u0 ? rect[4 * i]     : lm->u0;
+      u1     = rect[4 * i + 1] > u1     ? rect[4 * i + 1] : u1;
+      lm->v0 = rect[4 * i + 2] < lm->v0 ? rect[4 * i + 2] : lm->v0;
+      v1     = rect[4 * i + 3] > v1     ? rect[4 * i + 3] : v1;
+      lm->w_lo = lm->wmin[i] < lm->w_lo ? lm->wmin[i] : lm->w_lo;
+      lm->w_hi = whi[i]      > lm->w_hi ? whi[i]      : lm->w_hi;
+      ++n_bounded;
+    }
+  }
+  if (u1 < lm->u0) {
+    /* 有界な要素が無い : 格子は空で、すべて wide で調べる */
+    lm->u0 = lm->v0 = 0.0;
+    lm->cell = 1.0;
+    lm->nu = lm->nv = 0;
+  } else {
+    double span = u1 - lm->u0 > v1 - lm->v0 ? u1 - lm->u0 : v1 - lm->v0;
+    lm->cell = span > 0.0 ? span / LIGHT_MAP_RES : 1.0;
+    lm->nu = (int) ceil((u1 - lm->u0) / lm->cell);
+    lm->nv = (int) ceil((v1 - lm->v0) / lm->cell);
+    lm->nu = lm->nu < 1 ? 1 : lm->nu > LIGHT_MAP_RES ? LIGHT_MAP_RES : lm->nu;
+    lm->nv = lm->nv < 1 ? 1 : lm->nv > LIGHT_MAP_RES ? LIGHT_MAP_RES : lm->nv;
+  }
+  n_cells = lm->nu * lm->nv;
+  max_cover = n_bounded > 0 ? LIGHT_MAP_FILL * n_cells / n_bounded : 0;
+  max_cover = max_cover > LIGHT_MAP_WIDE ? max_cover : LIGHT_MAP_WIDE;
+
+  /* セルごとの要素数を数えてから、OR 行列の順に詰める */
+  lm->wide = calloc(n + 1, sizeof(int));
+  lm->cell_start = calloc(n_cells + 2, sizeof(int));
+  cnt = calloc(n_cells + 1, sizeof(int));
+  for (i = 0; i < n; ++i) {
+    int c[4];
+    light_map_cells(lm, &rect[4 * i], c);
+    if (!bound_is_finite(&lm->items[i].lo, &lm->items[i].hi) ||
+        (c[1] - c[0] + 1) * (c[3] - c[2] + 1) > max_cover) {
+      lm->wide[lm->n_wide++] = i;
+      continue;
+    }
+    for (iv = c[2]; iv <= c[3]; ++iv) {
+      for (iu = c[0]; iu <= c[1]; ++iu) {
+        ++lm->cell_start[iv * lm->nu + iu + 1];
+      }
+    }
+  }
+  for (i = 0; i < n_cells; ++i) {
+    lm->cell_start[i + 1] += lm->cell_start[i];
+  }
+  lm->cell_items = calloc(lm->cell_start[n_cells] + 1, sizeof(int));
+  for (i = 0; i < n; ++i) {
+    int c[4];
+    light_map_cells(lm, &rect[4 * i], c);
+    if (!bound_is_finite(&lm->items[i].lo, &lm->items[i].hi) ||
+        (c[1] - c[0] + 1) * (c[3] - c[2] + 1) > max_cover) {
+      continue;
+    }
+    for (iv = c[2]; iv <= c[3]; ++iv) {
+      for (iu = c[0]; iu <= c[1]; ++iu) {
+        int k = iv * lm->nu + iu;
+        lm->cell_items[lm->cell_start[k] + cnt[k]++] = i;
+      }
+    }
+  }
+  free(cnt);
+  free(rect);
+  free(whi);
+  sc->light_map = lm;
+
+  /* 速い版 : 厳密版の格子を使って各セルの影になり始める深さを求める */
+  if (fast && n_cells > 0) {
+    render_ctx_t ctx;
+    int n_answered = 0, n_wrong = 0;
+    lm->w_lo -= 1.0;
+    lm->w_hi += 1.0;
+    lm->band = 0.1;
+    init_render_ctx(&ctx, sc);
+    build_light_cells(&ctx, lm);
+    lm->fast = true;
+    if (bench) {
+      measure_light_map(&ctx, lm, &n_answered, &n_wrong);
+      fprintf(stderr, "light map: %d of %d samples answered by cells, %d wrong (%.3f%%)\n",
+              n_answered, LIGHT_MAP_SAMPLES, n_wrong,
+              n_answered > 0 ? 100.0 * n_wrong / n_answered : 0.0);
+    }
+    free_render_ctx(&ctx);
+  }
+  if (bench) {
+    fprintf(stderr, "light map: %d x %d cells, %d items (%d wide), %d cell entries, %.3f s\n",
+            lm->nu, lm->nv, n, lm->n_wide, lm->cell_start[n_cells], get_time() - t0);
+  }
+}
+
+/******************************************************************************
+   複数スレッドによる並列レンダリング
+*****************************************************************************/
+
+/* 各ラインの前処理(pretrace_line)をスレッド間で分担し、前後のラインの前処理
+   が揃ったラインから順にピクセル値を計算する。ピクセル値の計算が終わった
+   ラインは、上から順に並べ直してから PPM に出力する。
+
+   逐次版の scan_lines は3本のラインを使い回すので、y 行目の前処理は y-3 行目の
+   結果が残ったバッファの上で行われる。trace_ray は反射の途中で打ち切ると
+   それより深い衝突点の情報を書き換えないため、間接光の計算はこの残った情報
+   も参照する。並列版でも出力を一致させるため、前処理を次の3段階に分ける。
+     1. 直接光追跡          : 各ラインで独立に行える
+     2. 残った情報の引き継ぎ : y-3 行目の引き継ぎが済んでから行う (軽い)
+     3. 間接光20%の追跡      : 各ラインで独立に行える */
+
+/* ラインの状態 */
+#define ROW_EMPTY      0 /* 未着手 */
+#define ROW_TRACING    1 /* 直接光追跡中 */
+#define ROW_TRACED     2 /* 直接光追跡済 */
+#define ROW_MERGING    3 /* y-3 行目の情報を引き継ぎ中 */
+#define ROW_DIFFUSING  4 /* 引き継ぎ済、間接光を追跡中 */
+#define ROW_PRETRACED  5 /* 前処理済 */
+#define ROW_SCANNING   6 /* ピクセル値を計算中 */
+#define ROW_SCANNED    7 /* ピクセル値を計算済 (未出力) */
+#define ROW_WRITTEN    8 /* 出力済 */
+
+/* 直接光追跡で書き込まれなかった衝突面番号 */
+#define SID_UNSET (-2)
+
+typedef struct {
+  scene_t  *sc;
+  ppm_writer_t *out;
+  /* y 行目の情報は lines[y % n_slots], rgbs[y % n_slots] に置く */
+  int       n_slots;
+  pixel_t **lines;
+  vec_t   **rgbs;
+  /* 逐次版で y 行目が使うバッファの中身を再現したもの (y % 3 で引く) */
+  pixel_t  *history[3];
+  /* 各ラインの状態 */
+  int      *state;
+  /* 次に直接光追跡するライン */
+  int       next_pretrace;
+  /* 次に出力するライン */
+  int       next_write;
+  /* あるスレッドが出力中か */
+  bool      writing;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} row_queue_t;
+
+/* スレッドごとの計測値 */
+typedef struct {
+  double busy;     /* タスクの実行に費やした時間 (秒) */
+  int    n_tasks;
+  int    n_stolen; /* 他のスレッドから盗んだタスク数 */
+} worker_stat_t;
+
+typedef struct {
+  row_queue_t  *q;
+  render_ctx_t  ctx;
+  pthread_t     thread;
+  worker_stat_t stat;
+} row_worker_t;
+
+void report_worker_stat(int id, worker_stat_t *st, double wall) {
+  fprintf(stderr, "thread %d: busy %.3f s (%.1f%%), %d tasks, %d stolen\n",
+          id, st->busy, wall > 0.0 ? 100.0 * st->busy / wall : 0.0,
+          st->n_tasks, st->n_stolen);
+}
+
+/* 1. y 行目の x_begin 〜 x_end 番目のピクセルの直接光追跡のみを行う。
+   x 番目のピクセルは line[x - ofs] に置く */
+void pretrace_span_direct(render_ctx_t *ctx, pixel_t *line, int ofs, int y, int x_begin, int x_end) {
+  scene_t *sc = ctx->sc;
+  double ydisp = sc->scan_pitch * float_of_int(y - sc->image_center[1]);
+  double lc0 = ydisp * sc->screeny_dir.x + sc->screenz_dir.x;
+  double lc1 = ydisp * sc->screeny_dir.y + sc->screenz_dir.y;
+  double lc2 = ydisp * sc->screeny_dir.z + sc->screenz_dir.z;
+  /* グループIDは1ラインごとに2ずつ、右端から1ピクセルごとに1ずつずらす */
+  int group_id = (2 * y + sc->image_size[0] - 1 - x_end) % 5;
+  int x;
+  for (x = x_end; x >= x_begin; --x) {
+    pixel_t *pixel = &line[x - ofs];
+    int i;
+    for (i = 0; i < p_depth(pixel); ++i) {
+      p_surface_id(pixel, i) = SID_UNSET;
+    }
+    pretrace_pixel(ctx, pixel, x, group_id, lc0, lc1, lc2);
+    group_id = (group_id + 1) % 5;
+  }
+}
+
+/* 直接光追跡だけを行ったピクセル p のうち書き込まれなかった要素を、
+   3行上の同じ位置のピクセル h (引き継ぎ済) の値で埋める */
+void inherit_pixel(pixel_t *p, pixel_t *h) {
+  int i;
+  for (i = 0; i < p_depth(p); ++i) {
+    /* trace_ray は衝突面番号を書いたときだけ、衝突した場合のみ交点と
+       フラグを、間接光を計算する場合のみエネルギーと法線を書き込む */
+    bool sid_new  = p_surface_id(p, i) != SID_UNSET;
+    bool hit_new  = sid_new && p_surface_id(p, i) >= 0;
+    bool cdif_new = hit_new && p_calc_diffuse(p, i);
+    if (!sid_new) {
+      p_surface_id(p, i) = p_surface_id(h, i);
+    }
+    if (!hit_new) {
+      p_intersection_point(p, i) = p_intersection_point(h, i);
+      p_calc_diffuse(p, i)       = p_calc_diffuse(h, i);
+    }
+    if (!cdif_new) {
+      p_energy(p, i)  = p_energy(h, i);
+      p_nvector(p, i) = p_nvector(h, i);
+    }
+  }
+}
+
+/* 2. 直接光追跡で書き込まれなかった要素を、逐次版と同じく前の結果で埋める */
+/* hist は y-3 行目の引き継ぎ済の結果で、y 行目のものに置き換える */
+void inherit_line(scene_t *sc, pixel_t *line, pixel_t *hist) {
+  int x;
+  for (x = 0; x < sc->image_size[0]; ++x) {
+    inherit_pixel(&line[x], &hist[x]);
+    copy_pixel(&hist[x], &line[x]);
+  }
+}
+
+/* 3. ラインの各ピクセルについて間接光の20%を追跡する */
+void pretrace_line_diffuse(render_ctx_t *ctx, pixel_t *line) {
+  int x;
+  for (x = ctx->sc->image_size[0] - 1; x >= 0; --x) {
+    pretrace_diffuse_rays(ctx, &line[x], 0);
+  }
+}
+
+/* 前後のラインの前処理が済み、ピクセル値を計算できるラインを探す */
+int find_scannable_row(row_queue_t *q) {
+  int height = q->sc->image_size[1];
+  int y;
+  for (y = q->next_write; y < q->next_pretrace; ++y) {
+    if (q->state[y] == ROW_PRETRACED
+        && (y == 0 || q->state[y-1] >= ROW_PRETRACED)
+        && (y + 1 == height || q->state[y+1] >= ROW_PRETRACED)) {
+      return y;
+    }
+  }
+  return -1;
+}
+
+/* 直接光追跡が済み、y-3 行目の引き継ぎも済んだラインを探す */
+int find_mergeable_row(row_queue_t *q) {
+  int y;
+  for (y = q->next_write; y < q->next_pretrace; ++y) {
+    if (q->state[y] == ROW_TRACED
+        && (y < 3 || q->state[y-3] >= ROW_DIFFUSING)) {
+      return y;
+    }
+  }
+  return -1;
+}
+
+/* 直接光追跡を始めてよいラインがあるか */
+/* 使い回すバッファの前の持ち主 (next_pretrace - n_slots 行目) を参照する
+   ラインがすべて出力済であることを確認する */
+bool can_pretrace(row_queue_t *q) {
+  return q->next_pretrace < q->sc->image_size[1]
+    && q->next_pretrace - q->n_slots + 1 < q->next_write;
+}
+
+/* 計算済のラインを上から順に出力する。lock を取った状態で呼ぶ */
+void flush_rows(row_queue_t *q) {
+  int height = q->sc->image_size[1];
+  while (!q->writing && q->next_write < height
+         && q->state[q->next_write] == ROW_SCANNED) {
+    int y = q->next_write;
+    vec_t *rgbs = q->rgbs[y % q->n_slots];
+    q->writing = true;
+    pthread_mutex_unlock(&q->lock);
+    write_rgb_row(q->out, rgbs);
+    pthread_mutex_lock(&q->lock);
+    q->state[y] = ROW_WRITTEN;
+    q->next_write = y + 1;
+    q->writing = false;
+  }
+}
+
+void *row_worker_main(void *arg) {
+  row_worker_t *w = arg;
+  row_queue_t  *q = w->q;
+  int width  = q->sc->image_size[0];
+  int height = q->sc->image_size[1];
+
+  pthread_mutex_lock(&q->lock);
+  while (q->next_write < height) {
+    double t0 = get_time();
+    int y;
+    if ((y = find_scannable_row(q)) >= 0) {
+      /* ピクセル値を計算 */
+      pixel_t *prev = q->lines[(y + q->n_slots - 1) % q->n_slots];
+      pixel_t *cur  = q->lines[y % q->n_slots];
+      pixel_t *next = q->lines[(y + 1) % q->n_slots];
+      vec_t   *rgbs = q->rgbs[y % q->n_slots];
+      int x;
+      q->state[y] = ROW_SCANNING;
+      pthread_mutex_unlock(&q->lock);
+      for (x = 0; x < width; ++x) {
+        scan_pixel(&w->ctx, x, y, x, prev, cur, next);
+        rgbs[x] = w->ctx.rgb;
+      }
+      pthread_mutex_lock(&q->lock);
+      q->state[y] = ROW_SCANNED;
+      flush_rows(q);
+      pthread_cond_broadcast(&q->cond);
+    } else if ((y = find_mergeable_row(q)) >= 0) {
+      /* 前の結果を引き継いでから間接光を追跡 */
+      pixel_t *line = q->lines[y % q->n_slots];
+      q->state[y] = ROW_MERGING;
+      pthread_mutex_unlock(&q->lock);
+      inherit_line(q->sc, line, q->history[y % 3]);
+      pthread_mutex_lock(&q->lock);
+      q->state[y] = ROW_DIFFUSING;
+      pthread_cond_broadcast(&q->cond);
+      pthread_mutex_unlock(&q->lock);
+      pretrace_line_diffuse(&w->ctx, line);
+      pthread_mutex_lock(&q->lock);
+      q->state[y] = ROW_PRETRACED;
+      pthread_cond_broadcast(&q->cond);
+    } else if (can_pretrace(q)) {
+      /* 次のラインを直接光追跡 */
+      y = q->next_pretrace++;
+      q->state[y] = ROW_TRACING;
+      pthread_mutex_unlock(&q->lock);
+      pretrace_span_direct(&w->ctx, q->lines[y % q->n_slots], 0, y, 0, width - 1);
+      pthread_mutex_lock(&q->lock);
+      q->state[y] = ROW_TRACED;
+      pthread_cond_broadcast(&q->cond);
+    } else {
+      pthread_cond_wait(&q->cond, &q->lock);
+      continue;
+    }
+    w->stat.busy += get_time() - t0;
+    ++w->stat.n_tasks;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return NULL;
+}
+
+/* scan_lines の並列版。n_threads 個のスレッドで全ラインを計算し出力する */
+/* bench が真ならスレッドごとの稼働時間を標準エラーに出力する。
+   全スレッドの計測値を count に足し込む */
+void scan_lines_parallel(scene_t *sc, ppm_writer_t *out, int n_threads, bool bench, ray_count_t *count) {
+  row_queue_t q;
+  row_worker_t *workers = calloc(n_threads, sizeof(row_worker_t));
+  int i;
+  double t0 = get_time();
+
+  q.sc = sc;
+  q.out = out;
+  q.n_slots = 2 * n_threads + 3;
+  q.lines = calloc(q.n_slots, sizeof(pixel_t *));
+  q.rgbs  = calloc(q.n_slots, sizeof(vec_t *));
+  for (i = 0; i < q.n_slots; ++i) {
+    q.lines[i] = create_pixelline(sc);
+    q.rgbs[i]  = calloc(sc->image_size[0], sizeof(vec_t));
+  }
+  for (i = 0; i < 3; ++i) {
+    q.history[i] = create_pixelline(sc);
+  }
+  q.state = calloc(sc->image_size[1], sizeof(int));
+  q.next_pretrace = 0;
+  q.next_write = 0;
+  q.writing = false;
+  pthread_mutex_init(&q.lock, NULL);
+  pthread_cond_init(&q.cond, NULL);
+
+  for (i = 0; i < n_threads; ++i) {
+    workers[i].q = &q;
+    init_render_ctx(&workers[i].ctx, sc);
+    if (pthread_create(&workers[i].thread, NULL, row_worker_main, &workers[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  for (i = 0; i < n_threads; ++i) {
+    pthread_join(workers[i].thread, NULL);
+    add_ray_count(count, &workers[i].ctx.count);
+    free_render_ctx(&workers[i].ctx);
+  }
+  if (bench) {
+    double wall = get_time() - t0;
+    for (i = 0; i < n_threads; ++i) {
+      report_worker_stat(i, &workers[i].stat, wall);
+    }
+  }
+
+  pthread_cond_destroy(&q.cond);
+  pthread_mutex_destroy(&q.lock);
+  for (i = 0; i < q.n_slots; ++i) {
+    free_pixelline(sc, q.lines[i]);
+    free(q.rgbs[i]);
+  }
+  for (i = 0; i < 3; ++i) {
+    free_pixelline(sc, q.history[i]);
+  }
+  free(q.lines);
+  free(q.rgbs);
+  free(q.state);
+  free(workers);
+}
+
+/******************************************************************************
+   タイル分割とワークスティーリングによる並列レンダリング
+*****************************************************************************/
+
+/* 画像を tile_size 四方のタイルに分割し、タイルごとに
+     TRACE  : 周囲1ピクセルの余白を含めた範囲の直接光追跡
+     FINISH : 3行上の情報の引き継ぎ、間接光20%の追跡、ピクセル値の計算
+   の2つのタスクを行う。余白の間接光も自前で追跡するので、上下左右4点を使う
+   calc_diffuse_using_5points のために隣のタイルを待つ必要はない。
+   ただし引き継ぎは上から順に行う必要があるので、FINISH は左上・上・右上の
+   タイルの引き継ぎが済むまで待つ。
+
+   タスクはスレッドごとの両端キューに積む。自分のキューは後ろから取り出し、
+   空になったら他のスレッドのキューの先頭から盗む。タスク1つは十分重いので、
+   キューとタイルの状態はまとめて1つの lock で保護する */
+
+/* タイルの状態 */
+#define TILE_WAITING    0 /* 未投入 */
+#define TILE_QUEUED     1 /* TRACE 待ち */
+#define TILE_TRACING    2
+#define TILE_TRACED     3
+#define TILE_READY      4 /* FINISH 待ち */
+#define TILE_MERGING    5
+#define TILE_MERGED     6 /* 引き継ぎ済、間接光とピクセル値を計算中 */
+#define TILE_DONE       7
+
+/* タスク番号 = タイル番号 * 2 + 種類 */
+#define TASK_TRACE  0
+#define TASK_FINISH 1
+
+typedef struct {
+  int x0, y0, x1, y1;   /* 担当範囲 [x0, x1) x [y0, y1) */
+  int state;
+  /* 余白を含めたピクセル。画像上の (x, y) は lines[y - y0 + 1][x - x0 + 1] */
+  pixel_t **lines;
+} tile_t;
+
+typedef struct {
+  int *tasks;           /* tasks[top % cap] 〜 tasks[(bottom - 1) % cap] */
+  int  cap, top, bottom;
+} task_deque_t;
+
+typedef struct {
+  scene_t *sc;
+  ppm_writer_t *out;
+  int n_threads;
+  int tile_size;
+  int tiles_x, tiles_y;
+  tile_t *tiles;
+  task_deque_t *deques;
+  /* 同時に処理するタイルの行数 */
+  int window;
+  /* タイル行 ty の処理後、剰余 r の最新の行の引き継ぎ済の情報は
+     bounds[ty % (window + 1)][r * 画像幅 + x] に置く。ty = -1 は root_bound */
+  pixel_t **bounds;
+  pixel_t  *root_bound;
+  /* タイル行 ty のピクセル値は bands[ty % window] に置く */
+  vec_t **bands;
+  /* タイル行ごとの完了したタイル数 */
+  int *n_done;
+  /* 次に投入するタイル行と、次に出力するタイル行 */
+  int next_release;
+  int next_write;
+  bool writing;
+  /* 使い回すタイル用バッファ */
+  pixel_t ***pool;
+  int n_pool;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} tile_sched_t;
+
+typedef struct {
+  tile_sched_t *s;
+  int           id;
+  render_ctx_t  ctx;
+  pthread_t     thread;
+  worker_stat_t stat;
+} tile_worker_t;
+
+tile_t *get_tile(tile_sched_t *s, int tx, int ty) {
+  return &s->tiles[ty * s->tiles_x + tx];
+}
+
+pixel_t *tile_pixel(tile_t *t, int x, int y) {
+  return &t->lines[y - t->y0 + 1][x - t->x0 + 1];
+}
+
+/* タイル行 ty の処理後の、剰余 r の最新の行の情報 */
+pixel_t *bound_row(tile_sched_t *s, int ty, int r) {
+  pixel_t *b = ty < 0 ? s->root_bound : s->bounds[ty % (s->window + 1)];
+  return &b[r * s->sc->image_size[0]];
+}
+
+void push_task(tile_sched_t *s, int w, int task) {
+  task_deque_t *d = &s->deques[w];
+  d->tasks[d->bottom++ % d->cap] = task;
+  pthread_cond_broadcast(&s->cond);
+}
+
+/* 自分のキューの後ろから取り出す。空なら他のキューの先頭から盗む */
+int pop_task(tile_sched_t *s, int w, bool *stolen) {
+  task_deque_t *d = &s->deques[w];
+  int i;
+  if (d->bottom > d->top) {
+    *stolen = false;
+    return d->tasks[--d->bottom % d->cap];
+  }
+  for (i = 1; i < s->n_threads; ++i) {
+    task_deque_t *v = &s->deques[(w + i) % s->n_threads];
+    if (v->bottom > v->top) {
+      *stolen = true;
+      return v->tasks[v->top++ % v->cap];
+    }
+  }
+  return -1;
+}
+
+/* タイル行 ty の TRACE タスクを各スレッドに均等に配る */
+void release_tile_row(tile_sched_t *s, int ty) {
+  int tx;
+  for (tx = 0; tx < s->tiles_x; ++tx) {
+    get_tile(s, tx, ty)->state = TILE_QUEUED;
+    push_task(s, tx * s->n_threads / s->tiles_x,
+              (ty * s->tiles_x + tx) * 2 + TASK_TRACE);
+  }
+}
+
+/* 直接光追跡が済み、上の3タイルの引き継ぎも済んでいれば FINISH を積む */
+void try_ready_tile(tile_sched_t *s, int w, int tx, int ty) {
+  int dx;
+  if (tx < 0 || s->tiles_x <= tx || ty >= s->tiles_y) {
+    return;
+  }
+  if (get_tile(s, tx, ty)->state != TILE_TRACED) {
+    return;
+  }
+  for (dx = -1; dx <= 1; ++dx) {
+    if (ty > 0 && 0 <= tx + dx && tx + dx < s->tiles_x
+        && get_tile(s, tx + dx, ty - 1)->state < TILE_MERGED) {
+      return;
+    }
+  }
+  get_tile(s, tx, ty)->state = TILE_READY;
+  push_task(s, w, (ty * s->tiles_x + tx) * 2 + TASK_FINISH);
+}
+
+/* 完了したタイル行を上から順に出力する。lock を取った状態で呼ぶ */
+void flush_tile_rows(tile_sched_t *s) {
+  int width = s->sc->image_size[0];
+  while (!s->writing && s->next_write < s->tiles_y
+         && s->n_done[s->next_write] == s->tiles_x) {
+    int ty = s->next_write;
+    tile_t *t = get_tile(s, 0, ty);
+    vec_t *band = s->bands[ty % s->window];
+    int y;
+    s->writing = true;
+    pthread_mutex_unlock(&s->lock);
+    for (y = t->y0; y < t->y1; ++y) {
+      write_rgb_row(s->out, &band[(y - t->y0) * width]);
+    }
+    pthread_mutex_lock(&s->lock);
+    s->next_write = ty + 1;
+    s->writing = false;
+    if (s->next_release < s->tiles_y) {
+      release_tile_row(s, s->next_release++);
+    }
+  }
+}
+
+/* TRACE : 余白を含めた範囲の直接光追跡。上の余白は引き継ぎ済の情報を使う */
+void trace_tile(render_ctx_t *ctx, tile_t *t) {
+  scene_t *sc = ctx->sc;
+  int cx0 = t->x0 > 0 ? t->x0 - 1 : 0;
+  int cx1 = t->x1 < sc->image_size[0] ? t->x1 : t->x1 - 1;
+  int cy1 = t->y1 < sc->image_size[1] ? t->y1 : t->y1 - 1;
+  int y;
+  for (y = t->y0; y <= cy1; ++y) {
+    pretrace_span_direct(ctx, t->lines[y - t->y0 + 1], t->x0 - 1, y, cx0, cx1);
+  }
+}
+
+/* FINISH の前半 : 3行上の情報を引き継ぎ、次のタイル行のための情報を残す */
+void merge_tile(tile_sched_t *s, tile_t *t, int ty) {
+  scene_t *sc = s->sc;
+  int cx0 = t->x0 > 0 ? t->x0 - 1 : 0;
+  int cx1 = t->x1 < sc->image_size[0] ? t->x1 : t->x1 - 1;
+  int cy1 = t->y1 < sc->image_size[1] ? t->y1 : t->y1 - 1;
+  int x, y, r;
+
+  /* 上の余白は上のタイル行で引き継ぎ済 */
+  if (t->y0 > 0) {
+    pixel_t *b = bound_row(s, ty - 1, (t->y0 - 1) % 3);
+    for (x = cx0; x <= cx1; ++x) {
+      copy_pixel(tile_pixel(t, x, t->y0 - 1), &b[x]);
+    }
+  }
+
+  for (y = t->y0; y <= cy1; ++y) {
+    pixel_t *b = bound_row(s, ty - 1, y % 3);
+    for (x = cx0; x <= cx1; ++x) {
+      pixel_t *h = y - 3 >= t->y0 ? tile_pixel(t, x, y - 3) : &b[x];
+      inherit_pixel(tile_pixel(t, x, y), h);
+    }
+  }
+
+  /* 剰余ごとに、このタイル行で最後の行の情報を残す */
+  for (r = 0; r < 3; ++r) {
+    pixel_t *b  = bound_row(s, ty, r);
+    pixel_t *pb = bound_row(s, ty - 1, r);
+    y = t->y1 - 1 - (t->y1 - 1 - r + 3) % 3;
+    for (x = t->x0; x < t->x1; ++x) {
+      copy_pixel(&b[x], y >= t->y0 ? tile_pixel(t, x, y) : &pb[x]);
+    }
+  }
+}
+
+/* FINISH の後半 : 間接光20%を追跡してからピクセル値を計算 */
+void shade_tile(render_ctx_t *ctx, tile_t *t, vec_t *band) {
+  scene_t *sc = ctx->sc;
+  int width = sc->image_size[0];
+  int cx0 = t->x0 > 0 ? t->x0 - 1 : 0;
+  int cx1 = t->x1 < width ? t->x1 : t->x1 - 1;
+  int cy0 = t->y0 > 0 ? t->y0 - 1 : 0;
+  int cy1 = t->y1 < sc->image_size[1] ? t->y1 : t->y1 - 1;
+  int x, y;
+
+  for (y = cy0; y <= cy1; ++y) {
+    bool y_margin = y < t->y0 || t->y1 <= y;
+    for (x = cx0; x <= cx1; ++x) {
+      /* 余白の四隅は上下左右4点に含まれない */
+      if (!(y_margin && (x < t->x0 || t->x1 <= x))) {
+        pretrace_diffuse_rays(ctx, tile_pixel(t, x, y), 0);
+      }
+    }
+  }
+
+  for (y = t->y0; y < t->y1; ++y) {
+    pixel_t *prev = t->lines[y - t->y0];
+    pixel_t *cur  = t->lines[y - t->y0 + 1];
+    pixel_t *next = t->lines[y - t->y0 + 2];
+    for (x = t->x0; x < t->x1; ++x) {
+      scan_pixel(ctx, x, y, x - t->x0 + 1, prev, cur, next);
+      band[(y - t->y0) * width + x] = ctx->rgb;
+    }
+  }
+}
+
+void *tile_worker_main(void *arg) {
+  tile_worker_t *w = arg;
+  tile_sched_t  *s = w->s;
+  int n = s->tile_size + 2;
+
+  pthread_mutex_lock(&s->lock);
+  while (s->next_write < s->tiles_y) {
+    bool stolen;
+    int task = pop_task(s, w->id, &stolen);
+    tile_t *t;
+    int tx, ty;
+    double t0;
+    if (task < 0) {
+      pthread_cond_wait(&s->cond, &s->lock);
+      continue;
+    }
+    t  = &s->tiles[task / 2];
+    tx = task / 2 % s->tiles_x;
+    ty = task / 2 / s->tiles_x;
+    t0 = get_time();
+    if (task % 2 == TASK_TRACE) {
+      int i;
+      if (s->n_pool > 0) {
+        t->lines = s->pool[--s->n_pool];
+      } else {
+        t->lines = calloc(n, sizeof(pixel_t *));
+        for (i = 0; i < n; ++i) {
+          t->lines[i] = create_pixels(s->sc, n);
+        }
+      }
+      t->state = TILE_TRACING;
+      pthread_mutex_unlock(&s->lock);
+      trace_tile(&w->ctx, t);
+      pthread_mutex_lock(&s->lock);
+      t->state = TILE_TRACED;
+      try_ready_tile(s, w->id, tx, ty);
+    } else {
+      t->state = TILE_MERGING;
+      pthread_mutex_unlock(&s->lock);
+      merge_tile(s, t, ty);
+      pthread_mutex_lock(&s->lock);
+      t->state = TILE_MERGED;
+      try_ready_tile(s, w->id, tx - 1, ty + 1);
+      try_ready_tile(s, w->id, tx,     ty + 1);
+      try_ready_tile(s, w->id, tx + 1, ty + 1);
+      pthread_mutex_unlock(&s->lock);
+      shade_tile(&w->ctx, t, s->bands[ty % s->window]);
+      pthread_mutex_lock(&s->lock);
+      t->state = TILE_DONE;
+      s->pool[s->n_pool++] = t->lines;
+      t->lines = NULL;
+      ++s->n_done[ty];
+      flush_tile_rows(s);
+    }
+    w->stat.busy += get_time() - t0;
+    ++w->stat.n_tasks;
+    if (stolen) {
+      ++w->stat.n_stolen;
+    }
+    pthread_cond_broadcast(&s->cond);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+/* scan_lines のタイル並列版。全スレッドの計測値を count に足し込む */
+void scan_tiles_parallel(scene_t *sc, ppm_writer_t *out, int n_threads, int tile_size, bool bench, ray_count_t *count) {
+  tile_sched_t s;
+  tile_worker_t *workers = calloc(n_threads, sizeof(tile_worker_t));
+  int width  = sc->image_size[0];
+  int height = sc->image_size[1];
+  int n = tile_size + 2;
+  int tx, ty, i;
+  double t0 = get_time();
+
+  s.sc = sc;
+  s.out = out;
+  s.n_threads = n_threads;
+  s.tile_size = tile_size;
+  s.tiles_x = (width  + tile_size - 1) / tile_size;
+  s.tiles_y = (height + tile_size - 1) / tile_size;
+  s.tiles = calloc(s.tiles_x * s.tiles_y, sizeof(tile_t));
+  for (ty = 0; ty < s.tiles_y; ++ty) {
+    for (tx = 0; tx < s.tiles_x; ++tx) {
+      tile_t *t = get_tile(&s, tx, ty);
+      t->x0 = tx * tile_size;
+      t->y0 = ty * tile_size;
+      t->x1 = t->x0 + tile_size < width  ? t->x0 + tile_size : width;
+      t->y1 = t->y0 + tile_size < height ? t->y0 + tile_size : height;
+      t->state = TILE_WAITING;
+    }
+  }
+  /* 全スレッドに4タスク程度行き渡るだけのタイル行を同時に処理する */
+  s.window = (4 * n_threads + s.tiles_x - 1) / s.tiles_x + 1;
+  if (s.window > s.tiles_y) {
+    s.window = s.tiles_y;
+  }
+  s.deques = calloc(n_threads, sizeof(task_deque_t));
+  for (i = 0; i < n_threads; ++i) {
+    s.deques[i].cap = 2 * s.tiles_x * s.window;
+    s.deques[i].tasks = calloc(s.deques[i].cap, sizeof(int));
+  }
+  s.bounds = calloc(s.window + 1, sizeof(pixel_t *));
+  for (i = 0; i <= s.window; ++i) {
+    s.bounds[i] = create_pixels(sc, 3 * width);
+  }
+  s.root_bound = create_pixels(sc, 3 * width);
+  s.bands = calloc(s.window, sizeof(vec_t *));
+  for (i = 0; i < s.window; ++i) {
+    s.bands[i] = calloc(width * tile_size, sizeof(vec_t));
+  }
+  s.n_done = calloc(s.tiles_y, sizeof(int));
+  s.pool = calloc(s.tiles_x * s.window, sizeof(pixel_t **));
+  s.n_pool = 0;
+  s.next_write = 0;
+  s.writing = false;
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.cond, NULL);
+
+  for (s.next_release = 0; s.next_release < s.window; ++s.next_release) {
+    release_tile_row(&s, s.next_release);
+  }
+
+  for (i = 0; i < n_threads; ++i) {
+    workers[i].s = &s;
+    workers[i].id = i;
+    init_render_ctx(&workers[i].ctx, sc);
+    if (pthread_create(&workers[i].thread, NULL, tile_worker_main, &workers[i]) != 0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+  for (i = 0; i < n_threads; ++i) {
+    pthread_join(workers[i].thread, NULL);
+    add_ray_count(count, &workers[i].ctx.count);
+    free_render_ctx(&workers[i].ctx);
+  }
+  if (bench) {
+    double wall = get_time() - t0;
+    for (i = 0; i < n_threads; ++i) {
+      report_worker_stat(i, &workers[i].stat, wall);
+    }
+  }
+
+  pthread_cond_destroy(&s.cond);
+  pthread_mutex_destroy(&s.lock);
+  while (s.n_pool > 0) {
+    pixel_t **lines = s.pool[--s.n_pool];
+    for (i = 0; i < n; ++i) {
+      free_pixels(lines[i], n);
+    }
+    free(lines);
+  }
+  for (i = 0; i <= s.window; ++i) {
+    free_pixels(s.bounds[i], 3 * width);
+  }
+  free_pixels(s.root_bound, 3 * width);
+  for (i = 0; i < s.window; ++i) {
+    free(s.bands[i]);
+  }
+  for (i = 0; i < n_threads; ++i) {
+    free(s.deques[i].tasks);
+  }
+  free(s.bounds);
+  free(s.bands);
+  free(s.deques);
+  free(s.n_done);
+  free(s.pool);
+  free(s.tiles);
+  free(workers);
+}
+
+/*****************************************************************************
+   段階的な描画
+*****************************************************************************/
+
+/* 画像全体のピクセルの情報を保持して、次の3段階で描画する。各段階は前の
+   段階で pixel_t に書いた結果 (衝突面番号、交点、法線、エネルギー、間接光
+   20%) を使い、視点からの光線は追跡し直さない。
+     1. 直接光追跡だけの画像
+     2. 間接光を 60本(20%)追跡し、上下左右4点と合わせた(使えない点では
+        自分の結果を5倍した)画像
+     3. 残りの間接光を追跡した最終画像 (逐次版と一致する)
+   1, 2 の画像は prefix-1.ppm, prefix-2.ppm に書き出し、3 は通常の出力先へ
+   書く。逐次版が前のラインの残った情報を参照するのは並列版と同じく
+   inherit_line で再現する */
+
+/* 段階2 の画像のピクセル値を ctx->rgb に求める。scan_pixel と同じく
+   上下左右4点を使えるかを判定し、使えない点では残りの240本を追跡する
+   代わりに自分の60本の結果を5倍する */
+void scan_pixel_preview(render_ctx_t *ctx, int x, int y, pixel_t *prev, pixel_t *cur, pixel_t *next) {
+  pixel_t *pixel = &cur[x];
+  bool five = neighbors_exist(ctx->sc, x, y, next);
+  int nref;
+  ctx->rgb = *p_rgb(pixel);
+  for (nref = 0; nref < p_depth(pixel) && get_surface_id(pixel, nref) >= 0; ++nref) {
+    if (five && !neighbors_are_available(x, prev, cur, next, nref)) {
+      five = false;
+    }
+    if (p_calc_diffuse(pixel, nref)) {
+      if (five) {
+        calc_diffuse_using_5points(ctx, x, prev, cur, next, nref);
+      } else {
+        ctx->diffuse_ray = p_received_ray_20percent(pixel, nref);
+        vecscale(&ctx->diffuse_ray, 5.0);
+        vecaccumv(&ctx->rgb, &p_energy(pixel, nref), &ctx->diffuse_ray);
+      }
+    }
+  }
+}
+
+/* 画像全体のピクセル値 rgbs を PPM として path に書き出す */
+void write_ppm_file(const char *path, scene_t *sc, vec_t *rgbs, bool binary) {
+  FILE *fp = fopen(path, "wb");
+  int i, n = sc->image_size[0] * sc->image_size[1];
+  if (fp == NULL) {
+    perror(path);
+    return;
+  }
+  fprintf(fp, "P%d\n%d %d 255\n", binary ? 6 : 3, sc->image_size[0], sc->image_size[1]);
+  for (i = 0; i < n; ++i) {
+    if (binary) {
+      putc(rgb_element(rgbs[i].x), fp);
+      putc(rgb_element(rgbs[i].y), fp);
+      putc(rgb_element(rgbs[i].z), fp);
+    } else {
+      fprintf(fp, "%d %d %d\n", rgb_element(rgbs[i].x),
+              rgb_element(rgbs[i].y), rgb_element(rgbs[i].z));
+    }
+  }
+  fclose(fp);
+}
+
+/* 画像を段階的に描画する。最終画像は out に書く。bench が真なら各段階の
+   書き出しまでの時間を標準エラーに出力する */
+void render_progressive(render_ctx_t *ctx, ppm_writer_t *out, const char *prefix, bool bench) {
+  scene_t *sc = ctx->sc;
+  int width  = sc->image_size[0];
+  int height = sc->image_size[1];
+  pixel_t *img = create_pixels(sc, width * height);
+  vec_t *rgbs = calloc(width * height, sizeof(vec_t));
+  char *path = malloc(strlen(prefix) + 8);
+  pixel_t *history[3];
+  double t0 = get_time();
+  int x, y, i;
+
+  for (i = 0; i < 3; ++i) {
+    history[i] = create_pixelline(sc);
+  }
+
+  /* 1. 直接光追跡 */
+  for (y = 0; y < height; ++y) {
+    pretrace_span_direct(ctx, &img[y * width], 0, y, 0, width - 1);
+    inherit_line(sc, &img[y * width], history[y % 3]);
+  }
+  for (i = 0; i < width * height; ++i) {
+    rgbs[i] = *p_rgb(&img[i]);
+  }
+  sprintf(path, "%s-1.ppm", prefix);
+  write_ppm_file(path, sc, rgbs, out->binary);
+  if (bench) {
+    fprintf(stderr, "progressive: %s at %.3f s\n", path, get_time() - t0);
+  }
+
+  /* 2. 間接光の 20% */
+  for (y = 0; y < height; ++y) {
+    pretrace_line_diffuse(ctx, &img[y * width]);
+  }
+  for (y = 0; y < height; ++y) {
+    pixel_t *cur = &img[y * width];
+    for (x = 0; x < width; ++x) {
+      scan_pixel_preview(ctx, x, y, y > 0 ? cur - width : cur, cur,
+                         y + 1 < height ? cur + width : cur);
+      rgbs[y * width + x] = ctx->rgb;
+    }
+  }
+  sprintf(path, "%s-2.ppm", prefix);
+  write_ppm_file(path, sc, rgbs, out->binary);
+  if (bench) {
+    fprintf(stderr, "progressive: %s at %.3f s\n", path, get_time() - t0);
+  }
+
+  /* 3. 最終画像 */
+  for (y = 0; y < height; ++y) {
+    pixel_t *cur = &img[y * width];
+    for (x = 0; x < width; ++x) {
+      scan_pixel(ctx, x, y, x, y > 0 ? cur - width : cur, cur,
+                 y + 1 < height ? cur + width : cur);
+      rgbs[x] = ctx->rgb;
+    }
+    write_rgb_row(out, rgbs);
+  }
+  if (bench) {
+    fprintf(stderr, "progressive: final image at %.3f s\n", get_time() - t0);
+  }
+
+  for (i = 0; i < 3; ++i) {
+    free_pixelline(sc, history[i]);
+  }
+  free_pixels(img, width * height);
+  free(rgbs);
+  free(path);
+}
+
+/*****************************************************************************
+   物体を動かしながらの連続描画
+*****************************************************************************/
+
+/* 方向ベクトルの定数テーブルは物体の abc と回転 (と反転) だけで決まり、
+   位置 xyz には依らない。そこで回した物体についてだけ、テーブルを持つ全ての
+   方向ベクトルのその物体の列を計算し直す。平行移動だけならテーブルは
+   そのまま使える。BVH と影の格子は物体の位置に依るので、どれかの物体が
+   動けば作り直し、放射照度キャッシュは空にする */
+
+/* 物体 index の回転角 (度) を設定し直す。回転は読み込み時と同じく、
+   回転前の abc から計算する */
+void set_object_rotation(scene_t *sc, int index, double deg1, double deg2, double deg3) {
+  obj_t *m = &sc->objects[index];
+  vec_t rotation;
+  rotation.x = rad(deg1);
+  rotation.y = rad(deg2);
+  rotation.z = rad(deg3);
+  m->abc = sc->base_abc[index];
+  rotate_quadratic_matrix(&m->abc, &rotation);
+  m->rot123 = rotation;
+  m->isrot = true;
+}
+
+/* テーブルを持つ全ての方向ベクトル (間接光の600本、光源、鏡面反射) に
+   ついて、物体 index の列を計算し直す */
+void update_object_constants(scene_t *sc, int index) {
+  int g, i;
+  for (g = 0; g < 5; ++g) {
+    for (i = 0; i < 120; ++i) {
+      setup_object_constants(sc, &sc->dirvecs[g][i], index);
+    }
+  }
+  setup_object_constants(sc, &sc->light_dirvec, index);
+  for (i = 0; i < sc->n_reflections; ++i) {
+    setup_object_constants(sc, r_dvec(&sc->reflections[i]), index);
+  }
+}
+
+/* 物体 index を回したときに、その物体の鏡面反射の情報を更新する。平面の鏡は
+   反射の向きが変わるので、その方向ベクトルのテーブルを全て作り直す。
+   直方体の鏡の反射の向きは光源だけで決まるので変わらない */
+void update_reflections(scene_t *sc, int index) {
+  obj_t *obj = &sc->objects[index];
+  int i;
+  if (o_form(obj) != 2) {
+    return;
+  }
+  for (i = 0; i < sc->n_reflections; ++i) {
+    refl_t *r = &sc->reflections[i];
+    if (r_surface_id(r) / 4 == index) {
+      double p = veciprod(&sc->light, o_param_abc(obj));
+      vecset(d_vec(r_dvec(r)),
+             2.0 * o_param_a(obj) * p - sc->light.x,
+             2.0 * o_param_b(obj) * p - sc->light.y,
+             2.0 * o_param_c(obj) * p - sc->light.z);
+      setup_dirvec_constants(sc, r_dvec(r));
+    }
+  }
+}
+
+/*****************************************************************************
+   全体の制御
+*****************************************************************************/
+
+/* 各形の物体について、間接光の方向ベクトル600本との交差判定 (solver_fast2)
+   の速さを測り、標準エラーに出力する。始点は視点 */
+void bench_solvers(scene_t *sc) {
+  static const char *names[3] = {"rect", "surface", "second"};
+  render_ctx_t ctx;
+  int shape;
+
+  init_render_ctx(&ctx, sc);
+  setup_startp(&ctx, &sc->viewpoint);
+  for (shape = 1; shape <= 3; ++shape) {
+    int count = 0, reps, rep, index, g, i;
+    double n, t0, t_scalar;
+    for (index = 0; index < sc->n_objects; ++index) {
+      count += (o_form(&sc->objects[index]) < 3 ? o_form(&sc->objects[index]) : 3) == shape;
+    }
+    if (count == 0) {
+      continue;
+    }
+    reps = 1 + 2000000 / (count * 600);
+
+    t0 = get_time();
+    for (rep = 0; rep < reps; ++rep) {
+      for (index = 0; index < sc->n_objects; ++index) {
+        int s = o_form(&sc->objects[index]);
+        if ((s < 3 ? s : 3) != shape) {
+          continue;
+        }
+        for (g = 0; g < 5; ++g) {
+          for (i = 0; i < 120; ++i) {
+            solver_fast2(&ctx, index, &sc->dirvecs[g][i]);
+          }
+        }
+      }
+    }
+    t_scalar = get_time() - t0;
+
+    n = (double) reps * count * 600;
+    fprintf(stderr, "solver %-7s: %d objects, %.2f Mrays/s\n",
+            names[shape - 1], count, n / t_scalar * 1e-6);
+  }
+  free_render_ctx(&ctx);
+}
+
+/* 描画の設定 */
+/* 影の格子の使い方 */
+#define LIGHT_MAP_NONE   0 /* 使わない */
+#define LIGHT_MAP_STRICT 1 /* 厳密版 (出力は変わらない) */
+#define LIGHT_MAP_FAST   2 /* 速い版 */
+
+typedef struct {
+  /* 画像サイズ */
+  int width, height;
+  /* 2以上ならその数のスレッドで並列に追跡する */
+  int n_threads;
+  /* 正ならタイル単位で分担する */
+  int tile_size;
+  /* 正なら交差判定に BVH を使い、0 なら使わず、負ならシーンの大きさで決める */
+  int use_bvh;
+  /* 影の判定に使う影の格子 (LIGHT_MAP_*) */
+  int light_map;
+  /* 視点からの光線の最大追跡回数と、鏡面反射を辿り続ける重みの下限 */
+  int max_depth;
+  double energy_cutoff;
+  /* 正ならエッジのピクセルを aa x aa 本の光線で追跡し直す。その閾値 */
+  int aa;
+  double aa_threshold;
+  /* 正なら、その許容誤差の放射照度キャッシュを使う */
+  double irr_error;
+  /* 放射照度キャッシュを読み込み、描画後に書き出すファイル (NULL なら無し) */
+  const char *irr_file;
+  /* NULL でなければ段階的に描画し、途中の画像をこれで始まるファイルに書く */
+  const char *progressive;
+  /* NULL でなければ、このファイルに並べたカメラごとに描画する */
+  const char *views;
+  /* NULL でなければ、このファイルに従って物体を動かしながら描画する */
+  const char *frames;
+  /* NULL でなければ、ラインごとに枠に入れてここに送る (open_row_sink) */
+  const char *stream;
+  /* PPM の代わりに書く浮動小数点の画像の形式 (HDR_*) */
+  int hdr;
+  /* 真なら描画せず、形ごとに交差判定の速さを測る */
+  bool solver_bench;
+  /* 真なら P6 で出力する */
+  bool binary;
+  /* 真なら描画時間と光線の本数を標準エラーに出力する */
+  bool bench;
+  /* 入力と出力のファイル名 (NULL なら標準入出力) */
+  const char *input;
+  const char *output;
+} rt_opts_t;
+
+/* 今のカメラから見た画像を1枚描画して標準出力に書く。光線の本数などは
+   count に足す。index が正なら -views, -frames の index 番目の画像で、
+   段階的な描画の途中の画像は prefix-index-1.ppm のように書く */
+void render_view(scene_t *sc, rt_opts_t *opt, int index, ppm_writer_t *out, ray_count_t *count) {
+  write_ppm_header(out, sc);
+  if (opt->progressive != NULL) {
+    render_ctx_t ctx;
+    char *prefix = malloc(strlen(opt->progressive) + 16);
+    if (index > 0) {
+      sprintf(prefix, "%s-%d", opt->progressive, index);
+    } else {
+      strcpy(prefix, opt->progressive);
+    }
+    init_render_ctx(&ctx, sc);
+    render_progressive(&ctx, out, prefix, opt->bench);
+    add_ray_count(count, &ctx.count);
+    free_render_ctx(&ctx);
+    free(prefix);
+  } else if (opt->tile_size > 0) {
+    scan_tiles_parallel(sc, out, opt->n_threads, opt->tile_size, opt->bench, count);
+  } else if (opt->n_threads > 1) {
+    scan_lines_parallel(sc, out, opt->n_threads, opt->bench, count);
+  } else {
+    render_ctx_t ctx;
+    pixel_t *prev = create_pixelline(sc);
+    pixel_t *cur  = create_pixelline(sc);
+    pixel_t *next = create_pixelline(sc);
+    init_render_ctx(&ctx, sc);
+    pretrace_line(&ctx, cur, 0, 0);
+    scan_lines(&ctx, out, prev, cur, next, 2);
+    add_ray_count(count, &ctx.count);
+    free_render_ctx(&ctx);
+    free_pixelline(sc, prev);
+    free_pixelline(sc, cur);
+    free_pixelline(sc, next);
+  }
+}
+
+/* opt->views のファイルの各行のカメラで描画する。1行は
+     スクリーンの中心 x y z, 回転角1, 回転角2 (度), 出力ファイル名
+   で、SLD の先頭5つの値と同じ意味を持つ。空行と # で始まる行は読み飛ばす。
+   シーンの読み込みと、方向ベクトルの定数テーブルや BVH などカメラに
+   依存しない前処理は全てのカメラで共有する。-stream のときは画像を全て
+   送り先に送り、出力ファイルは作らない。-progressive の途中の画像は
+   カメラごとに prefix-番号-1.ppm などに書く (番号は1から) */
+void render_views(scene_t *sc, rt_opts_t *opt, ppm_writer_t *out, ray_count_t *count) {
+  FILE *fp = fopen(opt->views, "r");
+  char line[4352], path[4096];
+  int lineno = 0, n = 0;
+  if (fp == NULL) {
+    perror(opt->views);
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    /* SLD と同じく単精度で読むので、シーンと同じカメラなら同じ画像になる */
+    float v[5];
+    char c;
+    double t0;
+    ++lineno;
+    if (sscanf(line, " %c", &c) != 1 || c == '#') {
+      continue;
+    }
+    if (sscanf(line, "%f %f %f %f %f %4095s", &v[0], &v[1], &v[2], &v[3], &v[4], path) != 6) {
+      fprintf(stderr, "%s:%d: expected \"x y z angle1 angle2 output.ppm\"\n", opt->views, lineno);
+      exit(1);
+    }
+    setup_screen(sc, v[0], v[1], v[2], v[3], v[4]);
+    if (out->sink < 0 && freopen(path, "wb", stdout) == NULL) {
+      perror(path);
+      exit(1);
+    }
+    t0 = get_time();
+    render_view(sc, opt, ++n, out, count);
+    fflush(stdout);
+    if (opt->bench) {
+      fprintf(stderr, "view %d (%s): %.3f s\n", n, path, get_time() - t0);
+    }
+  }
+  fclose(fp);
+}
+
+/* 動かした物体に合わせて前処理済みのデータを更新する。rotated[i] は物体 i を
+   回したかどうかで、更新後に下ろす */
+void update_moved_objects(scene_t *sc, rt_opts_t *opt, bool *rotated) {
+  int i;
+  for (i = 0; i < sc->n_objects; ++i) {
+    if (rotated[i]) {
+      update_object_constants(sc, i);
+      update_reflections(sc, i);
+      rotated[i] = false;
+    }
+  }
+  if (sc->bvh != NULL) {
+    free_bvh(sc->bvh);
+    sc->bvh = NULL;
+  }
+  if (opt->use_bvh != 0) {
+    build_bvh(sc, opt->use_bvh > 0);
+  }
+  if (sc->light_map != NULL) {
+    free_light_map(sc->light_map);
+    sc->light_map = NULL;
+    build_light_map(sc, opt->light_map == LIGHT_MAP_FAST, opt->bench);
+  }
+  if (sc->irr_cache != NULL) {
+    double error = sc->irr_cache->error;
+    /* -irrfile には、初めて物体を動かす前までの、読み込んだシーンの記録を書く */
+    if (opt->irr_file != NULL) {
+      save_irr_cache(sc->irr_cache, opt->irr_file);
+    }
+    free_irr_cache(sc->irr_cache);
+    sc->irr_cache = create_irr_cache(error);
+    sc->irr_cache->moved = true;
+  }
+}
+
+/* opt->frames のファイルに従い、物体を動かしながら描画する。各行は
+     pos 物体番号 x y z      物体の位置を設定する
+     rot 物体番号 回転角1 回転角2 回転角3 (度)   物体の回転を設定する
+     frame 出力ファイル名    今の状態の画像を書く
+   で、設定は以後の frame にも残る。値は SLD と同じく単精度で読む。
+   空行と # で始まる行は読み飛ばす。-stream と -progressive の扱いは
+   render_views と同じ */
+void render_frames(scene_t *sc, rt_opts_t *opt, ppm_writer_t *out, ray_count_t *count) {
+  FILE *fp = fopen(opt->frames, "r");
+  bool *rotated = calloc(sc->n_objects + 1, sizeof(bool));
+  bool moved = false;
+  char line[4352], path[4096], cmd[16];
+  int lineno = 0, n = 0;
+  if (fp == NULL) {
+    perror(opt->frames);
+    exit(1);
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    float v[3];
+    int id;
+    ++lineno;
+    if (sscanf(line, "%15s", cmd) != 1 || cmd[0] == '#') {
+      continue;
+    }
+    if (strcmp(cmd, "pos") == 0
+        && sscanf(line, "%*s %d %f %f %f", &id, &v[0], &v[1], &v[2]) == 4
+        && 0 <= id && id < sc->n_objects) {
+      vecset(&sc->objects[id].xyz, v[0], v[1], v[2]);
+      moved = true;
+    } else if (strcmp(cmd, "rot") == 0
+               && sscanf(line, "%*s %d %f %f %f", &id, &v[0], &v[1], &v[2]) == 4
+               && 0 <= id && id < sc->n_objects) {
+      set_object_rotation(sc, id, v[0], v[1], v[2]);
+      rotated[id] = true;
+      moved = true;
+    } else if (strcmp(cmd, "frame") == 0 && sscanf(line, "%*s %4095s", path) == 1) {
+      double t0 = get_time();
+      if (moved) {
+        update_moved_objects(sc, opt, rotated);
+        moved = false;
+      }
+      if (out->sink < 0 && freopen(path, "wb", stdout) == NULL) {
+        perror(path);
+        exit(1);
+      }
+      render_view(sc, opt, ++n, out, count);
+      fflush(stdout);
+      if (opt->bench) {
+        fprintf(stderr, "frame %d (%s): %.3f s\n", n, path, get_time() - t0);
+      }
+    } else {
+      fprintf(stderr, "%s:%d: expected \"pos id x y z\", \"rot id a1 a2 a3\" or \"frame output.ppm\"\n",
+              opt->frames, lineno);
+      exit(1);
+    }
+  }
+  free(rotated);
+  fclose(fp);
+}
+
+/* レイトレの各ステップを行う関数を順次呼び出す */
+void rt (rt_opts_t *opt) {
+  scene_t *sc = create_scene();
+  ppm_writer_t out;
+  ray_count_t count;
+  double t0, wall;
+#ifdef RT_STATS
+  double t_init_dirvecs;
+#endif
+  sc->image_size[0] = opt->width;
+  sc->image_size[1] = opt->height;
+  sc->image_center[0] = opt->width / 2;
+  sc->image_center[1] = opt->height / 2;
+  /* ピクセルは正方形で、画像の横幅が 128 (元の 128x128 の画面の幅) になる */
+  sc->scan_pitch = 128.0 / float_of_int(opt->width);
+  sc->max_depth = opt->max_depth;
+  sc->energy_cutoff = opt->energy_cutoff;
+  sc->aa = opt->aa;
+  sc->aa_threshold = opt->aa_threshold;
+  read_parameter(sc);
+  if (opt->use_bvh != 0) {
+    build_bvh(sc, opt->use_bvh > 0);
+  }
+#ifdef RT_STATS
+  t_init_dirvecs = get_time();
+  init_dirvecs(sc);
+  t_init_dirvecs = get_time() - t_init_dirvecs;
+#else
+  init_dirvecs(sc);
+#endif
+  *d_vec(&sc->light_dirvec) = sc->light;
+  setup_dirvec_constants(sc, &sc->light_dirvec);
+  setup_reflections(sc, sc->n_objects - 1);
+  if (opt->light_map != LIGHT_MAP_NONE) {
+    build_light_map(sc, opt->light_map == LIGHT_MAP_FAST, opt->bench);
+  }
+  if (opt->irr_error > 0.0 || opt->irr_file != NULL) {
+    sc->irr_cache = create_irr_cache(opt->irr_error > 0.0 ? opt->irr_error : IRR_DEFAULT_ERROR);
+    sc->irr_cache->scene = scene_hash(sc);
+    if (opt->irr_file != NULL) {
+      load_irr_cache(sc->irr_cache, opt->irr_file);
+    }
+  }
+  if (opt->solver_bench) {
+    bench_solvers(sc);
+    free_scene(sc);
+    return;
+  }
+  init_ppm_writer(&out, sc, opt->binary, opt->hdr, opt->stream != NULL ? open_row_sink(opt->stream) : -1);
+  if (opt->bench) {
+    report_scene_memory(sc);
+  }
+  memset(&count, 0, sizeof(count));
+  t0 = get_time();
+  if (opt->frames != NULL) {
+    render_frames(sc, opt, &out, &count);
+  } else if (opt->views != NULL) {
+    render_views(sc, opt, &out, &count);
+  } else {
+    render_view(sc, opt, 0, &out, &count);
+  }
+  wall = get_time() - t0;
+  if (opt->bench) {
+    fprintf(stderr, "wall %.3f s, %lu rays, %.0f rays/s\n",
+            wall, count.n_rays, wall > 0.0 ? count.n_rays / wall : 0.0);
+    fprintf(stderr, "peak rss %ld KB\n", peak_rss_kb());
+    fprintf(stderr, "shadow: %lu tests, %lu shadowed, last occluder hit %lu (%.1f%% of shadowed)\n",
+            count.n_shadow, count.n_shadowed, count.n_cache_hits,
+            count.n_shadowed > 0 ? 100.0 * count.n_cache_hits / count.n_shadowed : 0.0);
+    if (sc->aa > 0) {
+      fprintf(stderr, "antialias: %lu edge pixels (%.1f%%), %lu new diffuse points\n",
+              count.n_aa_pixels, 100.0 * count.n_aa_pixels / ((double) sc->image_size[0] * sc->image_size[1]),
+              count.n_aa_diffuse);
+    }
+    if (sc->irr_cache != NULL) {
+      fprintf(stderr, "irradiance cache: %lu of %lu lookups interpolated, %d records\n",
+              count.n_irr_hits, count.n_irr_lookups, sc->irr_cache->n_records);
+    }
+    if (opt->light_map == LIGHT_MAP_FAST) {
+      fprintf(stderr, "shadow: %lu answered by light map cells (%.1f%% of tests)\n",
+              count.n_map_hits, count.n_shadow > 0 ? 100.0 * count.n_map_hits / count.n_shadow : 0.0);
+    }
+  }
+  fflush(stdout);
+#ifdef RT_STATS
+  print_stats_json(stderr, &count, opt->progressive != NULL ? 1 : opt->n_threads, t_init_dirvecs, wall);
+#endif
+  if (opt->irr_file != NULL) {
+    save_irr_cache(sc->irr_cache, opt->irr_file);
+  }
+  free_ppm_writer(&out);
+  free_scene(sc);
+}
+
+void usage(void) {
+  fprintf(stderr,
+          "usage: min-rt [options] < scene.(sld|bin) > image.ppm\n"
+          "  -w width -h height   image size (default 128x128)\n"
+          "  -i file  -o file     read the scene from / write the image to file\n"
+          "  -j threads           render with threads workers\n"
+          "  -tile size           split the image into size x size tiles\n"
+          "  -bvh | -nobvh        always / never use the BVH\n"
+          "  -depth n -cutoff e   follow up to n-1 mirror bounces while the weight\n"
+          "                       is above e (default 5 and 0.1)\n");
+  fprintf(stderr,
+          "  -lightmap strict|fast  test shadows with a light-space grid\n"
+          "  -irrcache error      reuse diffuse samples within error (e.g. 0.3)\n"
+          "  -irrfile file        load/save the irradiance cache (implies -irrcache 0.3)\n"
+          "  -progressive prefix  also write prefix-1.ppm (direct light only) and\n"
+          "                       prefix-2.ppm (20%% of diffuse rays), single thread;\n"
+          "                       prefix-N-1.ppm etc. for the N-th -views/-frames image\n");
+  fprintf(stderr,
+          "  -views file          render one image per line \"x y z angle1 angle2 out.ppm\"\n"
+          "  -frames file         move objects (\"pos id x y z\", \"rot id a1 a2 a3\") and\n"
+          "                       render (\"frame out.ppm\") as listed in file (not with -views)\n"
+          "  -aa n                add n x n rays to pixels on edges (adaptive antialiasing)\n"
+          "  -aathreshold t       color difference that makes an edge (default 16)\n");
+  fprintf(stderr,
+          "  -stream unix:path|file|-  send each P6 row framed with its row number\n"
+          "                       to a UNIX socket, a file or pipe, or stdout\n"
+          "  -hdr pfm|tiled       write linear float RGB (255 -> 1.0) as PFM or as\n"
+          "                       PFM-like 64x64 tiles instead of PPM (not with -stream)\n");
+  fprintf(stderr,
+          "  -solverbench         time the solvers of each shape, no image\n"
+          "  -p6                  write binary PPM\n"
+          "  -bench               report timings to stderr\n");
+  exit(1);
+}
+
+/* argv[i] の次の引数を正の整数として読む */
+int positive_arg(int argc, char **argv, int *i) {
+  int n;
+  if (*i + 1 >= argc) {
+    usage();
+  }
+  n = atoi(argv[++*i]);
+  if (n < 1) {
+    usage();
+  }
+  return n;
+}
+
+int main(int argc, char **argv) {
+  rt_opts_t opt;
+  int i;
+
+  opt.width = 128;
+  opt.height = 128;
+  opt.n_threads = 1;
+  opt.tile_size = 0;
+  opt.use_bvh = -1;
+  opt.light_map = LIGHT_MAP_NONE;
+  opt.max_depth = DEFAULT_MAX_DEPTH;
+  opt.energy_cutoff = DEFAULT_ENERGY_CUTOFF;
+  opt.aa = 0;
+  opt.aa_threshold = DEFAULT_AA_THRESHOLD;
+  opt.irr_error = 0.0;
+  opt.irr_file = NULL;
+  opt.progressive = NULL;
+  opt.views = NULL;
+  opt.frames = NULL;
+  opt.stream = NULL;
+  opt.hdr = HDR_NONE;
+  opt.solver_bench = false;
+  opt.binary = false;
+  opt.bench = false;
+  opt.input = NULL;
+  opt.output = NULL;
+
+  for (i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-w") == 0) {
+      opt.width = positive_arg(argc, argv, &i);
+    } else if (strcmp(argv[i], "-h") == 0) {
+      opt.height = positive_arg(argc, argv, &i);
+    } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+      opt.input = argv[++i];
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      opt.output = argv[++i];
+    } else if (strcmp(argv[i], "-j") == 0) {
+      opt.n_threads = positive_arg(argc, argv, &i);
+    } else if (strcmp(argv[i], "-tile") == 0) {
+      opt.tile_size = positive_arg(argc, argv, &i);
+    } else if (strcmp(argv[i], "-bvh") == 0) {
+      opt.use_bvh = 1;
+    } else if (strcmp(argv[i], "-nobvh") == 0) {
+      opt.use_bvh = 0;
+    } else if (strcmp(argv[i], "-lightmap") == 0 && i + 1 < argc) {
+      ++i;
+      if (strcmp(argv[i], "strict") == 0) {
+        opt.light_map = LIGHT_MAP_STRICT;
+      } else if (strcmp(argv[i], "fast") == 0) {
+        opt.light_map = LIGHT_MAP_FAST;
+      } else {
+        usage();
+      }
+    } else if (strcmp(argv[i], "-depth") == 0) {
+      opt.max_depth = positive_arg(argc, argv, &i);
+    } else if (strcmp(argv[i], "-cutoff") == 0 && i + 1 < argc) {
+      opt.energy_cutoff = atof(argv[++i]);
+      if (!(opt.energy_cutoff >= 0.0)) {
+        usage();
+      }
+    } else if (strcmp(argv[i], "-aa") == 0 && i + 1 < argc) {
+      opt.aa = positive_arg(argc, argv, &i);
+    } else if (strcmp(argv[i], "-aathreshold") == 0 && i + 1 < argc) {
+      opt.aa_threshold = atof(argv[++i]);
+      if (!(opt.aa_threshold >= 0.0)) {
+        usage();
+      }
+    } else if (strcmp(argv[i], "-irrcache") == 0 && i + 1 < argc) {
+      opt.irr_error = atof(argv[++i]);
+      if (!(opt.irr_error > 0.0)) {
+        usage();
+      }
+    } else if (strcmp(argv[i], "-irrfile") == 0 && i + 1 < argc) {
+      opt.irr_file = argv[++i];
+    } else if (strcmp(argv[i], "-progressive") == 0 && i + 1 < argc) {
+      opt.progressive = argv[++i];
+    } else if (strcmp(argv[i], "-hdr") == 0 && i + 1 < argc) {
+      ++i;
+      if (strcmp(argv[i], "pfm") == 0) {
+        opt.hdr = HDR_PFM;
+      } else if (strcmp(argv[i], "tiled") == 0) {
+        opt.hdr = HDR_TILED;
+      } else {
+        usage();
+      }
+    } else if (strcmp(argv[i], "-stream") == 0 && i + 1 < argc) {
+      opt.stream = argv[++i];
+    } else if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc) {
+      opt.frames = argv[++i];
+    } else if (strcmp(argv[i], "-views") == 0 && i + 1 < argc) {
+      opt.views = argv[++i];
+    } else if (strcmp(argv[i], "-solverbench") == 0) {
+      opt.solver_bench = true;
+    } else if (strcmp(argv[i], "-p6") == 0) {
+      opt.binary = true;
+    } else if (strcmp(argv[i], "-bench") == 0) {
+      opt.bench = true;
+    } else {
+      usage();
+    }
+  }
+  if (opt.hdr != HDR_NONE && opt.stream != NULL) {
+    usage();
+  }
+  if (opt.frames != NULL && opt.views != NULL) {
+    usage();
+  }
+
+  /* シーンは read_parameter が標準入力から読み、画像は標準出力へ書くので付け替える */
+  if (opt.input != NULL && freopen(opt.input, "rb", stdin) == NULL) {
+    perror(opt.input);
+    return 1;
+  }
+  if (opt.output != NULL && freopen(opt.output, "wb", stdout) == NULL) {
+    perror(opt.output);
+    return 1;
   }
 
-  rt(128, 128);
+  rt(&opt);
 
   return 0;
 }
@@ -0,0 +1,296 @@
+/*****************************************************************************
+ * SLD Reader : shared by conv and min-rt
+ *
+ * The SLD text is parsed from a memory buffer into its binary image: one
+ * 32-bit word (int or float) per number, in file order.  This is exactly what
+ * conv writes out and what min-rt reads in.
+ ****************************************************************************/
+#ifndef SLD_H
+#define SLD_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* for SLD tata stream */
+typedef union {
+  int i;
+  float f;
+} fi_union;
+
+/* the whole input file, mapped or read into memory */
+typedef struct {
+  const char* data;
+  size_t len;
+  int mapped;  /* 1 : data is mmap'ed, 0 : data is malloc'ed */
+} sld_buffer;
+
+/* state of the SLD text parser */
+typedef struct {
+  const char* p;    /* current position in the text */
+  const char* end;  /* end of the text */
+  fi_union* words;  /* the binary image of the SLD data (grown on demand) */
+  unsigned n_words;
+  unsigned max_words;
+} sld_reader;
+
+/* longest number token we accept */
+#define SLD_TOKEN_MAX 64
+
+/*-----------------------------------------------------------------------------
+ * map the file fd into memory.  Pipes and terminals can not be mapped, so
+ * they are read into a malloc'ed buffer instead.
+ * RETURN value : 0 on success, -1 on failure
+ */
+static int sld_load_buffer(int fd, sld_buffer* b)
+{
+  struct stat st;
+  size_t cap;
+  char* p;
+
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0){
+    void* m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(m != MAP_FAILED){
+      b->data = m;
+      b->len = (size_t)st.st_size;
+      b->mapped = 1;
+      return 0;
+    }
+  }
+
+  cap = 1 << 16;
+  p = malloc(cap);
+  b->len = 0;
+  for(;;){
+    ssize_t n;
+    if(p == NULL){
+      return -1;
+    }
+    if(b->len == cap){
+      char* q = realloc(p, cap * 2);
+      if(q == NULL){
+        free(p);
+        return -1;
+      }
+      p = q;
+      cap *= 2;
+    }
+    n = read(fd, p + b->len, cap - b->len);
+    if(n < 0){
+      free(p);
+      return -1;
+    }
+    if(n == 0){
+      break;
+    }
+    b->len += (size_t)n;
+  }
+  b->data = p;
+  b->mapped = 0;
+  return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * release a buffer made by sld_load_buffer
+ */
+static void sld_free_buffer(sld_buffer* b)
+{
+  if(b->mapped){
+    munmap((void*)b->data, b->len);
+  }else{
+    free((void*)b->data);
+  }
+  b->data = NULL;
+  b->len = 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * tell the SLD text from its binary image : the text consists only of
+ * numbers and white spaces, which a binary image practically never does
+ * (the terminators -1 are 0xffffffff).
+ */
+static int sld_is_text(const sld_buffer* b)
+{
+  size_t u;
+  for(u = 0; u < b->len; u++){
+    char c = b->data[u];
+    if(!isspace((unsigned char)c) && !isdigit((unsigned char)c) &&
+       (c == '\0' || strchr("+-.eE", c) == NULL)){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*-----------------------------------------------------------------------------
+ * make room for one more word in r->words.
+ */
+static void sld_reserve_word(sld_reader* r)
+{
+  if(r->n_words >= r->max_words){
+    unsigned n = r->max_words ? r->max_words * 2 : 4096;
+    fi_union* p = realloc(r->words, n * sizeof(fi_union));
+    if(p == NULL){
+      fprintf(stderr, "sld_reserve_word : out of memory (%u sld words).\n",
+              r->n_words);
+      exit(1);
+    }
+    r->words = p;
+    r->max_words = n;
+  }
+}
+
+/*-----------------------------------------------------------------------------
+ * skip white spaces and copy the next token into buf (NUL-terminated).
+ * RETURN value : the start of the token in the text
+ */
+static const char* sld_token(sld_reader* r, char* buf)
+{
+  const char* s;
+  int n = 0;
+  while(r->p < r->end && isspace((unsigned char)*r->p)){
+    r->p++;
+  }
+  s = r->p;
+  while(s + n < r->end && n < SLD_TOKEN_MAX - 1 &&
+        !isspace((unsigned char)s[n])){
+    buf[n] = s[n];
+    n++;
+  }
+  buf[n] = '\0';
+  return s;
+}
+
+/*-----------------------------------------------------------------------------
+ * read a float in the SLD text and append it to r->words.
+ * RETURN value : the float read from the text
+ */
+static float sld_read_float(sld_reader* r)
+{
+  char buf[SLD_TOKEN_MAX];
+  char* e;
+  const char* s = sld_token(r, buf);
+  float f = strtof(buf, &e);
+
+  if(e == buf){
+    fprintf(stderr, "failed to read a float\n");
+    exit(1);
+  }
+  r->p = s + (e - buf);
+
+  sld_reserve_word(r);
+  return (r->words[r->n_words++].f = f);
+}
+
+/*-----------------------------------------------------------------------------
+ * read an integer in the SLD text and append it to r->words.
+ * RETURN value : the integer read from the text
+ */
+static int sld_read_int(sld_reader* r)
+{
+  char buf[SLD_TOKEN_MAX];
+  char* e;
+  const char* s = sld_token(r, buf);
+  int i = (int)strtol(buf, &e, 10);
+
+  if(e == buf){
+    fprintf(stderr, "failed to read an int\n");
+    exit(1);
+  }
+  r->p = s + (e - buf);
+
+  sld_reserve_word(r);
+  return (r->words[r->n_words++].i = i);
+}
+
+/*-----------------------------------------------------------------------------
+ * read a 3D float vector and append it to r->words.
+ */
+static void sld_read_vec3(sld_reader* r)
+{
+  sld_read_float(r);
+  sld_read_float(r);
+  sld_read_float(r);
+}
+
+/*-----------------------------------------------------------------------------
+ * read the scene environments
+ */
+static void sld_read_env(sld_reader* r)
+{
+  /* screen pos */
+  sld_read_vec3(r);
+  /* screen rotation */
+  sld_read_float(r);  sld_read_float(r);
+  /* n_lights : Actually, it should be an int value ! */
+  sld_read_float(r);
+  /* light rotation */
+  sld_read_float(r);  sld_read_float(r);
+  /* beam  */
+  sld_read_float(r);
+}
+
+/*-----------------------------------------------------------------------------
+ * read all the objects
+ */
+static void sld_read_objects(sld_reader* r)
+{
+  while (sld_read_int(r) != -1) {  /* texture : -1 -> end */
+    int is_rot;
+    /* form */
+    sld_read_int(r);
+    /* refltype */
+    sld_read_int(r);
+    /* isrot_p*/
+    is_rot = sld_read_int(r);
+    /* abc */
+    sld_read_vec3(r);
+    /* xyz */
+    sld_read_vec3(r);
+    /* is_invert */
+    sld_read_float(r);
+    /* refl_param */
+    sld_read_float(r); sld_read_float(r);
+    /* color */
+    sld_read_vec3(r);
+    /* rot */
+    if(is_rot){
+      sld_read_vec3(r);
+    }
+  }
+}
+
+/*-----------------------------------------------------------------------------
+ * read the AND-network or the OR-network
+ */
+static void sld_read_network(sld_reader* r)
+{
+  while(sld_read_int(r) != -1){
+    while(sld_read_int(r) != -1);
+  }
+}
+
+/*-----------------------------------------------------------------------------
+ * parse the whole SLD text in b into r->words.
+ * r->words must be freed by the caller.
+ */
+static void sld_read_text(sld_reader* r, const sld_buffer* b)
+{
+  r->p = b->data;
+  r->end = b->data + b->len;
+  r->words = NULL;
+  r->n_words = 0;
+  r->max_words = 0;
+
+  sld_read_env(r);
+  sld_read_objects(r);
+  sld_read_network(r);  /* AND-network */
+  sld_read_network(r);  /* OR-network */
+}
+
+#endif /* SLD_H */
@@ -0,0 +1,160 @@
+/*****************************************************************************
+ * Stream Sink : a dummy consumer of `min-rt -stream`
+ *
+ * Receives the framed rows that min-rt sends with -stream, checks that the
+ * row numbers come in order, and writes the images back as P6 PPM files to
+ * stdout.  The frames are an 8-byte header (the row number and the length
+ * of the data, both 32-bit big-endian) followed by the data.  Row number -1
+ * carries the PPM header of a new image.
+ *
+ * usage: stream-sink [-d usec] socket_path|- > image.ppm
+ *   socket_path : listen on this UNIX domain socket and serve one client
+ *   -           : read the frames from stdin (a pipe or a file)
+ *   -d usec     : sleep usec micro seconds per row (a slow encoder)
+ ****************************************************************************/
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*-----------------------------------------------------------------------------
+ * read exactly n bytes.
+ * RETURN value : 1 on success, 0 at the end of the stream before any byte
+ */
+static int read_all(int fd, void* buf, size_t n)
+{
+  char* p = buf;
+  size_t got = 0;
+  while(got < n){
+    ssize_t k = read(fd, p + got, n - got);
+    if(k < 0 && errno == EINTR){
+      continue;
+    }
+    if(k < 0){
+      perror("stream-sink: read");
+      exit(1);
+    }
+    if(k == 0){
+      if(got == 0){
+        return 0;
+      }
+      fprintf(stderr, "stream-sink: truncated frame\n");
+      exit(1);
+    }
+    got += (size_t)k;
+  }
+  return 1;
+}
+
+/*-----------------------------------------------------------------------------
+ * listen on the UNIX domain socket path and accept one client.
+ * The socket is bound under a temporary name and renamed when it is ready,
+ * so the sender can connect as soon as path exists.
+ * RETURN value : the connected socket
+ */
+static int accept_one(const char* path)
+{
+  struct sockaddr_un addr;
+  int s, c;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) + 4 >= sizeof(addr.sun_path)){
+    fprintf(stderr, "stream-sink: socket path too long\n");
+    exit(1);
+  }
+  sprintf(addr.sun_path, "%s.tmp", path);
+  unlink(addr.sun_path);
+  s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(s < 0 || bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+     listen(s, 1) != 0 || rename(addr.sun_path, path) != 0){
+    perror(path);
+    exit(1);
+  }
+  c = accept(s, NULL, NULL);
+  if(c < 0){
+    perror("stream-sink: accept");
+    exit(1);
+  }
+  close(s);
+  unlink(path);
+  return c;
+}
+
+int main(int argc, char* argv[])
+{
+  long delay = 0;
+  int fd, width = 0, height = 0, next = 0, n_images = 0;
+  unsigned char* data = NULL;
+  size_t cap = 0;
+  unsigned char head[8];
+
+  if(argc == 4 && strcmp(argv[1], "-d") == 0){
+    delay = atol(argv[2]);
+    argv += 2;
+    argc -= 2;
+  }
+  if(argc != 2){
+    fprintf(stderr, "usage: stream-sink [-d usec] socket_path|- > image.ppm\n");
+    return 2;
+  }
+  fd = strcmp(argv[1], "-") == 0 ? 0 : accept_one(argv[1]);
+
+  while(read_all(fd, head, 8)){
+    int y = (int)((unsigned)head[0] << 24 | (unsigned)head[1] << 16 |
+                  (unsigned)head[2] << 8 | head[3]);
+    size_t n = (size_t)head[4] << 24 | (size_t)head[5] << 16 |
+               (size_t)head[6] << 8 | head[7];
+    if(n + 1 > cap){
+      cap = n + 1;
+      data = realloc(data, cap);
+      if(data == NULL){
+        fprintf(stderr, "stream-sink: out of memory\n");
+        return 1;
+      }
+    }
+    read_all(fd, data, n);
+
+    if(y == -1){
+      /* a new image : the previous one must be complete */
+      if(next != height){
+        fprintf(stderr, "stream-sink: image %d has %d of %d rows\n",
+                n_images, next, height);
+        return 1;
+      }
+      data[n] = '\0';
+      if(sscanf((char*)data, "P6 %d %d 255", &width, &height) != 2){
+        fprintf(stderr, "stream-sink: bad header\n");
+        return 1;
+      }
+      next = 0;
+      n_images++;
+    }else if(n_images == 0 || y != next || n != (size_t)width * 3){
+      fprintf(stderr, "stream-sink: unexpected row %d (%lu bytes), expected %d\n",
+              y, (unsigned long)n, next);
+      return 1;
+    }else{
+      next++;
+      if(delay > 0){
+        struct timespec ts;
+        ts.tv_sec = delay / 1000000;
+        ts.tv_nsec = delay % 1000000 * 1000;
+        nanosleep(&ts, NULL);
+      }
+    }
+    fwrite(data, 1, n, stdout);
+  }
+
+  if(n_images == 0 || next != height){
+    fprintf(stderr, "stream-sink: stream ended at row %d of %d\n", next, height);
+    return 1;
+  }
+  free(data);
+  return 0;
+}
@@ -0,0 +1,54 @@
+#!/bin/bash
+# -irrfile の試験。放射照度キャッシュを保存したファイルを次の実行で
+# 読み込めること (別のシーンのものとして捨てられないこと、-frames で物体を
+# 動かしても読み込んだシーンの記録を書くこと) と、別のシーンのキャッシュは
+# 捨てられることを、通常のビルドと -O2 のビルドで確かめる
+#
+# usage: test-irrfile.sh [min-rt options]
+make min-rt min-rt-bench || exit 1
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+bad=0
+
+for bin in ./min-rt ./min-rt-bench; do
+    for i in ./origin/sld/contest.sld ./origin/sld/shuttle.sld; do
+        g=$(basename "$i" .sld)
+        rm -f "$tmp/cache.irr"
+        "$bin" "$@" -irrfile "$tmp/cache.irr" -i "$i" -o "$tmp/1.ppm" < /dev/null 2> "$tmp/err1"
+        "$bin" "$@" -irrfile "$tmp/cache.irr" -i "$i" -o "$tmp/2.ppm" < /dev/null 2> "$tmp/err2"
+        if [ -s "$tmp/cache.irr" ] && ! grep -q "ignored" "$tmp/err1" "$tmp/err2"; then
+            echo "$bin $g reload: ok"
+        else
+            echo "$bin $g reload: FAILED"
+            cat "$tmp/err1" "$tmp/err2"
+            bad=1
+        fi
+    done
+    # -frames では、初めて物体を動かす前 (最初のフレーム) までの記録を書く。
+    # 最初のフレームはシーンのままなので、通常の描画で書いたものと一致し、
+    # 次の実行で読み込める
+    printf 'frame %s/f1.ppm\npos 0 0 30 45\nframe %s/f2.ppm\n' "$tmp" "$tmp" > "$tmp/frames.txt"
+    rm -f "$tmp/plain.irr" "$tmp/frames.irr"
+    "$bin" "$@" -irrfile "$tmp/plain.irr" -i ./origin/sld/contest.sld -o "$tmp/1.ppm" < /dev/null
+    "$bin" "$@" -irrfile "$tmp/frames.irr" -frames "$tmp/frames.txt" -i ./origin/sld/contest.sld < /dev/null
+    cmp -s "$tmp/plain.irr" "$tmp/frames.irr"
+    same=$?
+    "$bin" "$@" -irrfile "$tmp/frames.irr" -frames "$tmp/frames.txt" -i ./origin/sld/contest.sld < /dev/null 2> "$tmp/err1"
+    if [ -s "$tmp/plain.irr" ] && [ $same = 0 ] && ! grep -q "ignored" "$tmp/err1"; then
+        echo "$bin frames reload: ok"
+    else
+        echo "$bin frames reload: FAILED"
+        cat "$tmp/err1"
+        bad=1
+    fi
+    # 最後に保存した shuttle のキャッシュは contest の描画に使わない
+    "$bin" "$@" -irrfile "$tmp/cache.irr" -i ./origin/sld/contest.sld -o "$tmp/1.ppm" < /dev/null 2> "$tmp/err1"
+    if grep -q "ignored" "$tmp/err1"; then
+        echo "$bin other scene: ok"
+    else
+        echo "$bin other scene: FAILED"
+        bad=1
+    fi
+done
+exit $bad
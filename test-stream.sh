@@ -0,0 +1,59 @@
+#!/bin/bash
+# -stream の試験。ダミーの受け手 stream-sink に UNIX ドメインソケットと
+# パイプでラインを送り、受け手が組み立てた画像が -p6 の通常の出力と
+# 一致することを確かめる。受け手は1ラインごとに待つので、送り手は
+# 書き込みで待たされる (背圧がかかる)
+#
+# usage: test-stream.sh [min-rt options]
+make min-rt stream-sink || exit 1
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+bad=0
+
+for i in ./origin/sld/contest.sld ./origin/sld/shuttle.sld; do
+    g=$(basename "$i" .sld)
+    ./min-rt -p6 "$@" -i "$i" -o "$tmp/ref.ppm" < /dev/null || exit 1
+    for mode in "" "-j 4" "-tile 16 -j 4"; do
+        ./stream-sink -d 200 "$tmp/sock" > "$tmp/out.ppm" &
+        pid=$!
+        while [ ! -S "$tmp/sock" ]; do
+            kill -0 $pid 2> /dev/null || break
+            sleep 0.01
+        done
+        ./min-rt $mode "$@" -stream "unix:$tmp/sock" -i "$i" < /dev/null
+        if wait $pid && cmp -s "$tmp/out.ppm" "$tmp/ref.ppm"; then
+            echo "$g socket $mode: ok"
+        else
+            echo "$g socket $mode: FAILED"
+            bad=1
+        fi
+    done
+    if ./min-rt "$@" -stream - -i "$i" < /dev/null | ./stream-sink - > "$tmp/out.ppm" \
+            && cmp -s "$tmp/out.ppm" "$tmp/ref.ppm"; then
+        echo "$g pipe: ok"
+    else
+        echo "$g pipe: FAILED"
+        bad=1
+    fi
+done
+
+# -views と -frames では画像を全て送り先に送り、出力ファイルを作らない
+mkdir "$tmp/files"
+printf -- '-70 35 -20 20 30 %s/files/v1.ppm\n0 35 -20 20 30 %s/files/v2.ppm\n' "$tmp" "$tmp" > "$tmp/views.txt"
+printf 'frame %s/files/f1.ppm\npos 0 0 30 45\nframe %s/files/f2.ppm\n' "$tmp" "$tmp" > "$tmp/frames.txt"
+for list in views frames; do
+    ./min-rt -p6 "$@" -$list "$tmp/$list.txt" -i ./origin/sld/contest.sld < /dev/null || exit 1
+    cat "$tmp"/files/* > "$tmp/ref.ppm"
+    rm -f "$tmp"/files/*
+    if ./min-rt "$@" -$list "$tmp/$list.txt" -stream - -i ./origin/sld/contest.sld < /dev/null \
+            | ./stream-sink - > "$tmp/out.ppm" \
+            && cmp -s "$tmp/out.ppm" "$tmp/ref.ppm" && [ -z "$(ls "$tmp/files")" ]; then
+        echo "contest -$list pipe: ok"
+    else
+        echo "contest -$list pipe: FAILED"
+        ls -l "$tmp/files"
+        bad=1
+    fi
+done
+exit $bad
@@ -8,3 +8,5 @@ do
     ./conv <$f.sld >./test/$g.bin
     ./min-rt <./test/$g.bin >./test/$g.ppm
 done
+./test-stream.sh
+./test-irrfile.sh